@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "barrier.h"
+#include "sq.h"
+#include "sq_numa.h"
+#include "sq_wait.h"
+
+/*
+ * sq benchmark
+ * sweeps queue mode, producer/consumer counts, payload size and maxlen and writes one CSV line
+ * per run to stdout: throughput, end-to-end latency percentiles (push() to pop(), measured with
+ * CLOCK_MONOTONIC) and a few of the queue's own counters. `make bench` runs the full sweep and
+ * leaves the results in bench.csv.
+ *
+ * usage: sq_bench [-n msgs] [-q] [-u] [-c cpu,cpu,...] [-s spin[,yield]] [-N]
+ *     -n msgs    messages per run, split between the producers (default 200000)
+ *     -q         quick sweep, fewer combinations
+ *     -u         don't pin threads to CPUs
+ *     -c cpus    pin the producers and then the consumers to these CPUs in turn instead of
+ *                0, 1, 2, ... e.g. -c 0,8 puts a 1x1 run's producer and consumer on CPUs 0
+ *                and 8, which is the way to compare layouts across sockets
+ *     -s n,m     adaptive waits: poll n times spinning and then m times yielding before going
+ *                to sleep (sq_attr_t spin and yield); -s -1 only ever spins
+ *     -N         put each queue on its first consumer's NUMA node, with a pool big enough for
+ *                the payload so the elements and their data are there too
+ */
+
+#define BENCH_MSGS		200000
+#define BENCH_POP_NS		(1000 * 1000ULL)	/* how long consumers wait before checking for the end of a run */
+
+/* queue modes to sweep */
+static const struct {
+	const char *name;
+	unsigned int flags;
+	unsigned int max_producers;		/* most producers the mode allows */
+	unsigned int max_consumers;		/* most consumers the mode allows */
+} modes[] = {
+	{ "list",	SQ_FLAG_NONE,	~0U,	~0U },
+	{ "ring",	SQ_FLAG_RING,	~0U,	~0U },
+	{ "spsc",	SQ_FLAG_SPSC,	1,	1 },
+	{ "mpsc",	SQ_FLAG_MPSC,	~0U,	1 },
+};
+
+/* producer and consumer counts, payload sizes (0 is a pointer payload, otherwise VOLATILE) and maxlens */
+static const unsigned int threads_full[] = { 1, 2, 4 }, threads_quick[] = { 1, 4 };
+static const unsigned int payloads_full[] = { 0, 16, 256, 4096 }, payloads_quick[] = { 0, 256 };
+static const int maxlens_full[] = { 64, 4096 }, maxlens_quick[] = { 1024 };
+
+#define NUM(a)			(sizeof(a) / sizeof((a)[0]))
+
+/* -c: CPUs to pin the threads to, in order */
+static unsigned int cpus[256], num_cpus;
+
+/* queue attributes for every run, -s sets the adaptive waits */
+static sq_attr_t attr;
+
+/* -N: place queues on their consumer's node */
+static int numa;
+
+/* one benchmark run */
+typedef struct {
+	sq_t *q;
+	unsigned int producers, consumers;
+	unsigned int payload;
+	unsigned int msgs;			/* messages per producer */
+	int pin;
+	pthread_barrier_t start;
+	unsigned long long t_start;		/* when the producers were let go */
+	int stop;				/* set once every producer is done */
+} run_t;
+
+/* per-thread state */
+typedef struct {
+	run_t *r;
+	pthread_t tid;
+	unsigned int cpu;
+	unsigned long long *lat;		/* consumers: latency of every message popped */
+	unsigned long long n;			/* consumers: number of messages popped */
+	unsigned long long t_last;		/* consumers: when the last message was popped */
+} worker_t;
+
+
+/* pins the calling thread to a cpu, if we know how */
+static void pin_cpu(unsigned int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	long ncpu;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		ncpu = 1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % ncpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)cpu;
+#endif
+}
+
+
+/* pushes r->msgs timestamped messages */
+static void *producer(void *arg)
+{
+	worker_t *w = arg;
+	run_t *r = w->r;
+	unsigned long long ts;
+	unsigned int i;
+	sq_elem_t e;
+	char *buf;
+
+	if (r->pin) {
+		pin_cpu(w->cpu);
+	}
+
+	if ((buf = calloc(1, r->payload ? r->payload : 1)) == NULL) {
+		return NULL;
+	}
+
+	memset(&e, 0, sizeof(e));
+	pthread_barrier_wait(&r->start);
+
+	for (i = 0; i < r->msgs; i++) {
+		ts = sq_now_ns();
+
+		/* VOLATILE payloads carry the timestamp in their first 8 bytes, pointer payloads are the timestamp */
+		if (r->payload) {
+			memcpy(buf, &ts, sizeof(ts));
+			e.data = buf;
+			e.dlen = r->payload;
+			e.flags = SQ_FLAG_VOLATILE;
+
+		} else {
+			e.data = (void *)(uintptr_t)ts;
+			e.dlen = 0;
+			e.flags = SQ_FLAG_NONE;
+		}
+
+		while (sq_push(r->q, &e) == SQ_ERR_WOULDBLOCK) ;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+
+/* pops until the producers are done and the queue is empty, recording the latency of each message */
+static void *consumer(void *arg)
+{
+	worker_t *w = arg;
+	run_t *r = w->r;
+	unsigned long long ts, t;
+	sq_elem_t *e;
+	int ret;
+
+	if (r->pin) {
+		pin_cpu(w->cpu);
+	}
+
+	pthread_barrier_wait(&r->start);
+
+	for (;;) {
+		if ((ret = sq_pop_timed(r->q, &e, BENCH_POP_NS)) != SQ_ERR_NO_ERROR) {
+			if ((ret == SQ_ERR_TIMEOUT || ret == SQ_ERR_EMPTY) && __atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+
+			continue;
+		}
+
+		t = sq_now_ns();
+		if (r->payload) {
+			memcpy(&ts, e->data, sizeof(ts));
+
+		} else {
+			ts = (uintptr_t)e->data;
+		}
+
+		w->lat[w->n++] = t - ts;
+		w->t_last = t;
+		sq_elem_release(e);
+	}
+
+	return NULL;
+}
+
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+/* returns the p'th (0..1) percentile of sorted samples */
+static unsigned long long percentile(const unsigned long long *s, unsigned long long n, double p)
+{
+	unsigned long long i;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	i = (unsigned long long)(p * (n - 1) + 0.5);
+	return s[i < n ? i : n - 1];
+}
+
+
+/*
+ * does one run and prints its CSV line
+ *
+ * returns 0 on success, -1 if the run couldn't be set up
+ */
+static int bench_run(unsigned int mode, unsigned int producers, unsigned int consumers, unsigned int payload, int maxlen, unsigned int msgs, int pin)
+{
+	run_t r;
+	sq_attr_t q_attr;
+	worker_t *w;
+	sq_stats_t st;
+	unsigned long long *all, n, t_end;
+	unsigned int i, nw, flags;
+	const char *pattern;
+	double secs;
+
+	memset(&r, 0, sizeof(r));
+	r.producers = producers;
+	r.consumers = consumers;
+	r.payload = payload;
+	r.msgs = msgs / producers;
+	r.pin = pin;
+
+	/* the consumers come after the producers in the -c list */
+	q_attr = attr;
+	flags = modes[mode].flags;
+	if (numa) {
+		q_attr.numa_node = sq_numa_node_of_cpu(num_cpus ? cpus[producers % num_cpus] : producers);
+		q_attr.pool_dlen = payload;
+		flags |= SQ_FLAG_POOL;
+	}
+
+	if ((r.q = sq_init_attr(modes[mode].name, NULL, maxlen, flags, &q_attr)) == NULL) {
+		return -1;
+	}
+
+	nw = producers + consumers;
+	if ((w = calloc(nw, sizeof(*w))) == NULL) {
+		return -1;
+	}
+
+	for (i = producers; i < nw; i++) {
+		if ((w[i].lat = malloc((unsigned long long)r.msgs * producers * sizeof(*w[i].lat))) == NULL) {
+			return -1;
+		}
+	}
+
+	pthread_barrier_init(&r.start, NULL, nw + 1);
+	for (i = 0; i < nw; i++) {
+		w[i].r = &r;
+		w[i].cpu = num_cpus ? cpus[i % num_cpus] : i;
+		pthread_create(&w[i].tid, NULL, i < producers ? producer : consumer, &w[i]);
+	}
+
+	pthread_barrier_wait(&r.start);
+	r.t_start = sq_now_ns();
+
+	for (i = 0; i < producers; i++) {
+		pthread_join(w[i].tid, NULL);
+	}
+
+	__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+
+	/* gather up every consumer's latencies */
+	n = 0;
+	t_end = r.t_start;
+	all = w[producers].lat;
+	for (i = producers; i < nw; i++) {
+		pthread_join(w[i].tid, NULL);
+		if (w[i].n && w[i].t_last > t_end) {
+			t_end = w[i].t_last;
+		}
+
+		if (i > producers) {
+			memcpy(all + n, w[i].lat, w[i].n * sizeof(*all));
+		}
+
+		n += w[i].n;
+	}
+
+	qsort(all, n, sizeof(*all), cmp_ull);
+	sq_stats(r.q, &st);
+
+	if (producers == 1) {
+		pattern = consumers == 1 ? "spsc" : "spmc";
+
+	} else {
+		pattern = consumers == 1 ? "mpsc" : "mpmc";
+	}
+
+	secs = (t_end - r.t_start) / 1e9;
+	printf("%s,%s,%u,%u,%s,%u,%u,%llu,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu,%u\n",
+		modes[mode].name, pattern, producers, consumers, payload ? "volatile" : "pointer", payload, r.q->maxlen, n,
+		secs, secs > 0 ? n / secs : 0, percentile(all, n, 0.5), percentile(all, n, 0.99), percentile(all, n, 0.999),
+		st.drops, st.blocked, st.hwm);
+	fflush(stdout);
+
+	pthread_barrier_destroy(&r.start);
+	sq_destroy(r.q);
+	for (i = producers; i < nw; i++) {
+		free(w[i].lat);
+	}
+
+	free(w);
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	const unsigned int *threads, *payloads;
+	const int *maxlens;
+	unsigned int num_threads, num_payloads, num_maxlens;
+	unsigned int m, p, c, s, l, msgs;
+	int opt, pin, quick;
+	char *tok;
+
+	sq_attr_init(&attr);
+	msgs = BENCH_MSGS;
+	pin = 1;
+	quick = 0;
+	while ((opt = getopt(argc, argv, "n:quc:s:N")) != -1) {
+		switch (opt) {
+		case 'n':
+			msgs = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'q':
+			quick = 1;
+			break;
+
+		case 'u':
+			pin = 0;
+			break;
+
+		case 'c':
+			for (tok = strtok(optarg, ","); tok && num_cpus < NUM(cpus); tok = strtok(NULL, ",")) {
+				cpus[num_cpus++] = strtoul(tok, NULL, 0);
+			}
+			break;
+
+		case 's':
+			attr.spin = strtoul(optarg, &tok, 0);
+			if (*tok == ',') {
+				attr.yield = strtoul(tok + 1, NULL, 0);
+			}
+			break;
+
+		case 'N':
+			numa = 1;
+			break;
+
+		default:
+			fprintf(stderr, "usage: %s [-n msgs] [-q] [-u] [-c cpu,cpu,...] [-s spin[,yield]] [-N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (quick) {
+		threads = threads_quick;
+		num_threads = NUM(threads_quick);
+		payloads = payloads_quick;
+		num_payloads = NUM(payloads_quick);
+		maxlens = maxlens_quick;
+		num_maxlens = NUM(maxlens_quick);
+
+	} else {
+		threads = threads_full;
+		num_threads = NUM(threads_full);
+		payloads = payloads_full;
+		num_payloads = NUM(payloads_full);
+		maxlens = maxlens_full;
+		num_maxlens = NUM(maxlens_full);
+	}
+
+	printf("mode,pattern,producers,consumers,payload,payload_bytes,maxlen,msgs,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,drops,blocked,hwm\n");
+
+	for (m = 0; m < NUM(modes); m++) {
+		for (p = 0; p < num_threads; p++) {
+			for (c = 0; c < num_threads; c++) {
+				if (threads[p] > modes[m].max_producers || threads[c] > modes[m].max_consumers) {
+					continue;
+				}
+
+				for (s = 0; s < num_payloads; s++) {
+					for (l = 0; l < num_maxlens; l++) {
+						if (bench_run(m, threads[p], threads[c], payloads[s], maxlens[l], msgs, pin)) {
+							fprintf(stderr, "%s %ux%u %u/%d: setup failed\n", modes[m].name, threads[p], threads[c], payloads[s], maxlens[l]);
+							return 1;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+}
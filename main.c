@@ -2,7 +2,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <time.h>
-#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "barrier.h"
@@ -34,22 +35,6 @@ unsigned long now(void)
 }
 
 
-/* creates a timespec which is for some number of msec in the future of the current time */
-void future_ts(struct timespec *ts_out, unsigned int msec)
-{
-	time_t t;
-
-	time(&t);
-	ts_out->tv_sec = t;
-	ts_out->tv_nsec = msec * 1000000;
-
-	if (ts_out->tv_nsec > 1000000000) {
-		ts_out->tv_nsec -= 1000000000;
-		ts_out->tv_sec += 1;
-	}
-}
-
-
 /* returns a random number between 1 and max */
 unsigned long rand_num(unsigned long max)
 {
@@ -69,38 +54,33 @@ int process_msg(const char *tname, sq_elem_t *e)
 {
 	if (e) {
 		fprintf(stderr, "[%-5s] %5ld rx \"%s\"\n", tname, now(), (char *)e->data);
-
-		if (e->flags & SQ_FLAG_FREE) {
-			free(e->data);
-		}
-
-		free(e);
+		sq_elem_release(e);
 	}
 
 	return 0;
 }
 
 
-/* creates a new message and fills out the provided sq_elem_t struct */
-sq_elem_t *generate_msg(sq_elem_t *dest_e, const char *tname, const char *s, int val)
+/*
+ * creates a new message in buf and fills out the provided sq_elem_t struct
+ * returns NULL if the message doesn't fit in size bytes
+ */
+sq_elem_t *generate_msg(sq_elem_t *dest_e, char *buf, int size, const char *tname, const char *s, int val)
 {
 	int len;
-	char *buf;
-	const char *fmt = "[%-5s] %03d %s";
 
-	len = snprintf(NULL, 0, fmt, tname, val, s);
-	if ((buf = malloc(len)) == NULL) {
+	if ((len = snprintf(buf, size, "[%-5s] %03d %s", tname, val, s)) < 0 || len >= size) {
 		return NULL;
 	}
 
 	/*
-	 * VOLATILE - we want sq_push() to make a copy of the data
-	 * FREE - we malloc()'d the message data because this function might be called re-entrantly, so caller must free()
+	 * VOLATILE - we want sq_push() to make a copy of the data, buf is the caller's and short enough
+	 *     to go in a small element slot
+	 * SHARED - sq_publish() only needs to make one copy for all of the subscribers
 	 */
 	dest_e->data = buf;
-	dest_e->dlen = len;
-	dest_e->flags = SQ_FLAG_VOLATILE | SQ_FLAG_FREE;
-	snprintf(buf, len + 1, fmt, tname, val, s);
+	dest_e->dlen = len + 1;
+	dest_e->flags = SQ_FLAG_VOLATILE | SQ_FLAG_SHARED;
 	return dest_e;
 }
 
@@ -111,53 +91,60 @@ sq_elem_t *generate_msg(sq_elem_t *dest_e, const char *tname, const char *s, int
  * waits 100ms for anyone to send the thread a message
  * processes any messages that were sent our way
  * if it's time to transmit a message of our wn, do so
+ * returns nonzero once our queue has been closed and everything in it handled
  */
 int thread_msg_loop(thread_data_t *td)
 {
 	int ret;
 	unsigned long t;
-	struct timespec ts;
 	bool did_something;
+	sq_elem_t *e[16];
+	unsigned int i, n;
 
 	/* wait for a message to be published to our queue or a timeout */
-	pthread_mutex_lock(&td->nd_mtx);
-	future_ts(&ts, 100);
-	ret = pthread_cond_timedwait(&td->newdata, &td->nd_mtx, &ts);
+	ret = sq_pop_timed(td->q, &e[0], 100 * 1000000ULL);
 
 	t = now();
 	did_something = false;
 
-	if (ret != ETIMEDOUT) {
-		//fprintf(stderr, "[%-5s] %5ld cond_timedwait returned %d\n", td->name, t, ret);
-	}
-
-	/* condition var changed */
-	if (ret == 0) {
-		sq_elem_t *e;
+	/* got a message; process it and drain the rest of the queue a batch at a time */
+	if (ret == SQ_ERR_NO_ERROR) {
+		process_msg(td->name, e[0]);
+		++td->num_rx;
 
 		do {
-			ret = sq_pop(td->q, &e);
+			ret = sq_pop_many(td->q, e, sizeof(e) / sizeof(e[0]), &n);
 			if (ret == SQ_ERR_NO_ERROR) {
-				if (e) {
-					process_msg(td->name, e);
+				for (i = 0; i < n; i++) {
+					process_msg(td->name, e[i]);
 		 			++td->num_rx;
 				}
 
-			} else if (ret != SQ_ERR_EMPTY) {
-				fprintf(stderr, "[%-5s] sq_pop returned %d\n", td->name, ret);
+			} else if (ret != SQ_ERR_EMPTY && ret != SQ_ERR_CLOSED) {
+				fprintf(stderr, "[%-5s] sq_pop_many returned %d\n", td->name, ret);
 			}
 		} while (ret == SQ_ERR_NO_ERROR);
 
 		did_something = true;
+
+	/* nothing left and nothing more coming, we're done */
+	} else if (ret == SQ_ERR_CLOSED) {
+		fprintf(stderr, "[%-5s] %5ld queue closed (tx %d rx %d)\n", td->name, t, td->num_tx, td->num_rx);
+		return 1;
+
+	} else if (ret != SQ_ERR_TIMEOUT) {
+		fprintf(stderr, "[%-5s] sq_pop_timed returned %d\n", td->name, ret);
 	}
 
 	/* time to transmit? */
 	if (t > td->tx_time) {
 		sq_elem_t e;
+		char buf[SQ_INLINE_LEN];
 
 		fprintf(stderr, "[%-5s] %5ld tx\n", td->name, t);
-		if (generate_msg(&e, td->name, "hello", td->count)) {
- 			if ((ret = sq_publish(td->list, &e)) != SQ_ERR_NO_ERROR) {
+		if (generate_msg(&e, buf, sizeof(buf), td->name, "hello", td->count)) {
+ 			/* subscribers that are shutting down have closed their queues, that's not an error */
+ 			if ((ret = sq_publish(td->list, &e)) != SQ_ERR_NO_ERROR && ret != SQ_ERR_CLOSED) {
  				fprintf(stderr, "[%-5s] sq_publish returned %d\n", td->name, ret);
  			}
 
@@ -165,10 +152,6 @@ int thread_msg_loop(thread_data_t *td)
  			++td->num_tx;
  		}
 
-		if (e.flags & SQ_FLAG_FREE) {
-			free(e.data);
-		}
-
 		td->tx_time = t + rand_num(2500);
 		did_something = true;
 	}
@@ -177,27 +160,60 @@ int thread_msg_loop(thread_data_t *td)
 		fprintf(stderr, "[%-5s]         (tx %d rx %d)\n", td->name, td->num_tx, td->num_rx);
 	}
 
-	pthread_mutex_unlock(&td->nd_mtx);
 	return 0;
 }
 
 
+/*
+ * runs the demo until ^C, kill or (if given) argv[1] seconds have passed, then shuts it down
+ * cleanly: every thread handles what's left in its queue before returning
+ */
 int main(int argc, char **argv)
 {
 	pthread_t t1, t2, t3;
 	pthread_barrier_t pb;
+	sigset_t sigs;
+	int sig;
+
+	/* the threads inherit the blocked signals, so only sigwait() below ever sees them */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	if (argc > 1) {
+		alarm(strtoul(argv[1], NULL, 0));
+	}
 
-	pthread_barrier_init(&pb, NULL, 3);
+	pthread_barrier_init(&pb, NULL, 4);
 
-	/* create the threads, passing each the barrier so they can all wait for each other to start up */
+	/* create the threads, passing each the barrier so they can all wait for each other (and us) to start up */
 	pthread_create(&t1, NULL, thread1, (void *)&pb);
 	pthread_create(&t2, NULL, thread2, (void *)&pb);
 	pthread_create(&t3, NULL, thread3, (void *)&pb);
 
+	/* once past this, every thread has its queue */
+	pthread_barrier_wait(&pb);
+
+	sigwait(&sigs, &sig);
+	fprintf(stderr, "%s, shutting down\n", sig == SIGALRM ? "time's up" : "signal");
+
+	/* closing the queues has each thread finish off what's in its queue and return */
+	t1_close();
+	t2_close();
+	t3_close();
+
 	/* wait for everyone to quit */
 	pthread_join(t1, NULL);
 	pthread_join(t2, NULL);
 	pthread_join(t3, NULL);
 
+	/* nobody is publishing any more, so the queues can go */
+	t1_cleanup();
+	t2_cleanup();
+	t3_cleanup();
+
+	pthread_barrier_destroy(&pb);
 	return 0;
 }
@@ -2,300 +2,3293 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "sq.h"
+#include "sq_conflate.h"
+#include "sq_delay.h"
+#include "sq_journal.h"
+#include "sq_numa.h"
+#include "sq_wait.h"
+
+#define SQ_HWM_SAMPLE		64		/* lock-free modes: pushes between samples of the queue length */
+#define SQ_DRAIN_BATCH		64		/* elements sq_drain() takes per lock hold */
+
+#define SQ_NE_OFF		0		/* q->ne_used: nobody has waited, producers skip the fence */
+#define SQ_NE_ARMING		1		/* a first waiter is making sure every producer has seen it */
+#define SQ_NE_ON		2		/* producers fence and look for waiters on every push */
+
+#define SQ_CLOSING		1		/* q->closed: pushes fail, but an SQ_FLAG_SPSC producer may not have seen it yet */
+#define SQ_CLOSED		2		/* q->closed: every producer sees it, see sq_close() */
+
+/* takes a free slot from the pool, returns NULL if the pool is used up */
+static sq_elem_t *sq_pool_get(sq_pool_t *p)
+{
+	sq_elem_t *e;
+
+	/* slots of pushes that didn't go in come first, see sq_pool_unget() */
+	if (p->spsc) {
+		if ((e = p->spare)) {
+			p->spare = e->next;
+			return e;
+		}
+
+		return sq_spsc_pop(&p->spsc_free);
+	}
+
+	return sq_ring_pop(&p->free);
+}
+
+
+/* gives a slot back to the pool */
+static void sq_pool_put(sq_pool_t *p, sq_elem_t *e)
+{
+	if (p->spsc) {
+		sq_spsc_push(&p->spsc_free, e, NULL);
+
+	} else {
+		sq_ring_push(&p->free, e, NULL);
+	}
+}
+
 
 /*
- * creates an element and adds it to the queue.
- * if the element has SQ_FLAG_VOLATILE, will malloc() enough for the element and its data
- * once pushed, walks through the listener list and notifies anyone waiting
+ * gives a slot back to the pool from the producer's side, for a push that didn't go in.
+ * only the consumer may push to an spsc free list, so the producer keeps the slot for itself
+ * and sq_pool_get() hands it out again next time.
+ */
+static void sq_pool_unget(sq_pool_t *p, sq_elem_t *e)
+{
+	if (p->spsc) {
+		e->next = p->spare;
+		p->spare = e;
+
+	} else {
+		sq_ring_push(&p->free, e, NULL);
+	}
+}
+
+
+/*
+ * allocates a pool of len elements, each with dlen bytes of data space after the element
+ * the pool struct and all of the slots come from a single allocation, the free list is a
+ * lock-free ring so producers and consumers don't serialize on the pool either.
+ * if spsc is set, the free list is a single producer/single consumer ring: the queue's
+ * consumer is the only one giving slots back and its producer the only one taking them
+ * (slots of pushes that failed stay with the producer, on p->spare).
+ * node is where the slots go, see sq_numa_pick().
  *
- * returns SQ_ERR_NO_ERROR on successfull add, other SQ_ERR as needed
+ * returns the new pool or NULL on memory allocation failure
  */
-int sq_push(sq_t *q, sq_elem_t *e)
+static sq_pool_t *sq_pool_init(unsigned int len, unsigned int dlen, unsigned int spsc, int node)
 {
-	sq_listeners_t *l;
-	sq_elem_t *new_e;
-	int alloc_len;
+	int ret;
 
-	/* use trylock() first in case q->flags has SQ_FLAG_NOWAIT set */
-	if (pthread_mutex_trylock(&q->mtx) != 0) {
-		if (q->flags & SQ_FLAG_NOWAIT) {
-			return SQ_ERR_WOULDBLOCK;
+	sq_pool_t *p;
+	unsigned int i, slot_len, hdr_len;
+	size_t size;
+	char *slot;
 
-		} else {
-			pthread_mutex_lock(&q->mtx);
-		}
+	/* slots start on a cache line and fill whole ones, so each element's header and data share as few as possible */
+	hdr_len = (sizeof(*p) + SQ_CACHELINE - 1) & ~(SQ_CACHELINE - 1);
+	slot_len = sizeof(sq_elem_t) + dlen;
+	slot_len = (slot_len + SQ_CACHELINE - 1) & ~(SQ_CACHELINE - 1);
+
+	size = hdr_len + (size_t)len * slot_len;
+	if ((p = sq_numa_alloc(size, node)) == NULL) {
+		return NULL;
 	}
 
-	if (q->len >= q->maxlen) {
-		if (q->flags & SQ_FLAG_NOWAIT) {
-			q->flags |= SQ_FLAG_OVERRUN;
-			return SQ_ERR_FULL;
+	p->spsc = spsc;
+	p->spare = NULL;
+	p->len = len;
+	p->dlen = dlen;
+	p->node = node;
+	p->size = size;
 
-		} else {
-			/* queue is full; wait on q->notfull which changes when someone has pop()'d */
-			while (pthread_cond_wait(&q->notfull, &q->mtx)) ;
-		}
+	if (spsc) {
+		ret = sq_spsc_init(&p->spsc_free, len);
+
+	} else {
+		ret = sq_ring_init(&p->free, len);
 	}
 
-	/* allocate a new element (and maybe its data too) */
-	alloc_len = sizeof(*e);
-	if (e->flags & SQ_FLAG_VOLATILE) {
-		alloc_len += e->dlen;
+	if (ret == 0) {
+		sq_numa_free(p, size, node);
+		return NULL;
+	}
+
+	/* fill the free list so slots are handed out in address order */
+	for (i = 0, slot = (char *)p + hdr_len; i < len; i++, slot += slot_len) {
+		((sq_elem_t *)slot)->pool = p;
+		sq_pool_put(p, (sq_elem_t *)slot);
 	}
 
-	if ((new_e = malloc(alloc_len)) == NULL) {
+	return p;
+}
+
 
-		/* set overrun flag because we had no memory to add data, so data got lost */
-		q->flags |= SQ_FLAG_OVERRUN;
-		return SQ_ERR_NOMEM;
+/* frees a pool; every slot must have been given back first */
+static void sq_pool_destroy(sq_pool_t *p)
+{
+	if (p->spsc) {
+		sq_spsc_destroy(&p->spsc_free);
+
+	} else {
+		sq_ring_destroy(&p->free);
+	}
+
+	sq_numa_free(p, p->size, p->node);
+}
+
+
+/*
+ * makes the queue's own copy of an element that is being pushed
+ * the copy comes from pool p if there is one with a free slot big enough for the data,
+ * otherwise it is malloc()'d. SQ_FLAG_VOLATILE data is copied along with the element.
+ *
+ * returns the new element or NULL if there was no memory for it
+ */
+static sq_elem_t *sq_elem_new(sq_pool_t *p, const sq_elem_t *e)
+{
+	sq_elem_t *new_e = NULL;
+	unsigned int flags;
+
+	if (p && (!(e->flags & SQ_FLAG_VOLATILE) || e->dlen <= p->dlen)) {
+		new_e = sq_pool_get(p);
+	}
+
+	if (new_e) {
+		flags = SQ_FLAG_POOL;
+
+	/* no pool, pool is empty or the data won't fit in a slot */
+	} else {
+		size_t alloc_len;
+
+		/* small data gets a slot of the same size every time, so malloc() can just hand back the last one freed */
+		alloc_len = sizeof(*e);
+		if (e->flags & SQ_FLAG_VOLATILE) {
+			alloc_len += e->dlen > SQ_INLINE_LEN ? e->dlen : SQ_INLINE_LEN;
+		}
+
+		if ((new_e = malloc(alloc_len)) == NULL) {
+			return NULL;
+		}
+
+		new_e->pool = NULL;
+		flags = 0;
 	}
 
-	/* if the data is volatile, copy it */
+	/* if the data is volatile, copy it; it lives right after the element struct */
 	new_e->next = NULL;
 	if (e->flags & SQ_FLAG_VOLATILE) {
-		new_e->data = new_e + sizeof(*new_e);
+		new_e->data = new_e + 1;
 		new_e->dlen = e->dlen;
 		memcpy(new_e->data, e->data, e->dlen);
 
 		/* mask off any old allocation flags and explicitly set VOLATILE */
-		new_e->flags = SQ_FLAG_VOLATILE | (e->flags & ~SQ_MASK_ALLOC);
+		new_e->flags = flags | SQ_FLAG_VOLATILE | (e->flags & ~(SQ_MASK_ALLOC | SQ_FLAG_POOL | SQ_FLAG_SHARED | SQ_FLAG_JOURNAL));
 
 	/* data isn't volatile, just point to it */
 	} else {
 		new_e->data = e->data;
 		new_e->dlen = e->dlen;
-		new_e->flags = e->flags;
-	}
-
-	/* is this the first element in the queue? */
-	if (q->head == NULL) {
-		q->head = new_e;
-		q->tail = q->head;
-
-	/* not the first, just add to the queue */
-	} else {
-		q->tail->next = new_e;
-		q->tail = q->tail->next;
-	}
-
-	q->len++;
-	pthread_mutex_unlock(&q->mtx);
-
-	/* wake up everyone listening on this queue */
-	pthread_mutex_lock(&q->listeners_mtx);
-	for (l = q->listeners; l; l = l->next) {
-		//fprintf(stderr, "[%-5s] push wakeup: %p\n", q->name, l->newdata);
-		pthread_cond_broadcast(l->newdata);
+		new_e->flags = flags | (e->flags & ~(SQ_FLAG_POOL | SQ_FLAG_SHARED | SQ_FLAG_JOURNAL));
 	}
-	pthread_mutex_unlock(&q->listeners_mtx);
 
-	return SQ_ERR_NO_ERROR;
+	new_e->prio = e->prio < SQ_PRIO_LEVELS ? e->prio : SQ_PRIO_LEVELS - 1;
+	new_e->key = e->key;
+	new_e->shared = NULL;
+	return new_e;
 }
 
 
 /*
- * retrieves the next element from the queue
- * the element returned must be freed by the caller when they are done with it
- *
- * if the element has SQ_FLAG_VOLATILE set, then the caller must take care not to
- * free the element itself until they are done with the data as well, because the
- * element data was allocated with the element struct when it was pushed.
+ * makes the shared copy of an element's data for sq_publish()
+ * SQ_FLAG_VOLATILE data is copied in right after the sq_shared_t, otherwise the shared copy
+ * just points at the caller's data and takes over freeing it (SQ_FLAG_FREE).
+ * refs is the number of references to start out with. a VOLATILE copy goes on node if it
+ * isn't SQ_NUMA_ANY.
  *
- * If the element has SQ_FLAG_FREE set, then the caller must separately free()
- * the element data pointer.
- *
- * the returned element flags are also updated to include information about the
- * queue itself; SQ_FLAG_OVERRUN is particularly useful to know if there was
- * data loss due to the queue being full.
- *
- * e is updated with the queue element retreived or is set to NULL if the queue is empty.
- *
- * returns SQ_ERR_NO_ERROR on success, various SQ_ERR otherwise.
+ * returns the shared data or NULL if there was no memory for it
  */
-int sq_pop(sq_t *q, sq_elem_t **e)
+static sq_shared_t *sq_shared_new(const sq_elem_t *e, unsigned int refs, int node)
 {
-	int ret;
+	sq_shared_t *sh;
+	size_t size;
 
-	/* use trylock() first in case q->flags has SQ_FLAG_NOWAIT set */
-	if (pthread_mutex_trylock(&q->mtx) != 0) {
-		if (q->flags & SQ_FLAG_NOWAIT) {
-			return SQ_ERR_WOULDBLOCK;
+	if (e->flags & SQ_FLAG_VOLATILE) {
+		size = sizeof(*sh) + e->dlen;
+		if ((sh = node == SQ_NUMA_ANY ? malloc(size) : sq_numa_alloc(size, node)) == NULL) {
+			return NULL;
+		}
 
-		} else {
-			pthread_mutex_lock(&q->mtx);
+		sh->data = sh + 1;
+		memcpy(sh->data, e->data, e->dlen);
+		sh->flags = 0;
+
+	} else {
+		size = sizeof(*sh);
+		node = SQ_NUMA_ANY;
+		if ((sh = malloc(size)) == NULL) {
+			return NULL;
 		}
+
+		sh->data = e->data;
+		sh->flags = e->flags & SQ_FLAG_FREE;
 	}
 
-	if (q->len) {
-		sq_elem_t *new_e;
+	sh->refs = refs;
+	sh->node = node;
+	sh->size = size;
+	return sh;
+}
 
-		new_e = q->head;
-		q->head = new_e->next;
-		q->len--;
 
-		/*
-		 * queue is no longer full.
-		 * Copy the queue stats over to the popped element
-		 * and clear the queue flags.
-		 */
-		q->flags &= ~SQ_FLAG_FULL;
-		new_e->flags &= ~SQ_MASK_QSTATE;
-		new_e->flags |= (q->flags &= SQ_MASK_QSTATE);
-		q->flags &= ~SQ_MASK_QSTATE;
+/* drops n references to shared data, freeing it when the last one goes */
+static void sq_shared_put(sq_shared_t *sh, unsigned int n)
+{
+	if (__atomic_sub_fetch(&sh->refs, n, __ATOMIC_ACQ_REL) == 0) {
+		if (sh->flags & SQ_FLAG_FREE) {
+			free(sh->data);
+		}
+
+		sq_numa_free(sh, sh->size, sh->node);
+	}
+}
 
-		*e = new_e;
-		ret = SQ_ERR_NO_ERROR;
 
-		/* wake up anyone waiting to push to this queue */
-		pthread_cond_broadcast(&q->notfull);
+/* gets rid of an element struct (but not its SQ_FLAG_FREE data) */
+static void sq_elem_put(sq_elem_t *e)
+{
+	if (e->flags & SQ_FLAG_POOL) {
+		sq_pool_put(e->pool, e);
 
 	} else {
-		*e = NULL;
-		ret = SQ_ERR_EMPTY;
+		free(e);
 	}
+}
 
-	pthread_mutex_unlock(&q->mtx);
-	return ret;
+
+/*
+ * marks one of a set's queues ready after a push made it non-empty, and wakes up anyone
+ * sleeping in sq_select() if it's the first time since the last sq_select().
+ * pairs with sq_select_deadline(): either the sleeper has counted itself in waiters already
+ * and gets woken, or it hasn't, and it will see the bit when it re-checks.
+ */
+static void sq_set_ready(sq_set_t *set, unsigned long long bit)
+{
+	if (__atomic_fetch_or(&set->ready, bit, __ATOMIC_SEQ_CST) & bit) {
+		return;
+	}
+
+	if (__atomic_load_n(&set->waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&set->mtx);
+		pthread_cond_broadcast(&set->cond);
+		pthread_mutex_unlock(&set->mtx);
+	}
 }
 
 
-/* adds a new listener to the queue's listener list */
-void sq_add_listener(sq_t *q, pthread_cond_t *data_cond)
+/* frees up bit i of a set once its queue has stopped listening, with set->mtx held */
+static void sq_set_clear(sq_set_t *set, unsigned int i)
 {
-	sq_listeners_t *new_l;
+	__atomic_store_n(&set->queues[i], NULL, __ATOMIC_RELEASE);
+	__atomic_fetch_and(&set->ready, ~(1ULL << i), __ATOMIC_RELAXED);
 
-	/* create a new listeners_t and fill it out */
-	if ((new_l = malloc(sizeof(*new_l)))) {
-		pthread_mutex_lock(&q->listeners_mtx);
+	while (set->len && set->queues[set->len - 1] == NULL) {
+		set->len--;
+	}
+}
 
-		new_l->next = NULL;
-		new_l->newdata = data_cond;
 
-		/* add the new listener to the end of the list */
-		if (q->listeners) {
-			sq_listeners_t *l;
+/*
+ * wakes up everyone listening on this queue
+ * only called when the queue goes from empty to non-empty; listeners drain the queue
+ * after every wakeup, so there's nobody to tell about any push after that one
+ */
+static void sq_notify(sq_t *q)
+{
+	sq_listeners_t *l;
+	uint64_t one = 1;
 
-			for (l = q->listeners; l->next && l->newdata != data_cond; l = l->next) ;
+	/* nobody to wake up, don't bother with the lock */
+	if (__atomic_load_n(&q->listeners, __ATOMIC_ACQUIRE) == NULL) {
+		return;
+	}
 
-			/* don't add a listener that's already on the list */
-			if (l->newdata == data_cond) {
-				free(new_l);
-				new_l = NULL;
+	pthread_mutex_lock(&q->listeners_mtx);
+	for (l = q->listeners; l; l = l->next) {
+		//fprintf(stderr, "[%-5s] push wakeup: %p\n", q->name, l->newdata);
+		if (l->newdata) {
+			pthread_cond_broadcast(l->newdata);
 
-			} else {
-				l->next = new_l;
-			}
+		} else if (l->set) {
+			sq_set_ready(l->set, l->bit);
 
-		/* there is no list. the new listener starts the list */
+		/* a full eventfd counter is still readable, so EAGAIN can be ignored */
 		} else {
-			q->listeners = new_l;
+			while (write(l->fd, &one, sizeof(one)) < 0 && errno == EINTR) ;
 		}
-
-		pthread_mutex_unlock(&q->listeners_mtx);
-		//fprintf(stderr, "[%-5s] added listener %p\n", q->name, new_l->newdata);
 	}
+	pthread_mutex_unlock(&q->listeners_mtx);
 }
 
 
 /*
- * adds a queue to the end of a list of queues
- * correctly handles an empty list, and does not add queue
- * if it's already on the list
+ * lock-free modes: tells the listeners about elements that went in at ring positions first..last
  *
- * returns the start of the list or NULL if the queue couldn't be added
+ * the queue only just went non-empty if the consumers are still sitting somewhere in
+ * first..last, which might be because they found one of our slots empty and went to sleep.
+ * if they're further along they've already seen our elements, and if they're before first
+ * then whoever pushed the element they're stuck on gets to tell them.
+ * the fence pairs with the one in sq_pop_recheck().
  */
-sq_list_t *sq_list_add(sq_list_t **list, sq_t *q)
+static void sq_notify_lockfree(sq_t *q, unsigned long first, unsigned long last)
 {
-	sq_list_t *new_l;
+	unsigned long head;
 
-	if ((new_l = malloc(sizeof(*new_l))) == NULL) {
-		return NULL;
+	if (__atomic_load_n(&q->listeners, __ATOMIC_RELAXED) == NULL) {
+		return;
 	}
 
-	new_l->next = NULL;
-	new_l->q = q;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (q->flags & SQ_FLAG_SPSC) {
+		head = __atomic_load_n(&q->spsc.head, __ATOMIC_RELAXED);
 
-	/* add the queue to the end of the list of queues */
-	if (*list) {
-		sq_list_t *l;
+	} else {
+		head = __atomic_load_n(&q->ring.head, __ATOMIC_RELAXED);
+	}
 
-		for (l = *list; l->next && l->q != q; l = l->next) ;
+	if ((long)(head - first) >= 0 && (long)(last - head) >= 0) {
+		sq_notify(q);
+	}
+}
 
-		/* don't add a queue that's already on the list */
-		if (l->q == q) {
-			free(new_l);
 
-		} else {
-			l->next = new_l;
-		}
+/*
+ * SQ_FLAG_MPSC: tells the listeners about elements that were just linked in after prev
+ *
+ * producers don't link their elements in the order their positions say, so the positions
+ * can't tell us whether the consumer is stuck on us. the list can: the consumer only ever
+ * stops at an element (or the stub) whose next pointer it found unset, so it can only be
+ * waiting on us if it's sitting on prev. the fence pairs with the one in sq_pop_recheck().
+ */
+static void sq_notify_mpsc(sq_t *q, sq_elem_t *prev)
+{
+	if (__atomic_load_n(&q->listeners, __ATOMIC_RELAXED) == NULL) {
+		return;
+	}
 
-	/* this is the first entry in the list */
-	} else {
-		*list = new_l;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->mpsc.head, __ATOMIC_RELAXED) == prev) {
+		sq_notify(q);
 	}
+}
 
-	return *list;
+
+/*
+ * bumps a stats counter that any thread might be bumping at the same time
+ * relaxed, the counters are only ever read as a snapshot
+ */
+static void sq_stat_add(unsigned long long *c, unsigned long long n)
+{
+	__atomic_add_fetch(c, n, __ATOMIC_RELAXED);
 }
 
 
 /*
- * takes an element and adds it to every queue in the list of queues
- * correctly handles an empty list (i.e. list can be NULL)
- * DOES NOT STOP IF A QUEUE FAILED TO ADD THE ELEMENT
- *
- * returns SQ_ERR_NO_ERROR if all the element was successfully pushed
- * to all queues in the list, or the last error received
+ * bumps a stats counter that only one thread at a time can be writing (q->mtx held, or the
+ * one SQ_FLAG_SPSC producer/consumer), so there's no need for a locked instruction. the atomic
+ * load/store only keeps sq_stats() from seeing a torn value.
  */
-int sq_publish(sq_list_t *list, sq_elem_t *e)
+static void sq_stat_add_1w(unsigned long long *c, unsigned long long n)
 {
-	int ret;
-	sq_list_t *l;
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
 
-	for (l = list, ret = SQ_ERR_NO_ERROR; l; l = l->next) {
-		int l_ret;
 
-		if ((l_ret = sq_push(l->q, e)) != SQ_ERR_NO_ERROR) {
-			ret = l_ret;
-		}
+/* raises the high water mark to len if it's higher; only writes when it actually goes up */
+static void sq_stat_hwm(sq_t *q, unsigned int len)
+{
+	unsigned int hwm;
 
-		//fprintf(stderr, "    [%-5s] push(%p, %p) ret %d\n", l->q->name, l->q, e, l_ret);
+	hwm = __atomic_load_n(&q->hwm, __ATOMIC_RELAXED);
+	while (len > hwm && !__atomic_compare_exchange_n(&q->hwm, &hwm, len, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+
+/*
+ * lock-free modes: samples the queue length after a push at ring position pos, every
+ * SQ_HWM_SAMPLE pushes so the producers don't have to pull the consumers' cache line over
+ * every time. pushing to a full ring always raises the mark to maxlen, see sq_push_ring().
+ */
+static void sq_stat_hwm_sample(sq_t *q, unsigned long pos)
+{
+	unsigned long head;
+
+	if (pos % SQ_HWM_SAMPLE) {
+		return;
 	}
 
-	return ret;
+	if (q->flags & SQ_FLAG_SPSC) {
+		head = __atomic_load_n(&q->spsc.head, __ATOMIC_RELAXED);
+
+	} else if (q->flags & SQ_FLAG_MPSC) {
+		head = __atomic_load_n(&q->mpsc.pops, __ATOMIC_RELAXED);
+
+	} else {
+		head = __atomic_load_n(&q->ring.head, __ATOMIC_RELAXED);
+	}
+
+	if ((long)(pos + 1 - head) > 0) {
+		sq_stat_hwm(q, pos + 1 - head);
+	}
+}
+
+
+/* counts a producer that has been waiting for room since t0 */
+static void sq_stat_blocked(sq_t *q, unsigned long long t0)
+{
+	sq_stat_add(&q->blocked, 1);
+	sq_stat_add(&q->blocked_ns, sq_now_ns() - t0);
 }
 
 
+/* SQ_FLAG_TIMESTAMP: adds the time a popped element spent in the queue to the histogram */
+static void sq_stat_residency(sq_t *q, const sq_elem_t *e, unsigned long long now)
+{
+	unsigned long long dt;
+	unsigned int b;
+
+	/* bucket b counts 2^b .. 2^(b+1)-1 nsec, the last one everything longer */
+	dt = now > e->ts ? now - e->ts : 0;
+	b = dt ? 63 - __builtin_clzll(dt) : 0;
+	if (b >= SQ_STATS_BUCKETS) {
+		b = SQ_STATS_BUCKETS - 1;
+	}
+
+	if (q->flags & SQ_FLAG_RING) {
+		sq_stat_add(&q->residency[b], 1);
+
+	} else {
+		sq_stat_add_1w(&q->residency[b], 1);
+	}
+}
+
 
 /*
- * allocates and initializes a new queue.
- * useful flags include
- *     SQ_FLAG_NOWAIT - do not block waiting for the queue lock
+ * first part of an adaptive wait (see sq_attr_t): polls ready(q, arg) q->spin times with a
+ * pause in between, then q->yield times giving up the CPU in between. with SQ_SPIN_FOREVER it
+ * only spins, for as long as it takes.
  *
- * returns the newly-minted queue or NULL on memory allocation failure.
+ * returns nonzero as soon as ready() does, 0 if the caller should go to sleep now (the
+ * deadline, CLOCK_MONOTONIC nsec, passed or the polling ran out) or the queue was closed
  */
-sq_t *sq_init(const char *name, void *ctx, int maxlen, unsigned int flags)
+static int sq_spin(sq_t *q, int (*ready)(sq_t *q, void *arg), void *arg, unsigned long long deadline)
 {
-	sq_t *new_q;
+	unsigned int i;
+
+	for (i = 0; q->spin == SQ_SPIN_FOREVER || i < q->spin; i++) {
+		if (ready(q, arg)) {
+			return 1;
+		}
+
+		/* nothing more is coming to a closed queue, let the caller find that out */
+		if (__atomic_load_n(&q->closed, __ATOMIC_RELAXED)) {
+			return 0;
+		}
 
-	if ((new_q = malloc(sizeof(*new_q)))) {
-		memset(new_q, 0, sizeof(*new_q));
-		new_q->name = name;
-		new_q->ctx = ctx;
-		new_q->head = NULL;
-		new_q->tail = NULL;
-		new_q->listeners = NULL;
-		new_q->len = 0;
-		new_q->maxlen = maxlen;
-		new_q->flags = flags;
+		/* reading the clock every time round would take longer than the spin itself */
+		if (deadline && (i & 63) == 63 && sq_now_ns() >= deadline) {
+			return 0;
+		}
 
-		pthread_mutex_init(&new_q->mtx, NULL);
-		pthread_mutex_init(&new_q->listeners_mtx, NULL);
-		pthread_cond_init(&new_q->notfull, NULL);
+		sq_cpu_relax();
 	}
 
-	return new_q;
+	for (i = 0; i < q->yield; i++) {
+		if (ready(q, arg)) {
+			return 1;
+		}
+
+		if (__atomic_load_n(&q->closed, __ATOMIC_RELAXED)) {
+			return 0;
+		}
+
+		if (deadline && sq_now_ns() >= deadline) {
+			return 0;
+		}
+
+		sched_yield();
+	}
+
+	return ready(q, arg);
+}
+
+
+/* sq_spin() condition for sq_lock(); takes the lock when it's true */
+static int sq_spin_lock(sq_t *q, void *arg)
+{
+	(void)arg;
+	return pthread_mutex_trylock(&q->mtx) == 0;
+}
+
+
+/*
+ * takes the queue lock
+ * uses trylock() first in case q->flags has SQ_FLAG_NOWAIT set, then spins for it (if the
+ * queue was set up to) before blocking in pthread_mutex_lock()
+ *
+ * returns SQ_ERR_NO_ERROR with q->mtx held, or SQ_ERR_WOULDBLOCK
+ */
+static int sq_lock(sq_t *q)
+{
+	if (pthread_mutex_trylock(&q->mtx) != 0) {
+		sq_stat_add(&q->contended, 1);
+		if (q->flags & SQ_FLAG_NOWAIT) {
+			return SQ_ERR_WOULDBLOCK;
+
+		} else if (!sq_spin(q, sq_spin_lock, NULL, 0)) {
+			pthread_mutex_lock(&q->mtx);
+		}
+	}
+
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/* counts n elements lost because the queue was full (or there was no memory for them) */
+static void sq_overrun(sq_t *q, unsigned int n)
+{
+	__atomic_add_fetch(&q->overruns, n, __ATOMIC_RELAXED);
+	sq_stat_add(&q->drops, n);
+}
+
+
+/*
+ * copies the queue stats over to a popped element and clears them
+ * e->overruns gets the number of elements lost since the last pop(), and SQ_FLAG_OVERRUN is
+ * set if there were any. uses atomics, so the lock-free modes can call it without q->mtx.
+ */
+static void sq_qstate_move(sq_t *q, sq_elem_t *e)
+{
+	e->flags &= ~SQ_MASK_QSTATE;
+	e->overruns = 0;
+
+	if (__atomic_load_n(&q->overruns, __ATOMIC_RELAXED)) {
+		if ((e->overruns = __atomic_exchange_n(&q->overruns, 0, __ATOMIC_RELAXED))) {
+			e->flags |= SQ_FLAG_OVERRUN;
+		}
+	}
+}
+
+
+/*
+ * SQ_FLAG_RING: wakes up anyone waiting to push to this queue after a pop() made room
+ * pairs with the re-check in sq_push_ring()
+ */
+static void sq_wake_notfull(sq_t *q)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->nf_waiters, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&q->mtx);
+		pthread_cond_broadcast(&q->notfull);
+		pthread_mutex_unlock(&q->mtx);
+	}
+}
+
+
+/*
+ * lock-free modes: wakes up to n consumers sleeping in sq_pop_wait()/sq_pop_timed() after a
+ * push, pairs with the re-check in sq_pop_deadline(). producers only pay for the fence once
+ * somebody has actually waited on this queue. until then, a consumer about to wait for the
+ * first time turns ne_used on and then runs sq_membarrier(): that's a full barrier in this
+ * thread too, so either our element was visible before it returned or we see ne_used here.
+ */
+static void sq_wake_notempty(sq_t *q, int n)
+{
+	/* the element has to be stored before ne_used is loaded, as far as the compiler goes */
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->ne_used, __ATOMIC_RELAXED) != SQ_NE_OFF) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&q->ne_waiters, __ATOMIC_RELAXED)) {
+			__atomic_add_fetch(&q->ne_seq, 1, __ATOMIC_RELEASE);
+			sq_futex_wake(&q->ne_seq, n);
+		}
+	}
+}
+
+
+/*
+ * SQ_FLAG_MPSC: returns the number of elements pushed and not yet popped, counting any that
+ * are still on their way in. pops is read first, so it can never come out negative.
+ */
+static unsigned int sq_mpsc_len(sq_mpsc_t *m)
+{
+	unsigned long pops;
+
+	pops = __atomic_load_n(&m->pops, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&m->pushes, __ATOMIC_ACQUIRE) - pops;
+}
+
+
+/*
+ * SQ_FLAG_MPSC: puts the chain first..last (last->next must be NULL) on the end of the list
+ * the exchange makes last the tail straight away, and prev (the old tail) is linked to first
+ * right after. until then the consumer just doesn't see past prev.
+ *
+ * returns prev
+ */
+static sq_elem_t *sq_mpsc_append(sq_mpsc_t *m, sq_elem_t *first, sq_elem_t *last)
+{
+	sq_elem_t *prev;
+
+	prev = __atomic_exchange_n(&m->tail, last, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, first, __ATOMIC_RELEASE);
+	return prev;
+}
+
+
+/*
+ * SQ_FLAG_MPSC: takes the oldest element off the list, consumer only
+ * returns NULL if the list is empty, or if the only thing left is a producer's element that
+ * isn't linked in yet.
+ */
+static sq_elem_t *sq_mpsc_pop(sq_mpsc_t *m)
+{
+	sq_elem_t *head, *next;
+
+	head = m->head;
+	next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+	/* step over the stub */
+	if (head == &m->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+
+		__atomic_store_n(&m->head, next, __ATOMIC_RELAXED);
+		head = next;
+		next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	}
+
+	/* head is the last element; put the stub back behind it so it can be taken off */
+	if (next == NULL) {
+		if (head != __atomic_load_n(&m->tail, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+
+		m->stub.next = NULL;
+		sq_mpsc_append(m, &m->stub, &m->stub);
+
+		/* a producer may have got in after head before the stub did */
+		if ((next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE)) == NULL) {
+			return NULL;
+		}
+	}
+
+	__atomic_store_n(&m->head, next, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->pops, m->pops + 1, __ATOMIC_RELEASE);
+	head->next = NULL;
+	return head;
+}
+
+
+/* lock-free modes: takes the next element off the ring or list, NULL if there isn't one */
+static sq_elem_t *sq_pop_lockfree(sq_t *q)
+{
+	if (q->flags & SQ_FLAG_SPSC) {
+		return sq_spsc_pop(&q->spsc);
+
+	} else if (q->flags & SQ_FLAG_MPSC) {
+		return sq_mpsc_pop(&q->mpsc);
+	}
+
+	return sq_ring_pop(&q->ring);
+}
+
+
+/*
+ * returns nonzero if the queue is empty; in the lock-free modes it's safe to use as a re-check
+ * before sleeping, for a list queue it's only a snapshot unless q->mtx is held
+ */
+static int sq_empty(sq_t *q)
+{
+	if (q->flags & SQ_FLAG_SPSC) {
+		return sq_spsc_empty(&q->spsc);
+
+	} else if (q->flags & SQ_FLAG_RING) {
+		return sq_ring_empty(&q->ring);
+
+	} else if (q->flags & SQ_FLAG_MPSC) {
+		return sq_mpsc_len(&q->mpsc) == 0;
+
+	} else if (q->flags & SQ_FLAG_DELAY) {
+		return sq_delay_next(q->delay) > sq_now_ns();
+	}
+
+	return __atomic_load_n(&q->len, __ATOMIC_RELAXED) == 0;
+}
+
+
+/*
+ * lock-free modes: returns nonzero if a push may be part way in, with a slot claimed or its
+ * elements counted (or, SQ_FLAG_SPSC, flagged in q->pushing) but nothing there to pop yet.
+ * the loads are sequentially consistent, see sq_push_enter(), sq_push_ring() and sq_push_mpsc().
+ */
+static int sq_landing(sq_t *q)
+{
+	if (q->flags & SQ_FLAG_SPSC) {
+		return __atomic_load_n(&q->closed, __ATOMIC_SEQ_CST) == SQ_CLOSING ||
+		       __atomic_load_n(&q->pushing, __ATOMIC_SEQ_CST);
+
+	} else if (q->flags & SQ_FLAG_RING) {
+		return !sq_ring_settled(&q->ring);
+	}
+
+	return __atomic_load_n(&q->mpsc.pushes, __ATOMIC_SEQ_CST) != __atomic_load_n(&q->mpsc.pops, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * returns nonzero once a closed queue has nothing at all left in it (due or not), which is
+ * when a pop() that found it empty says SQ_ERR_CLOSED instead. a snapshot, like sq_empty().
+ */
+static int sq_ended(sq_t *q)
+{
+	if (!__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+		return 0;
+	}
+
+	/* a push that got in before the close may not have landed yet */
+	if (q->flags & SQ_MASK_LOCKFREE) {
+		return !sq_landing(q) && sq_empty(q);
+	}
+
+	return __atomic_load_n(&q->len, __ATOMIC_RELAXED) == 0;
+}
+
+
+/*
+ * SQ_FLAG_SPSC: a push has no lock to check closed under, and no slot claim or count that
+ * sq_ended() could see either, so the producer flags itself in q->pushing first and then
+ * looks. either the consumer sees the flag and waits for the element, or the push sees closed
+ * and gives up. in between there's only a compiler barrier; sq_close() makes up for that with
+ * sq_membarrier() before it lets the consumer trust the flag. where it can't, it's a real fence.
+ *
+ * returns nonzero if the queue is closed, in which case the push mustn't go ahead
+ */
+static int sq_push_enter(sq_t *q)
+{
+	__atomic_store_n(&q->pushing, 1, __ATOMIC_RELAXED);
+	if (q->barrier) {
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	} else {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+
+	if (__atomic_load_n(&q->closed, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&q->pushing, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* SQ_FLAG_SPSC: the push that sq_push_enter() let in is done, and in the queue if it went in */
+static void sq_push_leave(sq_t *q)
+{
+	__atomic_store_n(&q->pushing, 0, __ATOMIC_RELEASE);
+}
+
+
+/* sq_spin() condition for consumers: pops into *arg (an sq_elem_t **) once there's something there */
+static int sq_spin_pop(sq_t *q, void *arg)
+{
+	return !sq_empty(q) && sq_pop(q, arg) == SQ_ERR_NO_ERROR;
+}
+
+
+/* sq_spin() condition for producers: there's room to push, again only a snapshot */
+static int sq_spin_room(sq_t *q, void *arg)
+{
+	(void)arg;
+	if (q->flags & SQ_FLAG_SPSC) {
+		return sq_spsc_len(&q->spsc) < q->maxlen;
+
+	} else if (q->flags & SQ_FLAG_RING) {
+		return !sq_ring_full(&q->ring);
+
+	} else if (q->flags & SQ_FLAG_MPSC) {
+		return sq_mpsc_len(&q->mpsc) < q->maxlen;
+	}
+
+	return __atomic_load_n(&q->len, __ATOMIC_RELAXED) < q->maxlen;
+}
+
+
+/*
+ * list mode: polls for room with q->mtx dropped before a producer sleeps on q->notfull
+ * returns nonzero if there's room now or the queue was closed meanwhile (so the producer
+ * shouldn't sleep), q->mtx is held again either way
+ */
+static int sq_spin_list_room(sq_t *q, unsigned long long deadline)
+{
+	int ret;
+
+	if (q->spin == 0 && q->yield == 0) {
+		return 0;
+	}
+
+	pthread_mutex_unlock(&q->mtx);
+	ret = sq_spin(q, sq_spin_room, NULL, deadline);
+	pthread_mutex_lock(&q->mtx);
+	return ret || q->closed;
+}
+
+
+/*
+ * lock-free modes: called when a pop() found the queue empty. if there are listeners, fences
+ * and returns nonzero to have the caller look again: either that second look sees an element
+ * that was just pushed, or its producer sees that we're stuck on it and tells the listeners.
+ */
+static int sq_pop_recheck(sq_t *q)
+{
+	if (__atomic_load_n(&q->listeners, __ATOMIC_RELAXED) == NULL) {
+		return 0;
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return 1;
+}
+
+
+/*
+ * SQ_FLAG_RING push
+ * if the ring is full, throws away the oldest element (SQ_FLAG_DROP_OLDEST), fails
+ * (SQ_FLAG_NOWAIT, SQ_FLAG_DROP_NEWEST) or sleeps on q->notfull until a pop() makes room or
+ * the deadline passes. q->mtx is only used for that sleep, never on the fast path.
+ * pos is updated with the ring position the element went in at.
+ */
+static int sq_push_ring(sq_t *q, sq_elem_t *new_e, unsigned long *pos, unsigned long long deadline)
+{
+	sq_elem_t *old_e;
+	unsigned long long t0;
+	int ret;
+
+	for (t0 = 0; sq_ring_claim(&q->ring, pos); ) {
+		sq_stat_hwm(q, q->maxlen);
+
+		/* the pop() moves ring.head along, so keep count for sq_stats() to take back off */
+		if (q->flags & SQ_FLAG_DROP_OLDEST) {
+			if ((old_e = sq_ring_pop(&q->ring))) {
+				sq_stat_add(&q->evicted, 1);
+				sq_overrun(q, 1);
+				sq_elem_release(old_e);
+			}
+
+			continue;
+		}
+
+		if (q->flags & (SQ_FLAG_NOWAIT | SQ_FLAG_DROP_NEWEST)) {
+			sq_overrun(q, 1);
+			return SQ_ERR_FULL;
+		}
+
+		if (t0 == 0) {
+			t0 = sq_now_ns();
+		}
+
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+			sq_stat_blocked(q, t0);
+			return SQ_ERR_CLOSED;
+		}
+
+		if (sq_spin(q, sq_spin_room, NULL, deadline)) {
+			continue;
+		}
+
+		/*
+		 * count ourselves as a waiter before re-checking, so a pop() that makes room
+		 * either sees us waiting and wakes us up or happens before the re-check.
+		 * sq_close() sets closed with q->mtx held, so it can't slip in before we sleep either.
+		 */
+		pthread_mutex_lock(&q->mtx);
+		__atomic_add_fetch(&q->nf_waiters, 1, __ATOMIC_SEQ_CST);
+		ret = 0;
+		if (sq_ring_full(&q->ring) && !q->closed) {
+			ret = sq_cond_timedwait(&q->notfull, &q->mtx, deadline);
+		}
+
+		__atomic_sub_fetch(&q->nf_waiters, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&q->mtx);
+
+		/* one last try before giving up */
+		if (ret == ETIMEDOUT) {
+			if (sq_ring_claim(&q->ring, pos)) {
+				sq_stat_blocked(q, t0);
+				return SQ_ERR_TIMEOUT;
+			}
+
+			break;
+		}
+	}
+
+	if (t0) {
+		sq_stat_blocked(q, t0);
+	}
+
+	/*
+	 * the slot was claimed before looking, so either sq_ended() sees the claim and waits for
+	 * the element, or we see closed here and give the slot up again. the consumers may have
+	 * seen the queue end already and won't pop it, so we get it out of the way ourselves.
+	 */
+	if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+		sq_ring_fill(&q->ring, *pos, NULL);
+		sq_ring_skip(&q->ring);
+		return SQ_ERR_CLOSED;
+	}
+
+	sq_ring_fill(&q->ring, *pos, new_e);
+	sq_stat_hwm_sample(q, *pos);
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * SQ_FLAG_RING pop
+ * only touches q->mtx if there is a producer sleeping on a full ring
+ */
+static int sq_pop_ring(sq_t *q, sq_elem_t **e)
+{
+	sq_elem_t *new_e;
+
+	if ((new_e = sq_ring_pop(&q->ring)) == NULL && sq_pop_recheck(q)) {
+		new_e = sq_ring_pop(&q->ring);
+	}
+
+	if (new_e == NULL) {
+		*e = NULL;
+		return SQ_ERR_EMPTY;
+	}
+
+	sq_qstate_move(q, new_e);
+	if (q->flags & SQ_FLAG_TIMESTAMP) {
+		sq_stat_residency(q, new_e, sq_now_ns());
+	}
+
+	sq_wake_notfull(q);
+
+	*e = new_e;
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * SQ_FLAG_SPSC push
+ * there's only the one producer, so a full ring is waited out by yielding the CPU to the
+ * consumer rather than sleeping; that keeps the consumer free of any wakeup bookkeeping
+ * (SQ_FLAG_DROP_OLDEST can't be used here, the producer isn't allowed to pop)
+ * pos is updated with the ring position the element went in at.
+ */
+static int sq_push_spsc(sq_t *q, sq_elem_t *new_e, unsigned long *pos, unsigned long long deadline)
+{
+	unsigned long long t0;
+
+	for (t0 = 0; sq_spsc_push(&q->spsc, new_e, pos); ) {
+		sq_stat_hwm(q, q->maxlen);
+
+		if (q->flags & (SQ_FLAG_NOWAIT | SQ_FLAG_DROP_NEWEST)) {
+			sq_overrun(q, 1);
+			return SQ_ERR_FULL;
+		}
+
+		if (t0 == 0) {
+			t0 = sq_now_ns();
+		}
+
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+			sq_stat_blocked(q, t0);
+			return SQ_ERR_CLOSED;
+		}
+
+		if (deadline && sq_now_ns() >= deadline) {
+			sq_stat_blocked(q, t0);
+			return SQ_ERR_TIMEOUT;
+		}
+
+		if (!sq_spin(q, sq_spin_room, NULL, deadline)) {
+			sched_yield();
+		}
+	}
+
+	if (t0) {
+		sq_stat_blocked(q, t0);
+	}
+
+	sq_stat_hwm_sample(q, *pos);
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/* SQ_FLAG_SPSC and SQ_FLAG_MPSC pop; there's only the one consumer, so nobody to wake up */
+static int sq_pop_single(sq_t *q, sq_elem_t **e)
+{
+	sq_elem_t *new_e;
+
+	if ((new_e = sq_pop_lockfree(q)) == NULL && sq_pop_recheck(q)) {
+		new_e = sq_pop_lockfree(q);
+	}
+
+	if (new_e == NULL) {
+		*e = NULL;
+		return SQ_ERR_EMPTY;
+	}
+
+	sq_qstate_move(q, new_e);
+	if (q->flags & SQ_FLAG_TIMESTAMP) {
+		sq_stat_residency(q, new_e, sq_now_ns());
+	}
+
+	*e = new_e;
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * SQ_FLAG_MPSC push of the NULL terminated chain first..last (n elements)
+ * the whole chain goes in with one atomic add and one exchange, without waiting on the other
+ * producers or the consumer. the length is only checked beforehand, so producers pushing at
+ * the same time can take the queue a little past maxlen. a producer that finds it full yields
+ * the CPU until there is room, the same as SQ_FLAG_SPSC.
+ */
+static int sq_push_mpsc(sq_t *q, sq_elem_t *first, sq_elem_t *last, unsigned int n, unsigned long long deadline)
+{
+	unsigned long long t0;
+	unsigned long pos;
+	sq_elem_t *prev;
+
+	for (t0 = 0; sq_mpsc_len(&q->mpsc) + n > q->maxlen; ) {
+		sq_stat_hwm(q, q->maxlen);
+
+		if (q->flags & (SQ_FLAG_NOWAIT | SQ_FLAG_DROP_NEWEST)) {
+			sq_overrun(q, n);
+			return SQ_ERR_FULL;
+		}
+
+		if (t0 == 0) {
+			t0 = sq_now_ns();
+		}
+
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+			sq_stat_blocked(q, t0);
+			return SQ_ERR_CLOSED;
+		}
+
+		if (deadline && sq_now_ns() >= deadline) {
+			sq_stat_blocked(q, t0);
+			return SQ_ERR_TIMEOUT;
+		}
+
+		if (!sq_spin(q, sq_spin_room, NULL, deadline)) {
+			sched_yield();
+		}
+	}
+
+	if (t0) {
+		sq_stat_blocked(q, t0);
+	}
+
+	/* counted first, so sq_len() and the consumer's re-check before sleeping never come up short */
+	pos = __atomic_fetch_add(&q->mpsc.pushes, n, __ATOMIC_SEQ_CST);
+
+	/* and before looking at closed, so either sq_ended() sees the count or we see closed */
+	if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&q->mpsc.pushes, n, __ATOMIC_RELEASE);
+		return SQ_ERR_CLOSED;
+	}
+
+	prev = sq_mpsc_append(&q->mpsc, first, last);
+	sq_stat_hwm_sample(q, pos);
+
+	sq_wake_notempty(q, 1);
+	sq_notify_mpsc(q, prev);
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * links the NULL terminated chain first..last (n elements) onto the end of a list queue,
+ * q->mtx must be held. SQ_FLAG_PRIO queues get each element linked onto the end of its own
+ * priority's sublist instead, SQ_FLAG_DELAY queues put each one in the heap by its due
+ * time (e->ts), which there must be room for, and SQ_FLAG_CONFLATE queues give each one an
+ * entry in the key index (there must be free entries, and the keys must not be queued yet).
+ */
+static void sq_link(sq_t *q, sq_elem_t *first, sq_elem_t *last, unsigned int n)
+{
+	sq_prio_t *p;
+	sq_elem_t *e;
+	unsigned int lvl;
+
+	if (q->delay) {
+		for (e = first; e; e = e->next) {
+			sq_delay_add(q->delay, e, e->ts);
+		}
+
+	} else if (q->conflate) {
+		for (e = first; e; e = e->next) {
+			sq_conflate_add(q->conflate, e);
+		}
+
+	} else if ((p = q->prio)) {
+		while (first) {
+			e = first;
+			first = first->next;
+			e->next = NULL;
+
+			lvl = e->prio;
+			if (p->head[lvl]) {
+				p->tail[lvl]->next = e;
+
+			} else {
+				p->head[lvl] = e;
+				p->map |= 1U << lvl;
+			}
+
+			p->tail[lvl] = e;
+		}
+
+	} else {
+		if (q->head == NULL) {
+			q->head = first;
+
+		} else {
+			q->tail->next = first;
+		}
+
+		q->tail = last;
+	}
+
+	q->len += n;
+}
+
+
+/*
+ * unlinks the element pop() should hand out next from a list queue, q->mtx must be held and
+ * the queue must not be empty. on SQ_FLAG_PRIO queues that's the oldest element of the highest
+ * non-empty priority, found straight from the bitmap. with lowest set, it's the element
+ * SQ_FLAG_DROP_OLDEST should throw away instead: the oldest one of the lowest priority.
+ * SQ_FLAG_DELAY queues give up the element that's due first, due or not, and SQ_FLAG_CONFLATE
+ * queues the latest element of the key that was queued first.
+ */
+static sq_elem_t *sq_unlink(sq_t *q, int lowest)
+{
+	sq_prio_t *p;
+	sq_elem_t *e;
+	unsigned int lvl;
+
+	if (q->delay) {
+		e = sq_delay_take(q->delay);
+		e->next = NULL;
+
+	} else if (q->conflate) {
+		e = sq_conflate_take(q->conflate);
+		e->next = NULL;
+
+	} else if ((p = q->prio)) {
+		lvl = lowest ? __builtin_ctz(p->map) : 31 - __builtin_clz(p->map);
+		e = p->head[lvl];
+		if ((p->head[lvl] = e->next) == NULL) {
+			p->map &= ~(1U << lvl);
+		}
+
+	} else {
+		e = q->head;
+		q->head = e->next;
+	}
+
+	/* journaled queues are always in order, so the read cursor just follows the head */
+	if (q->journal) {
+		sq_journal_consume(q->journal, e->data);
+	}
+
+	q->len--;
+	return e;
+}
+
+
+/*
+ * returns nonzero if a list queue has an element pop() may take at time now (only looked at
+ * by SQ_FLAG_DELAY queues, 0 reads the clock if it's needed). q->mtx must be held.
+ */
+static int sq_ready(sq_t *q, unsigned long long now)
+{
+	if (q->len == 0) {
+		return 0;
+	}
+
+	if (q->delay) {
+		return sq_delay_next(q->delay) <= (now ? now : sq_now_ns());
+	}
+
+	return 1;
+}
+
+
+/*
+ * takes the next element off a list queue, q->mtx must be held
+ * copies the queue stats over to the element and wakes up anyone waiting to push
+ *
+ * returns the element or NULL if the queue is empty (or nothing in it is due yet)
+ */
+static sq_elem_t *sq_dequeue(sq_t *q)
+{
+	sq_elem_t *new_e;
+
+	if (!sq_ready(q, 0)) {
+		return NULL;
+	}
+
+	new_e = sq_unlink(q, 0);
+
+	/* Copy the queue stats over to the popped element and clear them. */
+	sq_qstate_move(q, new_e);
+
+	sq_stat_add_1w(&q->pops, 1);
+	if (q->flags & SQ_FLAG_TIMESTAMP) {
+		sq_stat_residency(q, new_e, sq_now_ns());
+	}
+
+	/* wake up anyone waiting to push to this queue */
+	pthread_cond_broadcast(&q->notfull);
+	return new_e;
+}
+
+
+/*
+ * SQ_FLAG_JOURNAL: copies an element's data into the journal and points the element at it
+ * instead, q->mtx must be held. whatever data the element had before is let go of here.
+ *
+ * returns 0, or -1 if the journal is full
+ */
+static int sq_journal_add(sq_t *q, sq_elem_t *e)
+{
+	void *data;
+
+	if ((data = sq_journal_append(q->journal, e->data, e->dlen)) == NULL) {
+		return -1;
+	}
+
+	if (e->flags & SQ_FLAG_SHARED) {
+		sq_shared_put(e->shared, 1);
+
+	} else if (e->flags & SQ_FLAG_FREE) {
+		free(e->data);
+	}
+
+	e->data = data;
+	e->shared = NULL;
+	e->flags = (e->flags & ~(SQ_MASK_ALLOC | SQ_FLAG_SHARED)) | SQ_FLAG_VOLATILE | SQ_FLAG_JOURNAL;
+	return 0;
+}
+
+
+/*
+ * makes the element push() adds to the queue. a journaled queue copies the data into the
+ * journal once it has the lock, so SQ_FLAG_VOLATILE data isn't copied into the element first;
+ * the element just points at the caller's data until then. that data stays the caller's, the
+ * same as with a copy, so SQ_FLAG_FREE goes too and sq_journal_add() doesn't free it.
+ */
+static sq_elem_t *sq_elem_make(sq_t *q, const sq_elem_t *e)
+{
+	sq_elem_t tmpl;
+
+	if (q->journal && (e->flags & SQ_FLAG_VOLATILE)) {
+		tmpl = *e;
+		tmpl.flags &= ~(SQ_FLAG_VOLATILE | SQ_MASK_ALLOC);
+		return sq_elem_new(q->pool, &tmpl);
+	}
+
+	return sq_elem_new(q->pool, e);
+}
+
+
+/* like sq_elem_put(), but for the producer giving back an element that didn't go in */
+static void sq_elem_unmake(sq_elem_t *e)
+{
+	if (e->flags & SQ_FLAG_POOL) {
+		sq_pool_unget(e->pool, e);
+
+	} else {
+		free(e);
+	}
+}
+
+
+/*
+ * adds an element made by sq_elem_new() to the queue; new_e == NULL means there was no
+ * memory for it. if the element can't be added, it is given back with sq_elem_unmake().
+ * a full queue is waited on until deadline (CLOCK_MONOTONIC nsec, 0 waits forever) unless
+ * the queue has an overflow policy or SQ_FLAG_NOWAIT. on an SQ_FLAG_DELAY queue the element
+ * can be popped from due (same clock) on, 0 means straight away.
+ *
+ * returns SQ_ERR_NO_ERROR on successfull add, other SQ_ERR as needed
+ */
+static int sq_push_elem(sq_t *q, sq_elem_t *new_e, unsigned long long due, unsigned long long deadline)
+{
+	sq_elem_t *old_e;
+	unsigned long long t0, jpos;
+	unsigned long pos;
+	int ret, was_empty;
+
+	/* delay queues keep the due time where the push time would go */
+	if (new_e && (q->flags & SQ_FLAG_DELAY)) {
+		new_e->ts = due ? due : sq_now_ns();
+
+	} else if (new_e && (q->flags & SQ_FLAG_TIMESTAMP)) {
+		new_e->ts = sq_now_ns();
+	}
+
+	/* nothing goes into a closed queue; not an overrun, the caller knows it didn't go in */
+	if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+		if (new_e) {
+			sq_elem_unmake(new_e);
+		}
+
+		return SQ_ERR_CLOSED;
+	}
+
+	if (q->flags & SQ_MASK_LOCKFREE) {
+		if (new_e == NULL) {
+			sq_overrun(q, 1);
+			return SQ_ERR_NOMEM;
+		}
+
+		if (q->flags & SQ_FLAG_MPSC) {
+			if ((ret = sq_push_mpsc(q, new_e, new_e, 1, deadline)) != SQ_ERR_NO_ERROR) {
+				sq_elem_unmake(new_e);
+			}
+
+			return ret;
+		}
+
+		if (q->flags & SQ_FLAG_SPSC) {
+			if (sq_push_enter(q)) {
+				sq_elem_unmake(new_e);
+				return SQ_ERR_CLOSED;
+			}
+
+			ret = sq_push_spsc(q, new_e, &pos, deadline);
+			sq_push_leave(q);
+
+		} else {
+			ret = sq_push_ring(q, new_e, &pos, deadline);
+		}
+
+		if (ret != SQ_ERR_NO_ERROR) {
+			sq_elem_unmake(new_e);
+			return ret;
+		}
+
+		sq_wake_notempty(q, 1);
+		sq_notify_lockfree(q, pos, pos);
+		return SQ_ERR_NO_ERROR;
+	}
+
+	if (sq_lock(q) != SQ_ERR_NO_ERROR) {
+		if (new_e) {
+			sq_elem_unmake(new_e);
+		}
+
+		return SQ_ERR_WOULDBLOCK;
+	}
+
+	if (new_e == NULL) {
+
+		/* count an overrun because we had no memory to add data, so data got lost */
+		sq_overrun(q, 1);
+		pthread_mutex_unlock(&q->mtx);
+		return SQ_ERR_NOMEM;
+	}
+
+	old_e = NULL;
+	t0 = 0;
+	for (;;) {
+
+		/* closed since we looked, or while we were waiting for room; see below */
+		if (q->closed) {
+			break;
+		}
+
+		/*
+		 * a key that's already queued keeps its place and just gets the new element, full or
+		 * not. looked up again after every wait, another producer may have queued the key since.
+		 */
+		if (q->conflate && (old_e = sq_conflate_replace(q->conflate, new_e))) {
+			sq_stat_add_1w(&q->pushes, 1);
+			sq_stat_add_1w(&q->conflated, 1);
+			pthread_mutex_unlock(&q->mtx);
+			if (t0) {
+				sq_stat_blocked(q, t0);
+			}
+
+			sq_elem_release(old_e);
+			return SQ_ERR_NO_ERROR;
+		}
+
+		if (q->len < q->maxlen) {
+			break;
+		}
+
+		/* make room by throwing away the oldest element, released once we've unlocked */
+		if (q->flags & SQ_FLAG_DROP_OLDEST) {
+			old_e = sq_unlink(q, 1);
+			sq_overrun(q, 1);
+			break;
+		}
+
+		if (q->flags & (SQ_FLAG_NOWAIT | SQ_FLAG_DROP_NEWEST)) {
+			sq_overrun(q, 1);
+			pthread_mutex_unlock(&q->mtx);
+			sq_elem_unmake(new_e);
+			return SQ_ERR_FULL;
+		}
+
+		/* queue is full; wait on q->notfull which changes when someone has pop()'d */
+		if (t0 == 0) {
+			t0 = sq_now_ns();
+		}
+
+		if (sq_spin_list_room(q, deadline)) {
+			continue;
+		}
+
+		if (sq_cond_timedwait(&q->notfull, &q->mtx, deadline) == ETIMEDOUT && q->len >= q->maxlen) {
+			pthread_mutex_unlock(&q->mtx);
+			sq_stat_blocked(q, t0);
+			sq_elem_unmake(new_e);
+			return SQ_ERR_TIMEOUT;
+		}
+	}
+
+	if (t0) {
+		sq_stat_blocked(q, t0);
+	}
+
+	/* this is the check that counts, q->mtx is held from here until the element is linked */
+	if (q->closed) {
+		pthread_mutex_unlock(&q->mtx);
+		sq_elem_unmake(new_e);
+		return SQ_ERR_CLOSED;
+	}
+
+	/* a heap or key index that can't grow is as good as running out of memory */
+	if ((q->delay && sq_delay_reserve(q->delay, 1)) || (q->conflate && sq_conflate_reserve(q->conflate, 1))) {
+		sq_overrun(q, 1);
+		pthread_mutex_unlock(&q->mtx);
+		sq_elem_release(old_e);
+		sq_elem_unmake(new_e);
+		return SQ_ERR_NOMEM;
+	}
+
+	/* a full journal is as good as running out of memory */
+	jpos = 0;
+	if (q->journal) {
+		if (sq_journal_add(q, new_e)) {
+			sq_overrun(q, 1);
+			pthread_mutex_unlock(&q->mtx);
+			sq_elem_release(old_e);
+			sq_elem_unmake(new_e);
+			return SQ_ERR_NOMEM;
+		}
+
+		jpos = sq_journal_wpos(q->journal);
+	}
+
+	was_empty = q->len == 0;
+	sq_link(q, new_e, new_e, 1);
+	sq_stat_add_1w(&q->pushes, 1);
+	sq_stat_hwm(q, q->len);
+
+	/* wake up a consumer sleeping in sq_pop_wait() */
+	if (q->ne_waiters) {
+		pthread_cond_signal(&q->notempty);
+	}
+
+	pthread_mutex_unlock(&q->mtx);
+
+	sq_elem_release(old_e);
+
+	if (q->journal) {
+		sq_journal_commit(q->journal, jpos);
+	}
+
+	/* listeners only need to hear about the queue going from empty to non-empty */
+	if (was_empty) {
+		sq_notify(q);
+	}
+
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * creates an element and adds it to the queue.
+ * the element comes from the queue's pool if it has one, otherwise it is malloc()'d.
+ * if the element has SQ_FLAG_VOLATILE, the data is copied in as well
+ * the copy is made before taking the queue lock so other producers aren't held up by it
+ * if the queue was empty, walks through the listener list and notifies anyone waiting
+ *
+ * returns SQ_ERR_NO_ERROR on successfull add, other SQ_ERR as needed
+ */
+int sq_push(sq_t *q, sq_elem_t *e)
+{
+	return sq_push_elem(q, sq_elem_make(q, e), 0, 0);
+}
+
+
+/*
+ * like sq_push(), but if the queue is full only waits timeout_ns nanoseconds for room
+ * on a queue with an overflow policy (SQ_FLAG_DROP_OLDEST, SQ_FLAG_DROP_NEWEST) or
+ * SQ_FLAG_NOWAIT this is the same as sq_push(), since those never wait for room anyway.
+ * an element that timed out isn't counted as an overrun, the caller still has it.
+ *
+ * returns SQ_ERR_NO_ERROR on successfull add, SQ_ERR_TIMEOUT if there was no room in time,
+ * other SQ_ERR as needed
+ */
+int sq_push_timed(sq_t *q, sq_elem_t *e, unsigned long long timeout_ns)
+{
+	return sq_push_elem(q, sq_elem_make(q, e), 0, sq_now_ns() + timeout_ns);
+}
+
+
+/*
+ * like sq_push(), but on an SQ_FLAG_DELAY queue the element can't be popped until due
+ * (sq_now_ns() time, i.e. CLOCK_MONOTONIC nsec); a due time in the past is due straight away.
+ * on any other queue due is ignored and this is the same as sq_push().
+ *
+ * returns SQ_ERR_NO_ERROR on successfull add, other SQ_ERR as needed
+ */
+int sq_push_at(sq_t *q, sq_elem_t *e, unsigned long long due)
+{
+	return sq_push_elem(q, sq_elem_make(q, e), due, 0);
+}
+
+
+/*
+ * sq_get_fd(): clears the queue's eventfd once a pop() has found (or left) the queue empty,
+ * then re-arms it if a push got in meanwhile. a push only writes the fd when the queue goes
+ * from empty to non-empty, so between the two the fd is readable exactly while there's data.
+ * a closed queue's fd is re-armed too, so the consumer comes back and gets SQ_ERR_CLOSED.
+ */
+static void sq_fd_clear(sq_t *q)
+{
+	uint64_t cnt, one = 1;
+
+	while (read(q->efd, &cnt, sizeof(cnt)) < 0 && errno == EINTR) ;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!sq_empty(q) || __atomic_load_n(&q->closed, __ATOMIC_RELAXED)) {
+		while (write(q->efd, &one, sizeof(one)) < 0 && errno == EINTR) ;
+	}
+}
+
+
+/* sq_get_fd(): called after every pop(), clears the queue's eventfd if the queue is (now) empty */
+static void sq_fd_check(sq_t *q)
+{
+	if (sq_empty(q)) {
+		sq_fd_clear(q);
+	}
+}
+
+
+/* sq_pop() without the eventfd upkeep */
+static int sq_pop_next(sq_t *q, sq_elem_t **e)
+{
+	if (q->flags & (SQ_FLAG_SPSC | SQ_FLAG_MPSC)) {
+		return sq_pop_single(q, e);
+
+	} else if (q->flags & SQ_FLAG_RING) {
+		return sq_pop_ring(q, e);
+	}
+
+	if (sq_lock(q) != SQ_ERR_NO_ERROR) {
+		return SQ_ERR_WOULDBLOCK;
+	}
+
+	*e = sq_dequeue(q);
+	pthread_mutex_unlock(&q->mtx);
+
+	return *e ? SQ_ERR_NO_ERROR : SQ_ERR_EMPTY;
+}
+
+
+/*
+ * retrieves the next element from the queue
+ * the element returned must be freed by the caller when they are done with it, either with
+ * sq_elem_release() or (if it doesn't have SQ_FLAG_POOL set) free()
+ *
+ * if the element has SQ_FLAG_VOLATILE set, then the caller must take care not to
+ * free the element itself until they are done with the data as well, because the
+ * element data was allocated with the element struct when it was pushed.
+ *
+ * If the element has SQ_FLAG_FREE set, then the caller must separately free()
+ * the element data pointer.
+ *
+ * the returned element flags are also updated to include information about the
+ * queue itself; SQ_FLAG_OVERRUN is particularly useful to know if there was
+ * data loss due to the queue being full, and e->overruns says how many elements
+ * were lost since the previous pop().
+ *
+ * e is updated with the queue element retreived or is set to NULL if the queue is empty.
+ *
+ * returns SQ_ERR_NO_ERROR on success, SQ_ERR_CLOSED once the queue has been closed and
+ * emptied, various SQ_ERR otherwise.
+ */
+int sq_pop(sq_t *q, sq_elem_t **e)
+{
+	int ret;
+
+	if ((ret = sq_pop_next(q, e)) == SQ_ERR_EMPTY && sq_ended(q)) {
+		ret = SQ_ERR_CLOSED;
+	}
+
+	if (q->efd >= 0) {
+		sq_fd_check(q);
+	}
+
+	if (q->journal) {
+		sq_journal_commit(q->journal, 0);
+	}
+
+	return ret;
+}
+
+
+/*
+ * common part of sq_pop_wait() and sq_pop_timed()
+ * deadline is in CLOCK_MONOTONIC nsec, 0 waits forever
+ */
+static int sq_pop_deadline(sq_t *q, sq_elem_t **e, unsigned long long deadline)
+{
+	unsigned long long until;
+	unsigned int seq, off;
+	int ret;
+
+	/* not allowed to sleep */
+	if (q->flags & SQ_FLAG_NOWAIT) {
+		return sq_pop(q, e);
+	}
+
+	/* adaptive wait: poll for a while before going to sleep, it's a lot quicker to wake up from */
+	if ((q->spin || q->yield) && sq_spin(q, sq_spin_pop, e, deadline)) {
+		return SQ_ERR_NO_ERROR;
+	}
+
+	/*
+	 * lock-free modes: announce ourselves in ne_waiters, re-check, then sleep on the ne_seq
+	 * futex. a push either sees us waiting and bumps ne_seq, or happened before the re-check.
+	 */
+	if (q->flags & SQ_MASK_LOCKFREE) {
+		for (;;) {
+			if ((ret = sq_pop(q, e)) != SQ_ERR_EMPTY) {
+				return ret;
+			}
+
+			/*
+			 * the first waiters turn on the producers' side of this, see sq_wake_notempty().
+			 * anyone who sees it half on does the barrier too, the first one may not be done.
+			 */
+			if (__atomic_load_n(&q->ne_used, __ATOMIC_ACQUIRE) != SQ_NE_ON) {
+				off = SQ_NE_OFF;
+				__atomic_compare_exchange_n(&q->ne_used, &off, SQ_NE_ARMING, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				sq_membarrier();
+				__atomic_store_n(&q->ne_used, SQ_NE_ON, __ATOMIC_RELEASE);
+			}
+
+			seq = __atomic_load_n(&q->ne_seq, __ATOMIC_ACQUIRE);
+			__atomic_add_fetch(&q->ne_waiters, 1, __ATOMIC_SEQ_CST);
+
+			/* sq_close() bumps ne_seq after setting closed, so it can't get in between either */
+			if (sq_empty(q) && !__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+				sq_futex_wait(&q->ne_seq, seq, deadline);
+
+			/* SQ_FLAG_MPSC: counted but not linked in yet; closed: a push may still be landing. let its producer finish */
+			} else if ((q->flags & SQ_FLAG_MPSC) || __atomic_load_n(&q->closed, __ATOMIC_RELAXED)) {
+				sched_yield();
+			}
+
+			__atomic_sub_fetch(&q->ne_waiters, 1, __ATOMIC_RELAXED);
+
+			if (deadline && sq_now_ns() >= deadline) {
+				ret = sq_pop(q, e);
+				return ret == SQ_ERR_EMPTY ? SQ_ERR_TIMEOUT : ret;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&q->mtx);
+	while (!sq_ready(q, 0)) {
+
+		/* closed, and there's nothing left that could come due */
+		if (q->closed && q->len == 0) {
+			pthread_mutex_unlock(&q->mtx);
+			*e = NULL;
+			return SQ_ERR_CLOSED;
+		}
+
+		/* SQ_FLAG_DELAY: sleep until the next element is due, a push of an earlier one wakes us */
+		until = deadline;
+		if (q->len && (until == 0 || sq_delay_next(q->delay) < until)) {
+			until = sq_delay_next(q->delay);
+		}
+
+		q->ne_waiters++;
+		ret = sq_cond_timedwait(&q->notempty, &q->mtx, until);
+		q->ne_waiters--;
+
+		if (ret == ETIMEDOUT && until == deadline && !sq_ready(q, 0)) {
+			pthread_mutex_unlock(&q->mtx);
+			*e = NULL;
+			return SQ_ERR_TIMEOUT;
+		}
+	}
+
+	*e = sq_dequeue(q);
+	pthread_mutex_unlock(&q->mtx);
+
+	if (q->efd >= 0) {
+		sq_fd_check(q);
+	}
+
+	if (q->journal) {
+		sq_journal_commit(q->journal, 0);
+	}
+
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * like sq_pop(), but if the queue is empty, sleeps until something is pushed (or the queue
+ * is closed) on an SQ_FLAG_NOWAIT queue this is the same as sq_pop()
+ *
+ * returns SQ_ERR_NO_ERROR on success, SQ_ERR_CLOSED once the queue has been closed and
+ * emptied, various SQ_ERR otherwise.
+ */
+int sq_pop_wait(sq_t *q, sq_elem_t **e)
+{
+	return sq_pop_deadline(q, e, 0);
+}
+
+
+/*
+ * like sq_pop_wait(), but gives up after timeout_ns nanoseconds
+ *
+ * returns SQ_ERR_NO_ERROR on success, SQ_ERR_TIMEOUT if nothing was pushed in time,
+ * various SQ_ERR otherwise.
+ */
+int sq_pop_timed(sq_t *q, sq_elem_t **e, unsigned long long timeout_ns)
+{
+	return sq_pop_deadline(q, e, sq_now_ns() + timeout_ns);
+}
+
+
+/*
+ * pushes a whole chain of elements (linked through e->next, NULL terminated) in one go.
+ * every element is copied just like sq_push() would, all before taking the queue lock, and
+ * then the copies are spliced onto the end of the queue with a single lock hold and at most a
+ * single wakeup of the listeners. if the queue fills up part way through, does whatever sq_push()
+ * would: waits for room, throws away the oldest elements (SQ_FLAG_DROP_OLDEST) or drops the
+ * rest of the chain (SQ_FLAG_NOWAIT, SQ_FLAG_DROP_NEWEST).
+ *
+ * n, if not NULL, is updated with the number of elements actually pushed; they are always
+ * the first *n elements of the chain.
+ *
+ * returns SQ_ERR_NO_ERROR if the whole chain was pushed, other SQ_ERR as needed
+ */
+int sq_push_many(sq_t *q, sq_elem_t *e, unsigned int *n)
+{
+	sq_elem_t *first, *last, *new_e, *old_e;
+	unsigned long long now, t0, jpos;
+	unsigned long pos, pos_first, pos_last;
+	unsigned int pushed, fresh, lost, jfull;
+	int ret, ret2;
+
+	/* don't bother copying anything for a closed queue */
+	if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+		if (n) {
+			*n = 0;
+		}
+
+		return SQ_ERR_CLOSED;
+	}
+
+	now = (q->flags & (SQ_FLAG_TIMESTAMP | SQ_FLAG_DELAY)) ? sq_now_ns() : 0;
+
+	/* make our own copies of the chain first */
+	first = last = NULL;
+	for (ret = SQ_ERR_NO_ERROR, lost = 0; e; e = e->next) {
+		if ((new_e = sq_elem_make(q, e)) == NULL) {
+			for (ret = SQ_ERR_NOMEM; e; e = e->next, lost++) ;
+			break;
+		}
+
+		new_e->ts = now;
+
+		if (last) {
+			last->next = new_e;
+
+		} else {
+			first = new_e;
+		}
+
+		last = new_e;
+	}
+
+	pushed = fresh = jfull = 0;
+	old_e = NULL;
+	t0 = jpos = 0;
+	/* the chain is thrown away below */
+	if ((q->flags & SQ_FLAG_SPSC) && sq_push_enter(q)) {
+		ret = SQ_ERR_CLOSED;
+
+	} else if (q->flags & SQ_FLAG_MPSC) {
+		if (lost) {
+			sq_overrun(q, lost);
+		}
+
+		/* as much of the chain as there's room for goes in with a single exchange */
+		while (first) {
+			unsigned int len, room, i;
+
+			len = sq_mpsc_len(&q->mpsc);
+			room = len < q->maxlen ? q->maxlen - len : 1;
+			for (i = 1, last = first; i < room && last->next; i++, last = last->next) ;
+
+			new_e = first;
+			first = last->next;
+			last->next = NULL;
+
+			/* a full queue has already counted these as lost */
+			if ((ret2 = sq_push_mpsc(q, new_e, last, i, 0)) != SQ_ERR_NO_ERROR) {
+				while (new_e) {
+					last = new_e;
+					new_e = new_e->next;
+					sq_elem_unmake(last);
+				}
+
+				ret = ret2;
+				break;
+			}
+
+			pushed += i;
+		}
+
+	} else if (q->flags & (SQ_FLAG_RING | SQ_FLAG_SPSC)) {
+		if (lost) {
+			sq_overrun(q, lost);
+		}
+
+		/* no lock to amortize here, but the wakeup still only happens once */
+		while (first) {
+			new_e = first;
+			first = first->next;
+			new_e->next = NULL;
+
+			if (q->flags & SQ_FLAG_SPSC) {
+				ret2 = sq_push_spsc(q, new_e, &pos, 0);
+
+			} else {
+				ret2 = sq_push_ring(q, new_e, &pos, 0);
+			}
+
+			if (ret2 != SQ_ERR_NO_ERROR) {
+				sq_elem_unmake(new_e);
+				ret = ret2;
+				break;
+			}
+
+			if (pushed++ == 0) {
+				pos_first = pos;
+			}
+
+			pos_last = pos;
+		}
+
+		if (q->flags & SQ_FLAG_SPSC) {
+			sq_push_leave(q);
+		}
+
+		if (pushed) {
+			sq_wake_notempty(q, INT_MAX);
+			sq_notify_lockfree(q, pos_first, pos_last);
+		}
+
+	} else if (sq_lock(q) != SQ_ERR_NO_ERROR) {
+		ret = SQ_ERR_WOULDBLOCK;
+
+	} else {
+		if (lost) {
+			sq_overrun(q, lost);
+		}
+
+		while (first) {
+			unsigned int room, i;
+
+			/* checked with the lock held, and again after every wait for room */
+			if (q->closed) {
+				ret = SQ_ERR_CLOSED;
+				break;
+			}
+
+			/* a key that's already queued takes no room, its element is just replaced */
+			if (q->conflate && (new_e = sq_conflate_replace(q->conflate, first))) {
+				e = first;
+				first = first->next;
+				e->next = NULL;
+
+				new_e->next = old_e;
+				old_e = new_e;
+				pushed++;
+				sq_stat_add_1w(&q->pushes, 1);
+				sq_stat_add_1w(&q->conflated, 1);
+				continue;
+			}
+
+			if (q->len >= q->maxlen) {
+
+				/* make room by throwing away the oldest element, released once we've unlocked */
+				if (q->flags & SQ_FLAG_DROP_OLDEST) {
+					new_e = sq_unlink(q, 1);
+					new_e->next = old_e;
+					old_e = new_e;
+					sq_overrun(q, 1);
+					continue;
+				}
+
+				if (q->flags & (SQ_FLAG_NOWAIT | SQ_FLAG_DROP_NEWEST)) {
+					ret = SQ_ERR_FULL;
+					break;
+				}
+
+				/* if the queue was empty, let listeners know about what we've added so far before waiting for them */
+				if (fresh) {
+					pthread_mutex_unlock(&q->mtx);
+					sq_notify(q);
+					fresh = 0;
+					pthread_mutex_lock(&q->mtx);
+					continue;
+				}
+
+				if (t0 == 0) {
+					t0 = sq_now_ns();
+				}
+
+				if (!sq_spin_list_room(q, 0)) {
+					pthread_cond_wait(&q->notfull, &q->mtx);
+				}
+				continue;
+			}
+
+			/* cut off as much of the chain as there's room for (in the journal too, if there is one) */
+			room = q->maxlen - q->len;
+			if (q->journal) {
+				for (i = 0, last = NULL, e = first; i < room && e; i++, last = e, e = e->next) {
+					if (sq_journal_add(q, e)) {
+						ret = SQ_ERR_NOMEM;
+						jfull = 1;
+						break;
+					}
+				}
+
+				if (i == 0) {
+					break;
+				}
+
+			} else {
+				/* conflating queues go one element at a time, any of them might replace another */
+				for (i = 1, last = first; i < room && last->next && !q->conflate; i++, last = last->next) ;
+
+				/* a heap or key index that can't grow is as good as running out of memory */
+				if ((q->delay && sq_delay_reserve(q->delay, i)) || (q->conflate && sq_conflate_reserve(q->conflate, i))) {
+					ret = SQ_ERR_NOMEM;
+					jfull = 1;
+					break;
+				}
+			}
+
+			new_e = first;
+			first = last->next;
+			last->next = NULL;
+
+			/* listeners only need to hear about the queue going from empty to non-empty */
+			if (q->len == 0) {
+				fresh = 1;
+			}
+
+			sq_link(q, new_e, last, i);
+			pushed += i;
+			sq_stat_add_1w(&q->pushes, i);
+			sq_stat_hwm(q, q->len);
+
+			if (q->ne_waiters) {
+				pthread_cond_broadcast(&q->notempty);
+			}
+
+			if (jfull) {
+				break;
+			}
+		}
+
+		if (q->journal) {
+			jpos = sq_journal_wpos(q->journal);
+		}
+
+		pthread_mutex_unlock(&q->mtx);
+
+		if (t0) {
+			sq_stat_blocked(q, t0);
+		}
+	}
+
+	/* whatever didn't make it in gets thrown away; a full queue means it's lost for good */
+	for (lost = 0; first; lost++) {
+		new_e = first;
+		first = first->next;
+		sq_elem_unmake(new_e);
+	}
+
+	if (lost && (ret == SQ_ERR_FULL || jfull)) {
+		sq_overrun(q, lost);
+	}
+
+	/* and so do the elements SQ_FLAG_DROP_OLDEST pushed out of the queue */
+	while (old_e) {
+		new_e = old_e;
+		old_e = old_e->next;
+		sq_elem_release(new_e);
+	}
+
+	if (pushed && q->journal) {
+		sq_journal_commit(q->journal, jpos);
+	}
+
+	if (fresh) {
+		sq_notify(q);
+	}
+
+	if (n) {
+		*n = pushed;
+	}
+
+	return ret;
+}
+
+
+/*
+ * pops up to max elements off the queue in one go, with a single lock hold and a single
+ * wakeup of any waiting producers. elems[] is filled in with the elements in queue order,
+ * and they are also still linked together through e->next (the last one's next is NULL),
+ * so the caller can walk them either way. each element must be released as with sq_pop().
+ * any queue state (SQ_MASK_QSTATE) is copied into the first element.
+ * with all set, SQ_FLAG_DELAY elements are taken whether they're due or not (sq_drain()).
+ *
+ * n is updated with the number of elements returned.
+ *
+ * returns SQ_ERR_NO_ERROR if at least one element was popped, other SQ_ERR as needed
+ */
+static int sq_pop_batch(sq_t *q, sq_elem_t **elems, unsigned int max, unsigned int *n, int all)
+{
+	sq_elem_t *new_e;
+	unsigned long long now;
+	unsigned int i, j;
+
+	*n = 0;
+	if (max == 0) {
+		return SQ_ERR_NO_ERROR;
+	}
+
+	if (q->flags & SQ_MASK_LOCKFREE) {
+		for (i = 0; i < max; i++) {
+			new_e = sq_pop_lockfree(q);
+
+			/* found it empty straight away, have another look like sq_pop() does */
+			if (new_e == NULL && i == 0 && sq_pop_recheck(q)) {
+				new_e = sq_pop_lockfree(q);
+			}
+
+			if (new_e == NULL) {
+				break;
+			}
+
+			new_e->flags &= ~SQ_MASK_QSTATE;
+			new_e->overruns = 0;
+			new_e->next = NULL;
+			if (i) {
+				elems[i - 1]->next = new_e;
+			}
+
+			elems[i] = new_e;
+		}
+
+		if (i == 0) {
+			return SQ_ERR_EMPTY;
+		}
+
+		sq_qstate_move(q, elems[0]);
+		if (q->flags & SQ_FLAG_TIMESTAMP) {
+			for (j = 0, now = sq_now_ns(); j < i; j++) {
+				sq_stat_residency(q, elems[j], now);
+			}
+		}
+
+		if (q->flags & SQ_FLAG_RING) {
+			sq_wake_notfull(q);
+		}
+
+		*n = i;
+		return SQ_ERR_NO_ERROR;
+	}
+
+	if (sq_lock(q) != SQ_ERR_NO_ERROR) {
+		return SQ_ERR_WOULDBLOCK;
+	}
+
+	now = all ? ~0ULL : q->delay ? sq_now_ns() : 0;
+	if (!sq_ready(q, now)) {
+		pthread_mutex_unlock(&q->mtx);
+		return SQ_ERR_EMPTY;
+	}
+
+	/* take the next max elements (or all of them, or all that are due) */
+	for (i = 0; i < max && sq_ready(q, now); i++) {
+		new_e = sq_unlink(q, 0);
+		new_e->flags &= ~SQ_MASK_QSTATE;
+		new_e->overruns = 0;
+		new_e->next = NULL;
+		if (i) {
+			elems[i - 1]->next = new_e;
+		}
+
+		elems[i] = new_e;
+	}
+
+	/* copy the queue stats over and clear them */
+	sq_qstate_move(q, elems[0]);
+
+	sq_stat_add_1w(&q->pops, i);
+	if (q->flags & SQ_FLAG_TIMESTAMP) {
+		for (j = 0, now = sq_now_ns(); j < i; j++) {
+			sq_stat_residency(q, elems[j], now);
+		}
+	}
+
+	pthread_cond_broadcast(&q->notfull);
+	pthread_mutex_unlock(&q->mtx);
+
+	*n = i;
+	return SQ_ERR_NO_ERROR;
+}
+
+
+int sq_pop_many(sq_t *q, sq_elem_t **elems, unsigned int max, unsigned int *n)
+{
+	int ret;
+
+	if ((ret = sq_pop_batch(q, elems, max, n, 0)) == SQ_ERR_EMPTY && sq_ended(q)) {
+		ret = SQ_ERR_CLOSED;
+	}
+
+	if (q->efd >= 0) {
+		sq_fd_check(q);
+	}
+
+	if (q->journal) {
+		sq_journal_commit(q->journal, 0);
+	}
+
+	return ret;
+}
+
+
+/*
+ * pops everything in the queue in one go, to hand over to whatever takes over from its
+ * consumers. it's taken SQ_DRAIN_BATCH elements per lock hold, and on an SQ_FLAG_DELAY queue
+ * that includes the elements that aren't due yet. it keeps going for as long as there's
+ * anything there, so close the queue first unless the producers have stopped anyway.
+ *
+ * e is set to the first element, with the rest linked to it through e->next in queue order
+ * (NULL if there weren't any), and n to the number of elements. each of them must be released
+ * as with sq_pop().
+ *
+ * returns SQ_ERR_NO_ERROR once the queue is empty, or SQ_ERR_WOULDBLOCK if an SQ_FLAG_NOWAIT
+ * queue's lock was taken (e and n then have whatever was drained until then)
+ */
+int sq_drain(sq_t *q, sq_elem_t **e, unsigned int *n)
+{
+	sq_elem_t *elems[SQ_DRAIN_BATCH], *last;
+	unsigned int got;
+	int ret;
+
+	*e = last = NULL;
+	*n = 0;
+	for (;;) {
+		if ((ret = sq_pop_batch(q, elems, SQ_DRAIN_BATCH, &got, 1)) == SQ_ERR_NO_ERROR) {
+			if (last) {
+				last->next = elems[0];
+
+			} else {
+				*e = elems[0];
+			}
+
+			last = elems[got - 1];
+			*n += got;
+			continue;
+		}
+
+		/* a lock-free push that's part way in, let its producer finish */
+		if (ret == SQ_ERR_EMPTY && (q->flags & SQ_MASK_LOCKFREE) && sq_landing(q)) {
+			sched_yield();
+			continue;
+		}
+
+		break;
+	}
+
+	if (q->efd >= 0) {
+		sq_fd_check(q);
+	}
+
+	if (q->journal) {
+		sq_journal_commit(q->journal, 0);
+	}
+
+	return ret == SQ_ERR_EMPTY ? SQ_ERR_NO_ERROR : ret;
+}
+
+
+/*
+ * closes the queue. pushes fail with SQ_ERR_CLOSED from now on, and once the consumers have
+ * popped what's left, pops return SQ_ERR_CLOSED instead of SQ_ERR_EMPTY or waiting. everyone
+ * waiting on the queue is woken up, and so are its listeners, so that they come and find out.
+ * closing a queue that's closed already does nothing.
+ */
+void sq_close(sq_t *q)
+{
+	/* with q->mtx held, so a list push or pop (or a producer about to sleep on a full ring) sees it or gets woken */
+	pthread_mutex_lock(&q->mtx);
+	if (q->closed) {
+		pthread_mutex_unlock(&q->mtx);
+		return;
+	}
+
+	__atomic_store_n(&q->closed, SQ_CLOSING, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&q->notempty);
+	pthread_cond_broadcast(&q->notfull);
+	pthread_mutex_unlock(&q->mtx);
+
+	/* an SQ_FLAG_SPSC producer only has a compiler barrier between q->pushing and closed, see sq_push_enter() */
+	if ((q->flags & SQ_FLAG_SPSC) && q->barrier) {
+		sq_membarrier();
+	}
+
+	__atomic_store_n(&q->closed, SQ_CLOSED, __ATOMIC_SEQ_CST);
+
+	/* lock-free consumers sleep on ne_seq, and check closed after reading it */
+	__atomic_add_fetch(&q->ne_seq, 1, __ATOMIC_SEQ_CST);
+	sq_futex_wake(&q->ne_seq, INT_MAX);
+
+	sq_notify(q);
+}
+
+
+/*
+ * adds a new listener (a cond var, an fd or a queue set) to the queue's listener list
+ *
+ * returns 0 on success or -1 on memory allocation failure
+ */
+static int sq_listener_add(sq_t *q, pthread_cond_t *data_cond, int fd, sq_set_t *set, unsigned long long bit)
+{
+	sq_listeners_t *new_l;
+
+	/* create a new listeners_t and fill it out */
+	if ((new_l = malloc(sizeof(*new_l))) == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&q->listeners_mtx);
+
+	new_l->next = NULL;
+	new_l->newdata = data_cond;
+	new_l->fd = fd;
+	new_l->set = set;
+	new_l->bit = bit;
+
+	/* add the new listener to the end of the list */
+	if (q->listeners) {
+		sq_listeners_t *l;
+
+		for (l = q->listeners; l->next && (l->newdata != data_cond || l->fd != fd || l->set != set); l = l->next) ;
+
+		/* don't add a listener that's already on the list */
+		if (l->newdata == data_cond && l->fd == fd && l->set == set) {
+			free(new_l);
+			new_l = NULL;
+
+		} else {
+			l->next = new_l;
+		}
+
+	/* there is no list. the new listener starts the list */
+	} else {
+		__atomic_store_n(&q->listeners, new_l, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&q->listeners_mtx);
+	return 0;
+}
+
+
+/*
+ * adds a cond var to the queue's listener list
+ * it is broadcast to whenever the queue goes from empty to non-empty, so whoever waits on it
+ * must pop until the queue is empty again before going back to sleep
+ */
+void sq_add_listener(sq_t *q, pthread_cond_t *data_cond)
+{
+	sq_listener_add(q, data_cond, -1, NULL, 0);
+}
+
+
+/*
+ * adds an eventfd (or the write end of a pipe) to the queue's listener list
+ * an 8 byte count of 1 is written to it whenever the queue goes from empty to non-empty, so it
+ * can be poll()'d along with other fds. read() the fd before draining the queue, then pop until
+ * the queue is empty again before polling it again.
+ */
+void sq_add_listener_fd(sq_t *q, int fd)
+{
+	sq_listener_add(q, NULL, fd, NULL, 0);
+}
+
+
+/*
+ * takes a listener off the queue's listener list. sq_notify() only walks the list with
+ * listeners_mtx held, so once this returns the listener won't be woken again, pushes or not.
+ *
+ * returns 0 on success or -1 if it wasn't on the list
+ */
+static int sq_listener_remove(sq_t *q, pthread_cond_t *data_cond, int fd, sq_set_t *set)
+{
+	sq_listeners_t **lp, *l;
+
+	pthread_mutex_lock(&q->listeners_mtx);
+
+	for (lp = &q->listeners; (l = *lp) && (l->newdata != data_cond || l->fd != fd || l->set != set); lp = &l->next) ;
+
+	/* sq_notify() looks at q->listeners without the lock to see if there's anyone at all */
+	if (l) {
+		__atomic_store_n(lp, l->next, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&q->listeners_mtx);
+
+	if (l == NULL) {
+		return -1;
+	}
+
+	free(l);
+	return 0;
+}
+
+
+/*
+ * takes a cond var added with sq_add_listener() off the queue's listener list
+ * safe while other threads push; once it returns the cond var isn't touched again.
+ *
+ * returns SQ_ERR_NO_ERROR, or SQ_ERR_INVAL if the cond var wasn't listening
+ */
+int sq_remove_listener(sq_t *q, pthread_cond_t *data_cond)
+{
+	if (data_cond == NULL) {
+		return SQ_ERR_INVAL;
+	}
+
+	return sq_listener_remove(q, data_cond, -1, NULL) ? SQ_ERR_INVAL : SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * takes an fd added with sq_add_listener_fd() off the queue's listener list, so it can be
+ * closed; safe while other threads push. the sq_get_fd() fd belongs to the queue, it can't be.
+ *
+ * returns SQ_ERR_NO_ERROR, or SQ_ERR_INVAL if the fd wasn't listening
+ */
+int sq_remove_listener_fd(sq_t *q, int fd)
+{
+	if (fd < 0 || fd == __atomic_load_n(&q->efd, __ATOMIC_ACQUIRE)) {
+		return SQ_ERR_INVAL;
+	}
+
+	return sq_listener_remove(q, NULL, fd, NULL) ? SQ_ERR_INVAL : SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * returns an eventfd that's readable whenever the queue has data in it, for use with epoll()
+ * and friends. the fd belongs to the queue; it's created on the first call and every later call
+ * returns the same one. unlike sq_add_listener_fd() it's level triggered: pop() clears it once
+ * it finds (or leaves) the queue empty, so a readable fd always means there's something to pop.
+ * don't read() it yourself.
+ *
+ * returns the fd, or -1 with errno set if it couldn't be created
+ */
+int sq_get_fd(sq_t *q)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+	int efd, cur;
+
+	if ((cur = __atomic_load_n(&q->efd, __ATOMIC_ACQUIRE)) >= 0) {
+		return cur;
+	}
+
+	if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	/* listen first, so that whoever sees q->efd sees an fd that pushes write to */
+	if (sq_listener_add(q, NULL, efd, NULL, 0)) {
+		close(efd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* someone else beat us to it */
+	cur = -1;
+	if (!__atomic_compare_exchange_n(&q->efd, &cur, efd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		sq_listener_remove(q, NULL, efd, NULL);
+		close(efd);
+		return cur;
+	}
+
+	/*
+	 * the queue may already have data in it, which no push will tell us about. a second caller
+	 * can be handed the fd before this check, and find it not readable with data in the queue;
+	 * that's only harmless because the check is still to come and will make it readable.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!sq_empty(q)) {
+		while (write(efd, &one, sizeof(one)) < 0 && errno == EINTR) ;
+	}
+
+	return efd;
+#else
+	(void)q;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+/* allocates and initializes an empty queue set for sq_select() */
+sq_set_t *sq_set_init(void)
+{
+	sq_set_t *set;
+
+	if ((set = calloc(1, sizeof(*set)))) {
+		pthread_mutex_init(&set->mtx, NULL);
+		sq_cond_init(&set->cond);
+	}
+
+	return set;
+}
+
+
+/*
+ * adds a queue to a set; the queue gets the lowest free bit in the ready mask sq_select()
+ * returns, and set->queues[bit] is the queue. the queue starts out marked ready in case it
+ * already has something in it. adding a queue that's already in the set does nothing.
+ * mustn't race sq_set_remove() of the same queue.
+ *
+ * returns the queue's bit number, or -1 if the set is full or there was no memory
+ */
+int sq_set_add(sq_set_t *set, sq_t *q)
+{
+	unsigned int i, hole;
+
+	pthread_mutex_lock(&set->mtx);
+	for (i = 0, hole = SQ_SET_MAX; i < set->len && set->queues[i] != q; i++) {
+		if (set->queues[i] == NULL && hole == SQ_SET_MAX) {
+			hole = i;
+		}
+	}
+
+	if (i < set->len) {
+		pthread_mutex_unlock(&set->mtx);
+		return i;
+	}
+
+	if ((i = hole) == SQ_SET_MAX && (i = set->len) == SQ_SET_MAX) {
+		pthread_mutex_unlock(&set->mtx);
+		return -1;
+	}
+
+	__atomic_store_n(&set->queues[i], q, __ATOMIC_RELEASE);
+	if (i == set->len) {
+		set->len++;
+	}
+	pthread_mutex_unlock(&set->mtx);
+
+	/* sq_notify() takes set->mtx with the queue's listeners_mtx held, so not the other way round */
+	if (sq_listener_add(q, NULL, -1, set, 1ULL << i)) {
+		pthread_mutex_lock(&set->mtx);
+		sq_set_clear(set, i);
+		pthread_mutex_unlock(&set->mtx);
+		return -1;
+	}
+
+	__atomic_fetch_or(&set->ready, 1ULL << i, __ATOMIC_SEQ_CST);
+	return i;
+}
+
+
+/*
+ * takes a queue out of a set; its bit is free for the next sq_set_add(), and set->queues[bit]
+ * is NULL until then. once this returns, pushes to the queue no longer touch the set and
+ * sq_select() won't report it again. a mask sq_select() returned before that may still have its
+ * bit in it, so the queue mustn't be destroyed while a consumer might still be working through
+ * such a mask (take it out from the consumer thread, or wait for the consumer to come back to
+ * sq_select()). mustn't race sq_set_add() of the same queue.
+ *
+ * returns SQ_ERR_NO_ERROR, or SQ_ERR_INVAL if the queue wasn't in the set
+ */
+int sq_set_remove(sq_set_t *set, sq_t *q)
+{
+	unsigned int i, len;
+
+	pthread_mutex_lock(&set->mtx);
+	for (i = 0, len = set->len; i < len && set->queues[i] != q; i++) ;
+	pthread_mutex_unlock(&set->mtx);
+
+	if (i == len) {
+		return SQ_ERR_INVAL;
+	}
+
+	sq_listener_remove(q, NULL, -1, set);
+
+	pthread_mutex_lock(&set->mtx);
+	sq_set_clear(set, i);
+	pthread_mutex_unlock(&set->mtx);
+
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * takes every queue out of a set and frees it. nobody may be in sq_select() on the set, or
+ * be about to call it.
+ */
+void sq_set_destroy(sq_set_t *set)
+{
+	unsigned int i;
+
+	for (i = 0; i < set->len; i++) {
+		if (set->queues[i]) {
+			sq_listener_remove(set->queues[i], NULL, -1, set);
+		}
+	}
+
+	pthread_cond_destroy(&set->cond);
+	pthread_mutex_destroy(&set->mtx);
+	free(set);
+}
+
+
+/*
+ * common part of sq_poll(), sq_select() and sq_select_timed()
+ * deadline is in CLOCK_MONOTONIC nsec, 0 waits forever; wait == 0 doesn't wait at all
+ */
+static int sq_select_deadline(sq_set_t *set, unsigned long long *ready, int wait, unsigned long long deadline)
+{
+	int ret;
+
+	if ((*ready = __atomic_exchange_n(&set->ready, 0, __ATOMIC_ACQUIRE)) || !wait) {
+		return *ready ? SQ_ERR_NO_ERROR : SQ_ERR_EMPTY;
+	}
+
+	pthread_mutex_lock(&set->mtx);
+	for (;;) {
+		__atomic_add_fetch(&set->waiters, 1, __ATOMIC_SEQ_CST);
+		if ((*ready = __atomic_exchange_n(&set->ready, 0, __ATOMIC_SEQ_CST))) {
+			ret = SQ_ERR_NO_ERROR;
+
+		} else if (sq_cond_timedwait(&set->cond, &set->mtx, deadline) == ETIMEDOUT) {
+			*ready = __atomic_exchange_n(&set->ready, 0, __ATOMIC_ACQUIRE);
+			ret = *ready ? SQ_ERR_NO_ERROR : SQ_ERR_TIMEOUT;
+
+		} else {
+			__atomic_sub_fetch(&set->waiters, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		__atomic_sub_fetch(&set->waiters, 1, __ATOMIC_RELAXED);
+		break;
+	}
+
+	pthread_mutex_unlock(&set->mtx);
+	return ret;
+}
+
+
+/*
+ * returns the set's ready mask without waiting: bit n is set if set->queues[n] went non-empty
+ * since the last poll()/select(). the mask is cleared as it's returned, and a queue is only
+ * marked ready again when it next goes from empty to non-empty, so every queue in the mask
+ * must be popped until SQ_ERR_EMPTY. queues that aren't in the mask can be skipped.
+ *
+ * returns SQ_ERR_NO_ERROR if any queue is ready, SQ_ERR_EMPTY if not
+ */
+int sq_poll(sq_set_t *set, unsigned long long *ready)
+{
+	return sq_select_deadline(set, ready, 0, 0);
+}
+
+
+/*
+ * like sq_poll(), but sleeps until at least one of the set's queues is ready
+ *
+ * returns SQ_ERR_NO_ERROR with the ready mask in *ready
+ */
+int sq_select(sq_set_t *set, unsigned long long *ready)
+{
+	return sq_select_deadline(set, ready, 1, 0);
+}
+
+
+/*
+ * like sq_select(), but gives up after timeout_ns nanoseconds
+ *
+ * returns SQ_ERR_NO_ERROR with the ready mask in *ready, or SQ_ERR_TIMEOUT
+ */
+int sq_select_timed(sq_set_t *set, unsigned long long *ready, unsigned long long timeout_ns)
+{
+	return sq_select_deadline(set, ready, 1, sq_now_ns() + timeout_ns);
+}
+
+
+/*
+ * adds a queue to the end of a list of queues
+ * correctly handles an empty list, and does not add queue
+ * if it's already on the list
+ *
+ * returns the start of the list or NULL if the queue couldn't be added
+ */
+sq_list_t *sq_list_add(sq_list_t **list, sq_t *q)
+{
+	sq_list_t *new_l;
+
+	if ((new_l = malloc(sizeof(*new_l))) == NULL) {
+		return NULL;
+	}
+
+	new_l->next = NULL;
+	new_l->q = q;
+
+	/* add the queue to the end of the list of queues */
+	if (*list) {
+		sq_list_t *l;
+
+		for (l = *list; l->next && l->q != q; l = l->next) ;
+
+		/* don't add a queue that's already on the list */
+		if (l->q == q) {
+			free(new_l);
+
+		} else {
+			l->next = new_l;
+		}
+
+	/* this is the first entry in the list */
+	} else {
+		*list = new_l;
+	}
+
+	return *list;
+}
+
+
+/*
+ * takes a queue off a list of queues, if it's on it, and frees its entry
+ * like sq_list_add(), it mustn't race an sq_publish() to the same list
+ *
+ * returns the start of the list, NULL once it's empty
+ */
+sq_list_t *sq_list_remove(sq_list_t **list, sq_t *q)
+{
+	sq_list_t **lp, *l;
+
+	for (lp = list; (l = *lp) && l->q != q; lp = &l->next) ;
+
+	if (l) {
+		*lp = l->next;
+		free(l);
+	}
+
+	return *list;
+}
+
+
+/*
+ * SQ_FLAG_SHARED publish
+ * the data is copied (or taken over) once and every subscriber gets an element pointing at
+ * the same reference-counted copy. the copy starts out with a reference for every queue plus
+ * one for us, and whatever wasn't handed out is dropped in one go at the end.
+ *
+ * with SQ_FLAG_NUMA, VOLATILE data gets a copy per shard instead: shard 0 for the queues that
+ * aren't placed on a node, shard n + 1 on node n for the queues that are. if a shard's copy
+ * can't be made, its queues get nothing and SQ_ERR_NOMEM is returned, the rest still get it.
+ */
+static int sq_publish_shared(sq_list_t *list, sq_elem_t *e)
+{
+	int ret;
+	unsigned int n[SQ_NUMA_MAX_NODES + 1], unused[SQ_NUMA_MAX_NODES + 1];
+	unsigned int i, shard, shards;
+	sq_list_t *l;
+	sq_shared_t *sh[SQ_NUMA_MAX_NODES + 1];
+	sq_elem_t tmpl, *new_e;
+
+	shards = (e->flags & SQ_FLAG_NUMA) && (e->flags & SQ_FLAG_VOLATILE) ? SQ_NUMA_MAX_NODES + 1 : 1;
+	memset(n, 0, shards * sizeof(*n));
+	for (l = list; l; l = l->next) {
+		n[shards > 1 ? l->q->numa_node + 1 : 0]++;
+	}
+
+	for (i = 0, ret = SQ_ERR_NO_ERROR; i < shards; i++) {
+		sh[i] = NULL;
+		unused[i] = 1;
+		if (n[i] && (sh[i] = sq_shared_new(e, n[i] + 1, i ? (int)i - 1 : SQ_NUMA_ANY)) == NULL) {
+			ret = SQ_ERR_NOMEM;
+		}
+	}
+
+	/* every subscriber's element just points at its shard's copy */
+	tmpl.dlen = e->dlen;
+	tmpl.flags = e->flags & ~(SQ_MASK_ALLOC | SQ_FLAG_SHARED | SQ_FLAG_NUMA);
+	tmpl.prio = e->prio;
+	tmpl.key = e->key;
+
+	for (l = list; l; l = l->next) {
+		int l_ret;
+
+		shard = shards > 1 ? l->q->numa_node + 1 : 0;
+		if (sh[shard] == NULL) {
+			continue;
+		}
+
+		tmpl.data = sh[shard]->data;
+		if ((new_e = sq_elem_new(l->q->pool, &tmpl))) {
+			new_e->shared = sh[shard];
+			new_e->flags |= SQ_FLAG_SHARED;
+		}
+
+		if ((l_ret = sq_push_elem(l->q, new_e, 0, 0)) != SQ_ERR_NO_ERROR) {
+			ret = l_ret;
+			unused[shard]++;
+		}
+	}
+
+	for (i = 0; i < shards; i++) {
+		if (sh[i]) {
+			sq_shared_put(sh[i], unused[i]);
+		}
+	}
+
+	return ret;
+}
+
+
+/*
+ * takes an element and adds it to every queue in the list of queues
+ * correctly handles an empty list (i.e. list can be NULL)
+ * DOES NOT STOP IF A QUEUE FAILED TO ADD THE ELEMENT
+ *
+ * if the element has SQ_FLAG_SHARED and SQ_FLAG_VOLATILE, the data is only copied once and
+ * shared between all of the queues instead of being copied for each one. with SQ_FLAG_SHARED
+ * and SQ_FLAG_FREE (but not VOLATILE), the data pointer itself is shared and free()'d when the
+ * last subscriber releases its element. either way the subscribers must treat the data as
+ * read-only and get rid of their elements with sq_elem_release(). adding SQ_FLAG_NUMA to a
+ * SHARED | VOLATILE element makes one copy per node the queues are on, on that node.
+ *
+ * returns SQ_ERR_NO_ERROR if all the element was successfully pushed
+ * to all queues in the list, or the last error received
+ */
+int sq_publish(sq_list_t *list, sq_elem_t *e)
+{
+	int ret;
+	sq_list_t *l;
+
+	if ((e->flags & SQ_FLAG_SHARED) && (e->flags & SQ_MASK_ALLOC)) {
+		return sq_publish_shared(list, e);
+	}
+
+	for (l = list, ret = SQ_ERR_NO_ERROR; l; l = l->next) {
+		int l_ret;
+
+		if ((l_ret = sq_push(l->q, e)) != SQ_ERR_NO_ERROR) {
+			ret = l_ret;
+		}
+
+		//fprintf(stderr, "    [%-5s] push(%p, %p) ret %d\n", l->q->name, l->q, e, l_ret);
+	}
+
+	return ret;
+}
+
+
+
+/*
+ * makes a copy of an element the way push() does, for code that keeps elements somewhere
+ * other than an sq_t. SQ_FLAG_VOLATILE data is copied along with it.
+ *
+ * returns the copy, to be given back with sq_elem_release(), or NULL if there was no memory
+ */
+sq_elem_t *sq_elem_dup(const sq_elem_t *e)
+{
+	return sq_elem_new(NULL, e);
+}
+
+
+/*
+ * hands back an element returned by sq_pop() once the caller is done with it
+ * pool elements go back to their pool, everything else is free()'d.
+ * if the element has SQ_FLAG_FREE set, its data pointer is free()'d as well.
+ * if the element has SQ_FLAG_SHARED set, its reference to the shared data is dropped and
+ * the data is freed once every subscriber is done with it.
+ * if the element has SQ_FLAG_JOURNAL set, its journal record can be reused.
+ */
+void sq_elem_release(sq_elem_t *e)
+{
+	if (e) {
+		if (e->flags & SQ_FLAG_SHARED) {
+			sq_shared_put(e->shared, 1);
+
+		} else if (e->flags & SQ_FLAG_FREE) {
+			free(e->data);
+
+		} else if (e->flags & SQ_FLAG_JOURNAL) {
+			sq_journal_release(e->data);
+		}
+
+		sq_elem_put(e);
+	}
+}
+
+
+/*
+ * SQ_FLAG_JOURNAL: puts the elements left in the journal from last time back on the queue.
+ * they point straight at their records, nothing is copied.
+ *
+ * returns 0, or -1 (with the queue emptied again) if there was no memory for the elements
+ */
+static int sq_journal_load(sq_t *q)
+{
+	sq_elem_t tmpl, *new_e;
+	unsigned long long pos;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	pos = 0;
+	while ((tmpl.data = sq_journal_recover(q->journal, &pos, &tmpl.dlen))) {
+		if ((new_e = sq_elem_new(q->pool, &tmpl)) == NULL) {
+			while ((new_e = q->head)) {
+				q->head = new_e->next;
+				sq_elem_put(new_e);
+			}
+
+			return -1;
+		}
+
+		new_e->flags |= SQ_FLAG_VOLATILE | SQ_FLAG_JOURNAL;
+		new_e->ts = sq_now_ns();
+		sq_link(q, new_e, new_e, 1);
+	}
+
+	sq_stat_hwm(q, q->len);
+	return 0;
+}
+
+
+/*
+ * frees what a queue owns, other than the elements in it: listeners, eventfd, rings, the
+ * prio/delay/conflate indexes, the journal and the pool, then the queue itself. shared by
+ * sq_destroy() and a failed sq_init_attr(), so it copes with whatever is still zero.
+ */
+static void sq_free(sq_t *q)
+{
+	sq_listeners_t *l;
+
+	while ((l = q->listeners)) {
+		q->listeners = l->next;
+		free(l);
+	}
+
+	if (q->efd >= 0) {
+		close(q->efd);
+	}
+
+	if (q->flags & SQ_FLAG_RING) {
+		sq_ring_destroy(&q->ring);
+
+	} else if (q->flags & SQ_FLAG_SPSC) {
+		sq_spsc_destroy(&q->spsc);
+	}
+
+	free(q->prio);
+	sq_delay_destroy(q->delay);
+	sq_conflate_destroy(q->conflate);
+	sq_journal_close(q->journal);
+
+	/* last, every element has gone back to it by now */
+	if (q->pool) {
+		sq_pool_destroy(q->pool);
+	}
+
+	pthread_mutex_destroy(&q->mtx);
+	pthread_mutex_destroy(&q->listeners_mtx);
+	pthread_cond_destroy(&q->notfull);
+	pthread_cond_destroy(&q->notempty);
+	sq_numa_free(q, sizeof(*q), q->numa_node);
+}
+
+
+/* fills out a queue attribute struct with the defaults */
+void sq_attr_init(sq_attr_t *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->pool_len = 0;
+	attr->pool_dlen = SQ_INLINE_LEN;
+	attr->journal = NULL;
+	attr->journal_size = SQ_JOURNAL_SIZE;
+	attr->journal_sync = SQ_JOURNAL_SYNC_NONE;
+	attr->journal_sync_ns = SQ_JOURNAL_SYNC_NS;
+	attr->spin = 0;
+	attr->yield = 0;
+	attr->numa_node = SQ_NUMA_ANY;
+}
+
+
+/*
+ * allocates and initializes a new queue.
+ * useful flags include
+ *     SQ_FLAG_NOWAIT - do not block waiting for the queue lock
+ *     SQ_FLAG_POOL - preallocate attr->pool_len elements with attr->pool_dlen bytes of data each
+ *     SQ_FLAG_RING - use a lock-free ring of (at least) maxlen elements instead of a list
+ *     SQ_FLAG_SPSC - like SQ_FLAG_RING, for exactly one producer and one consumer thread
+ *     SQ_FLAG_MPSC - use a lock-free list for any number of producers and one consumer thread
+ *     SQ_FLAG_DROP_OLDEST - push() to a full queue throws away the oldest element to make room
+ *     SQ_FLAG_DROP_NEWEST - push() to a full queue throws away the element being pushed
+ *     SQ_FLAG_TIMESTAMP - keep a histogram of how long elements spend in the queue, see sq_stats()
+ *     SQ_FLAG_PRIO - pop() hands out elements by e->prio first, then in order (not with the rings)
+ *     SQ_FLAG_DELAY - elements can't be popped until they're due, see sq_push_at() (list queues
+ *         without SQ_FLAG_PRIO or SQ_FLAG_DROP_OLDEST only)
+ *     SQ_FLAG_JOURNAL - keep the data in the journal file attr->journal, picking up whatever is
+ *         left in it from last time (list queues without SQ_FLAG_PRIO only)
+ *
+ * attr can be NULL to use the defaults. with attr->numa_node set, the queue and its pool are
+ * allocated on that node (see sq_numa.h); if it can't be placed, it's allocated as usual.
+ *
+ * returns the newly-minted queue or NULL on memory allocation failure, an invalid
+ * combination of flags or a journal that couldn't be opened.
+ */
+sq_t *sq_init_attr(const char *name, void *ctx, int maxlen, unsigned int flags, const sq_attr_t *attr)
+{
+	sq_t *new_q;
+	sq_attr_t def_attr;
+	int node;
+
+	if (attr == NULL) {
+		sq_attr_init(&def_attr);
+		attr = &def_attr;
+	}
+
+	/* pick one lock-free mode */
+	if (__builtin_popcount(flags & SQ_MASK_LOCKFREE) > 1) {
+		return NULL;
+	}
+
+	/* priorities are only for locked list queues */
+	if ((flags & SQ_FLAG_PRIO) && (flags & SQ_MASK_LOCKFREE)) {
+		return NULL;
+	}
+
+	/* so are due times, and they don't mix with priorities or an oldest element to throw away */
+	if ((flags & SQ_FLAG_DELAY) && (flags & (SQ_MASK_LOCKFREE | SQ_FLAG_PRIO | SQ_FLAG_DROP_OLDEST))) {
+		return NULL;
+	}
+
+	/* pick one overflow policy; the SPSC and MPSC producers can't pop to drop the oldest */
+	if ((flags & SQ_FLAG_DROP_OLDEST) && (flags & (SQ_FLAG_DROP_NEWEST | SQ_FLAG_SPSC | SQ_FLAG_MPSC))) {
+		return NULL;
+	}
+
+	/* the journal's read cursor needs a queue that's popped strictly in order */
+	if ((flags & SQ_FLAG_JOURNAL) && ((flags & (SQ_MASK_LOCKFREE | SQ_FLAG_PRIO | SQ_FLAG_DELAY)) || attr->journal == NULL)) {
+		return NULL;
+	}
+
+	/* the key index keeps the order itself, so it replaces the list like the heap does */
+	if ((flags & SQ_FLAG_CONFLATE) && (flags & (SQ_MASK_LOCKFREE | SQ_FLAG_PRIO | SQ_FLAG_DELAY | SQ_FLAG_JOURNAL))) {
+		return NULL;
+	}
+
+	/* the ring's head and tail each want a cache line to themselves, sq_numa_alloc() lines them up */
+	node = sq_numa_pick(attr->numa_node);
+	if ((new_q = sq_numa_alloc(sizeof(*new_q), node)) == NULL) {
+		return NULL;
+	}
+
+	memset(new_q, 0, sizeof(*new_q));
+	new_q->name = name;
+	new_q->ctx = ctx;
+	new_q->head = NULL;
+	new_q->tail = NULL;
+	new_q->listeners = NULL;
+	new_q->pool = NULL;
+	new_q->efd = -1;
+	new_q->len = 0;
+	new_q->maxlen = maxlen;
+	new_q->flags = flags;
+	new_q->spin = attr->spin;
+	new_q->yield = attr->yield;
+	new_q->numa_node = node;
+
+	/* first, so that sq_free() can always tear them down */
+	pthread_mutex_init(&new_q->mtx, NULL);
+	pthread_mutex_init(&new_q->listeners_mtx, NULL);
+	sq_cond_init(&new_q->notfull);
+	sq_cond_init(&new_q->notempty);
+
+	if (flags & SQ_FLAG_POOL) {
+		if ((new_q->pool = sq_pool_init(attr->pool_len ? attr->pool_len : (unsigned int)maxlen, attr->pool_dlen, flags & SQ_FLAG_SPSC, node)) == NULL) {
+			goto fail;
+		}
+	}
+
+	if (flags & SQ_FLAG_PRIO) {
+		if ((new_q->prio = calloc(1, sizeof(*new_q->prio))) == NULL) {
+			goto fail;
+		}
+	}
+
+	if (flags & SQ_FLAG_DELAY) {
+		if ((new_q->delay = sq_delay_init()) == NULL) {
+			goto fail;
+		}
+	}
+
+	if (flags & SQ_FLAG_CONFLATE) {
+		if ((new_q->conflate = sq_conflate_init()) == NULL) {
+			goto fail;
+		}
+	}
+
+	if (flags & SQ_FLAG_JOURNAL) {
+		if ((new_q->journal = sq_journal_open(attr->journal, attr->journal_size, attr->journal_sync, attr->journal_sync_ns)) == NULL) {
+			goto fail;
+		}
+	}
+
+	if (flags & SQ_FLAG_RING) {
+		if ((new_q->maxlen = sq_ring_init(&new_q->ring, maxlen)) == 0) {
+			goto fail;
+		}
+	}
+
+	if (flags & SQ_FLAG_SPSC) {
+		if ((new_q->maxlen = sq_spsc_init(&new_q->spsc, maxlen)) == 0) {
+			goto fail;
+		}
+	}
+
+	/* the stub is all there is to start with */
+	if (flags & SQ_FLAG_MPSC) {
+		new_q->mpsc.head = &new_q->mpsc.stub;
+		new_q->mpsc.tail = &new_q->mpsc.stub;
+	}
+
+	if (flags & SQ_MASK_LOCKFREE) {
+		new_q->barrier = sq_membarrier_usable();
+
+		/* without sq_membarrier() a first waiter can't catch up with the producers, so they always fence */
+		if (!new_q->barrier) {
+			new_q->ne_used = SQ_NE_ON;
+		}
+	}
+
+	if (new_q->journal && sq_journal_load(new_q)) {
+		goto fail;
+	}
+
+	return new_q;
+
+fail:
+	sq_free(new_q);
+	return NULL;
+}
+
+
+/*
+ * frees a queue and everything that belongs to it: the elements still in it (released as
+ * with sq_elem_release()), the pool, listener list, eventfd and rings. the journal is closed
+ * with the queued records left in it, so they're there again for the next sq_init_attr().
+ *
+ * nobody may be using the queue any more: close it and let the threads using it finish
+ * first, and take it off any sq_list_t it's on and out of any sq_broker_t. it's taken out of
+ * the sq_set_t's it's in here (see sq_set_remove()), so their consumers can carry on selecting,
+ * but they must be done with any mask that had its bit in it. elements popped off a queue with
+ * a pool or a journal point into them, so those must all have been released already.
+ * q can be NULL.
+ */
+void sq_destroy(sq_t *q)
+{
+	sq_listeners_t *l;
+	sq_set_t *set;
+	sq_elem_t *e;
+
+	if (q == NULL) {
+		return;
+	}
+
+	/* sets keep a pointer to the queue, and the queue's listener list one to the set */
+	for (;;) {
+		pthread_mutex_lock(&q->listeners_mtx);
+		for (l = q->listeners; l && l->set == NULL; l = l->next) ;
+		set = l ? l->set : NULL;
+		pthread_mutex_unlock(&q->listeners_mtx);
+
+		if (set == NULL) {
+			break;
+		}
+
+		/* the set may have let go of it already, just not of the listener yet */
+		if (sq_set_remove(set, q)) {
+			sq_listener_remove(q, NULL, -1, set);
+		}
+	}
+
+	if (q->flags & SQ_MASK_LOCKFREE) {
+		while ((e = sq_pop_lockfree(q))) {
+			sq_elem_release(e);
+		}
+
+	/* not popped, the records stay in the journal */
+	} else if (q->journal) {
+		while ((e = q->head)) {
+			q->head = e->next;
+			sq_elem_put(e);
+		}
+
+	} else {
+		while (q->len) {
+			sq_elem_release(sq_unlink(q, 0));
+		}
+	}
+
+	sq_free(q);
+}
+
+
+/*
+ * fills out stats with a snapshot of the queue's counters
+ * the counters are kept with relaxed atomics, so while the queue is in use they may not all be
+ * from quite the same moment. in the lock-free modes pushes and pops come straight from the
+ * ring positions, and the high water mark is sampled so it can be a bit low (but a full
+ * ring always shows up as maxlen).
+ */
+void sq_stats(sq_t *q, sq_stats_t *stats)
+{
+	unsigned int i;
+
+	if (q->flags & SQ_FLAG_SPSC) {
+		stats->pushes = __atomic_load_n(&q->spsc.tail, __ATOMIC_RELAXED);
+		stats->pops = __atomic_load_n(&q->spsc.head, __ATOMIC_RELAXED);
+
+	} else if (q->flags & SQ_FLAG_RING) {
+		stats->pushes = __atomic_load_n(&q->ring.tail, __ATOMIC_RELAXED);
+		stats->pops = __atomic_load_n(&q->ring.head, __ATOMIC_RELAXED) - __atomic_load_n(&q->evicted, __ATOMIC_RELAXED);
+
+	} else if (q->flags & SQ_FLAG_MPSC) {
+		stats->pushes = __atomic_load_n(&q->mpsc.pushes, __ATOMIC_RELAXED);
+		stats->pops = __atomic_load_n(&q->mpsc.pops, __ATOMIC_RELAXED);
+
+	} else {
+		stats->pushes = __atomic_load_n(&q->pushes, __ATOMIC_RELAXED);
+		stats->pops = __atomic_load_n(&q->pops, __ATOMIC_RELAXED);
+	}
+
+	stats->drops = __atomic_load_n(&q->drops, __ATOMIC_RELAXED);
+	stats->conflated = __atomic_load_n(&q->conflated, __ATOMIC_RELAXED);
+	stats->contended = __atomic_load_n(&q->contended, __ATOMIC_RELAXED);
+	stats->blocked = __atomic_load_n(&q->blocked, __ATOMIC_RELAXED);
+	stats->blocked_ns = __atomic_load_n(&q->blocked_ns, __ATOMIC_RELAXED);
+	stats->hwm = __atomic_load_n(&q->hwm, __ATOMIC_RELAXED);
+
+	for (i = 0; i < SQ_STATS_BUCKETS; i++) {
+		stats->residency[i] = __atomic_load_n(&q->residency[i], __ATOMIC_RELAXED);
+	}
+}
+
+
+/*
+ * SQ_FLAG_DELAY: returns when the next element is due (sq_now_ns() time), for consumers that
+ * wait some other way than sq_pop_wait(), e.g. as an epoll() timeout.
+ * returns 0 if there's nothing in the queue or it isn't a delay queue.
+ */
+unsigned long long sq_next_due(sq_t *q)
+{
+	unsigned long long due;
+
+	if (q->delay == NULL || (due = sq_delay_next(q->delay)) == SQ_DELAY_NONE) {
+		return 0;
+	}
+
+	return due;
+}
+
+
+/* returns the number of elements in the queue; only a snapshot if others are pushing/popping */
+unsigned int sq_len(sq_t *q)
+{
+	if (q->flags & SQ_FLAG_SPSC) {
+		return sq_spsc_len(&q->spsc);
+
+	} else if (q->flags & SQ_FLAG_RING) {
+		return sq_ring_len(&q->ring);
+
+	} else if (q->flags & SQ_FLAG_MPSC) {
+		return sq_mpsc_len(&q->mpsc);
+	}
+
+	return __atomic_load_n(&q->len, __ATOMIC_RELAXED);
+}
+
+
+/* allocates and initializes a new queue with the default attributes, see sq_init_attr() */
+sq_t *sq_init(const char *name, void *ctx, int maxlen, unsigned int flags)
+{
+	return sq_init_attr(name, ctx, maxlen, flags, NULL);
 }
@@ -1,6 +1,9 @@
 #ifndef _SQ_H_
 #define _SQ_H_
 
+#include "sq_config.h"
+#include "sq_ring.h"
+
 /*
  * simple queue
  * multiple producer, multiple consumer
@@ -10,9 +13,25 @@
  * each queue is represented by a single sq_t struct
  * the queue contains a number of individual elements, each represented by a sq_elem_t struct.
  * add to the queue with sq_push(), remove from the queue with sq_pop()
+ * sq_push_many() and sq_pop_many() do the same for a batch of elements with a single lock
+ * hold and a single wakeup, which is a lot cheaper when data comes in bursts.
+ *
+ * to wait for data, use sq_pop_wait() or sq_pop_timed() -- they sleep until an element is pushed
+ * (or the timeout passes) and then pop it. if you want to be told about new data some other way,
+ * create a condition var and call sq_add_listener() -- your cond var will be broadcast to when
+ * a push makes the queue go from empty to non-empty. sq_add_listener_fd() does the same with an
+ * eventfd, so a queue can be poll()'d along with other fds. listeners are NOT woken for every
+ * push, so once woken they must keep popping until SQ_ERR_EMPTY before waiting again.
+ *
+ * for an epoll() loop, sq_get_fd() hands back an eventfd owned by the queue that stays readable
+ * for as long as the queue has data in it (pop() clears it when the queue runs dry), so it works
+ * with level or edge triggered epoll and there's no need to drain the queue in one go.
  *
- * if you're interested in waiting for data to be pushed to the queue, create a condition var
- * and call sq_add_listener() -- your cond var will be broadcast to when new data is pushed.
+ * to wait on lots of queues at once, put them in an sq_set_t (sq_set_init(), sq_set_add()) and
+ * call sq_select(). it sleeps until at least one of them has data and returns a bitmask of the
+ * queues that went non-empty (bit n is set->queues[n]), so there's no need to scan the rest.
+ * sq_poll() does the same without waiting. every queue in the mask must be drained.
+ * sq_set_remove() takes a queue back out and sq_set_destroy() frees the set.
  *
  * you can send an element to multiple queues by using sq_publish() -- takes a sq_list_t of
  * queues to push() to and a sq_elem_t that will be pushed to all queues on the list.
@@ -24,13 +43,130 @@
  * means that when you pop(), you must use/copy the data before you free() the element, because
  * the data was allocated along with the element struct itself.
  *
+ * small VOLATILE payloads (up to SQ_INLINE_LEN bytes, see sq_config.h) all get the same size
+ * element slot, so the allocator (or the pool) can recycle them without splitting and merging
+ * blocks, and the data sits right behind the element header. a small message is cheapest
+ * pushed as VOLATILE from a buffer on the stack: one allocation and one copy, no free() after.
+ *
  * SQ_FLAG_FREE - if an element has this flag then the data pointer must be explicitly free()'d
  *
+ * SQ_FLAG_SHARED - on publish(), the data is copied once (VOLATILE) or handed over once (FREE)
+ * and shared by every subscriber instead of being copied for each. on pop(), the data is shared
+ * with other queues: don't modify it, and get rid of the element with sq_elem_release().
+ *
  * when you pop() data from the queue, some of the queue flags are copied into the element flags
  * since they might be useful:
  *
  * SQ_FLAG_OVERRUN - this means one or more push() operations on this queue have failed before
- * the pop() call, so there has been data loss
+ * the pop() call, so there has been data loss. e->overruns has the number of elements lost.
+ *
+ * when the queue is full, push() waits for room (sq_push_timed() gives up after a timeout)
+ * unless the queue was created with an overflow policy: SQ_FLAG_DROP_OLDEST throws away the
+ * element at the head of the queue to make room (not allowed with SQ_FLAG_SPSC), and
+ * SQ_FLAG_DROP_NEWEST throws away the element being pushed and returns SQ_ERR_FULL, like
+ * SQ_FLAG_NOWAIT but without giving up on a contended lock. either way it counts as an overrun.
+ *
+ * if SQ_FLAG_POOL is passed to sq_init_attr(), the queue preallocates a pool of elements (see
+ * sq_attr_t) and push() takes its elements from there instead of malloc()'ing them. pop()'d
+ * elements then have SQ_FLAG_POOL set and must be given back with sq_elem_release() instead
+ * of free(). sq_elem_release() works for any pop()'d element, pooled or not, and also takes care
+ * of SQ_FLAG_FREE data, so it is the preferred way to get rid of an element.
+ *
+ * if SQ_FLAG_RING is passed to sq_init(), the queue is a fixed-size lock-free ring instead of a
+ * linked list and producers/consumers no longer take the queue mutex. maxlen is rounded up to
+ * a power of two. push(), pop() and the error codes work the same, the queue never returns
+ * SQ_ERR_WOULDBLOCK, and the current length is available from sq_len() (q->len isn't kept).
+ *
+ * SQ_FLAG_SPSC is the same idea for a queue with exactly one producer thread and one consumer
+ * thread. its ring uses no locks and no atomic read-modify-write instructions at all, so it
+ * is the fastest way to get data from one thread to another. a producer that finds the queue
+ * full (and isn't SQ_FLAG_NOWAIT) yields the CPU until there is room, it doesn't sleep. if the
+ * queue also has SQ_FLAG_POOL, only the consumer thread may sq_elem_release() its elements.
+ *
+ * SQ_FLAG_MPSC is for queues with any number of producer threads and exactly one consumer
+ * thread that have to stay unbounded, like log sinks. it's a lock-free linked list through
+ * e->next rather than a ring, so nothing is preallocated and maxlen is only a safety valve. a
+ * push() is an atomic add and an atomic exchange, it never waits for another producer or the
+ * consumer. sq_len() works as usual. the one catch: a pop() can find nothing for the moment
+ * between a producer's exchange and it linking its element in, even though sq_len() already
+ * counts it. sq_pop_wait() yields the CPU until it shows up, a plain pop() returns
+ * SQ_ERR_EMPTY. a producer that finds maxlen reached (and isn't SQ_FLAG_NOWAIT or
+ * SQ_FLAG_DROP_NEWEST) yields until there is room, and with several producers checking at
+ * once the queue can go a few elements past maxlen. not available with SQ_FLAG_DROP_OLDEST,
+ * SQ_FLAG_PRIO or SQ_FLAG_JOURNAL.
+ *
+ * SQ_FLAG_PRIO makes a list queue priority-aware: every element carries a priority in e->prio
+ * (0 is the lowest, anything past SQ_PRIO_LEVELS - 1 counts as the highest), and pop() hands
+ * out the oldest element of the highest priority there is. each priority has its own sublist
+ * and a bitmap keeps track of which ones have anything in them, so both push() and pop() stay
+ * O(1). maxlen covers all priorities together, and SQ_FLAG_DROP_OLDEST throws away the oldest
+ * element of the lowest priority. not available with SQ_FLAG_RING, SQ_FLAG_SPSC or SQ_FLAG_MPSC.
+ *
+ * SQ_FLAG_DELAY turns a list queue into a delay queue for timers and retries. sq_push_at() says
+ * when an element becomes due (CLOCK_MONOTONIC nsec, as sq_now_ns() in sq_wait.h returns it)
+ * and pop() only hands out elements that are, earliest first (in push order for the same due
+ * time). sq_push() and friends push elements that are due straight away. the pending elements
+ * are kept in a heap, so a push is O(log n) however many are waiting, and sq_pop_wait() and
+ * sq_pop_timed() sleep until exactly when the next one is due (or an earlier one is pushed).
+ * sq_len() and maxlen count every pending element, due or not. listeners, sq_get_fd() and
+ * queue sets hear about pushes, not about elements coming due; a consumer that waits on those
+ * can use sq_next_due() for its timeout. with SQ_FLAG_TIMESTAMP, residency is measured from
+ * the due time, i.e. how late the element was popped. not available with the lock-free modes,
+ * SQ_FLAG_PRIO, SQ_FLAG_DROP_OLDEST, SQ_FLAG_JOURNAL or SQ_FLAG_CONFLATE.
+ *
+ * SQ_FLAG_CONFLATE makes a list queue keep only the latest element for each e->key, for state
+ * updates and market data where a consumer only cares about the current value. a push whose
+ * key is already queued swaps its element in for the queued one (which is released) and the
+ * key keeps its place in the queue; a new key goes on the end. keys are found through a hash
+ * index, so a push stays O(1), and the queue never holds more elements than there are distinct
+ * keys: a slow consumer gets fewer, fresher elements instead of overruns. replacing takes no
+ * room, so only new keys count against maxlen. replaced elements aren't overruns, sq_stats()
+ * counts them in conflated. not available with the lock-free modes, SQ_FLAG_PRIO,
+ * SQ_FLAG_DELAY or SQ_FLAG_JOURNAL.
+ *
+ * SQ_FLAG_JOURNAL keeps a list queue's data in a memory-mapped journal file (attr->journal)
+ * so it survives a restart. push() copies the data into the journal instead of the heap and
+ * pop() moves a read cursor kept in the file; popped elements have SQ_FLAG_JOURNAL set, their
+ * data points into the journal and must be given back with sq_elem_release(). when
+ * sq_init_attr() opens a journal with data left in it, the queue starts out with those
+ * elements, pointing at the records where they lie. attr->journal_sync says when the journal
+ * is flushed to disk. a push that doesn't fit in the journal fails with SQ_ERR_NOMEM like any
+ * other allocation failure. not available with the lock-free modes, SQ_FLAG_PRIO, SQ_FLAG_DELAY
+ * or SQ_FLAG_CONFLATE.
+ *
+ * sq_stats() returns a snapshot of the queue's counters: pushes, pops, drops, lock contention,
+ * time producers spent waiting for room and the high water mark. they're kept with relaxed
+ * atomics (or come for free from the ring positions) so they're always on. SQ_FLAG_TIMESTAMP
+ * also stamps every element on push() and keeps a log2 histogram of the time spent queued,
+ * which costs a clock read on each push() and pop().
+ *
+ * on a box with more than one NUMA node, attr->numa_node puts the queue struct and its pool
+ * on a node (SQ_NUMA_LOCAL is the node of the thread calling sq_init_attr(), so a consumer
+ * that creates its own queue gets it on its own node). with SQ_FLAG_POOL that covers the
+ * elements and VOLATILE data too, so the consumer isn't reading another socket's memory on
+ * every pop; elements that don't come from the pool are malloc()'d by the producer as usual.
+ * an SQ_FLAG_SHARED | SQ_FLAG_VOLATILE element published with SQ_FLAG_NUMA as well is copied
+ * once per node instead of once in all, onto that node, for the queues that were placed there
+ * (and once more for queues that weren't placed). node copies are whole pages from the kernel,
+ * so that pays off for payloads of a few KB and up read by several subscribers per node. with
+ * a single node, or built without libnuma (see sq_numa.h), nothing is placed and SQ_FLAG_NUMA
+ * publishes the usual single copy.
+ *
+ * waiting is adaptive: before a producer or consumer goes to sleep (on the queue lock, for room
+ * or for data) it can poll attr->spin times busy-waiting with a CPU pause, then attr->yield
+ * times giving up the CPU, which for hand-offs of a few microseconds is much quicker than
+ * being woken up. both default to 0, i.e. straight to sleep. attr->spin = SQ_SPIN_FOREVER
+ * never sleeps or yields at all, for threads pinned to isolated cores. a consumer that's still
+ * spinning when the push comes in also saves the producer the wakeup call.
+ *
+ * to shut a queue down, sq_close() it: from then on pushes fail with SQ_ERR_CLOSED, consumers
+ * still get whatever is left, and once it has all been popped, pop() and friends (waiting
+ * ones included) return SQ_ERR_CLOSED instead of SQ_ERR_EMPTY or going to sleep. closing wakes
+ * up everyone waiting on the queue, its listeners and queue sets, and leaves the sq_get_fd()
+ * eventfd readable for good, so every kind of consumer finds out. sq_drain() pops everything
+ * still queued in one go (due or not, on an SQ_FLAG_DELAY queue), to be handed to whatever
+ * takes over, and sq_destroy() frees the queue along with anything still in it. a push racing
+ * sq_close() either fails or goes in before the consumers are told the queue has ended.
  *
  * if SQ_FLAG_NOWAIT is passed to sq_init(), then (almost) all lock calls can fail and the sq_*
  * function might return SQ_ERR_WOULDBLOCK. not an error so much as an indication that the
@@ -38,36 +174,223 @@
  */
 
 /* queue entry */
+/* no holes, so SQ_FLAG_VOLATILE data copied in right behind it starts as early as it can */
 typedef struct sq_elem_t {
 	struct sq_elem_t *next;
 	void *data;				/* data for this entry */
 	unsigned int dlen;			/* lengh of data */
 	unsigned int flags;			/* entry flags */
+	unsigned int overruns;			/* on pop(): number of elements lost since the previous pop() */
+	unsigned int prio;			/* priority, 0 (lowest) to SQ_PRIO_LEVELS - 1 (SQ_FLAG_PRIO only) */
+	unsigned long long ts;			/* when this entry was pushed (SQ_FLAG_TIMESTAMP) or is due (SQ_FLAG_DELAY) */
+	unsigned long long key;			/* entries with the same key replace each other (SQ_FLAG_CONFLATE only) */
+	struct sq_pool_t *pool;			/* pool this entry belongs to (SQ_FLAG_POOL only) */
+	struct sq_shared_t *shared;		/* shared data this entry points to (SQ_FLAG_SHARED only) */
 } sq_elem_t;
 
 
+/*
+ * SQ_FLAG_MPSC list, Vyukov's intrusive multiple producer, single consumer queue
+ * a producer swaps its element in as the new tail and then links the old tail to it, the
+ * consumer follows the next pointers from head. the stub element keeps the list from ever
+ * being completely empty, so the two sides never have to touch the same pointer.
+ */
+typedef struct {
+	sq_elem_t *head SQ_ALIGNED;		/* next element to pop (or the stub), consumer only */
+	unsigned long pops;			/* elements popped, written by the consumer */
+	sq_elem_t *tail SQ_ALIGNED;		/* newest element, swapped in by producers */
+	unsigned long pushes;			/* elements pushed, counted before they're linked in */
+	sq_elem_t stub SQ_ALIGNED;		/* placeholder, back in the list whenever the consumer catches up */
+} sq_mpsc_t;
+
+
+#define SQ_PRIO_LEVELS		32		/* number of priorities, one bit each in sq_prio_t.map */
+
+/*
+ * per-priority sublists for SQ_FLAG_PRIO queues
+ * bit n of map is set when head[n] isn't empty, so pop() finds the highest priority with a
+ * single count-leading-zeros
+ */
+typedef struct sq_prio_t {
+	sq_elem_t *head[SQ_PRIO_LEVELS];	/* first element of each priority */
+	sq_elem_t *tail[SQ_PRIO_LEVELS];	/* last element of each priority */
+	unsigned int map;			/* non-empty priorities */
+} sq_prio_t;
+
+
+/*
+ * data shared by all of the elements sq_publish() creates for an SQ_FLAG_SHARED element
+ * freed when the last of those elements is released
+ */
+typedef struct sq_shared_t {
+	unsigned int refs;			/* number of elements still pointing here */
+	unsigned int flags;			/* SQ_FLAG_FREE if data must be free()'d too */
+	void *data;				/* the data, usually right after this struct */
+	int node;				/* node this copy is on (SQ_FLAG_NUMA), SQ_NUMA_ANY if it was malloc()'d */
+	size_t size;				/* bytes allocated, for sq_numa_free() */
+} sq_shared_t;
+
+
+/*
+ * element pool
+ * a fixed number of element slots allocated up front, each with room for dlen bytes of
+ * SQ_FLAG_VOLATILE data right after the element struct. slots are whole cache lines, so no
+ * two elements share one.
+ */
+typedef struct sq_pool_t {
+	sq_ring_t free;				/* unused slots */
+	sq_spsc_t spsc_free;			/* unused slots, when the pool belongs to an SQ_FLAG_SPSC queue */
+	unsigned int spsc;			/* nonzero if spsc_free is used instead of free */
+	sq_elem_t *spare;			/* spsc: slots of failed pushes, kept by the producer for its next get */
+	unsigned int len;			/* number of slots */
+	unsigned int dlen;			/* data bytes available in each slot */
+	int node;				/* node the pool is on, SQ_NUMA_ANY if it isn't placed */
+	size_t size;				/* bytes allocated for the pool and its slots */
+} sq_pool_t;
+
+
+/*
+ * optional queue attributes for sq_init_attr()
+ * set up the defaults with sq_attr_init() and then change what you need
+ */
+typedef struct {
+	unsigned int pool_len;			/* SQ_FLAG_POOL: number of pool elements, 0 means maxlen */
+	unsigned int pool_dlen;			/* SQ_FLAG_POOL: data bytes kept inline in each pool element, default SQ_INLINE_LEN */
+	const char *journal;			/* SQ_FLAG_JOURNAL: journal file, created if it doesn't exist */
+	unsigned long long journal_size;	/* SQ_FLAG_JOURNAL: bytes of record space in a new journal */
+	unsigned int journal_sync;		/* SQ_FLAG_JOURNAL: SQ_JOURNAL_SYNC_*, when the journal is msync()'d */
+	unsigned long long journal_sync_ns;	/* SQ_FLAG_JOURNAL: interval for SQ_JOURNAL_SYNC_PERIODIC */
+	unsigned int spin;			/* busy-wait polls before yielding, SQ_SPIN_FOREVER never stops spinning */
+	unsigned int yield;			/* sched_yield() polls after spinning, before going to sleep */
+	int numa_node;				/* node to put the queue and its pool on, default SQ_NUMA_ANY */
+} sq_attr_t;
+
+#define SQ_SPIN_FOREVER			(~0U)	/* spin: only ever busy-wait, for threads on cores of their own */
+
+#define SQ_NUMA_ANY			(-1)	/* numa_node: wherever the allocator puts it */
+#define SQ_NUMA_LOCAL			(-2)	/* numa_node: the node of the thread creating the queue */
+
+#define SQ_JOURNAL_SIZE			(1 << 20)		/* default journal_size */
+#define SQ_JOURNAL_SYNC_NS		(10 * 1000 * 1000ULL)	/* default journal_sync_ns, 10 msec */
+
+#define SQ_JOURNAL_SYNC_NONE		0	/* left to the kernel; survives the process crashing but not the host */
+#define SQ_JOURNAL_SYNC_PERIODIC	1	/* msync() at most every journal_sync_ns, from push() or pop() */
+#define SQ_JOURNAL_SYNC_BATCH		2	/* push() and push_many() return once their elements are on disk */
+
+
+#define SQ_STATS_BUCKETS	40		/* residency histogram buckets, the last one is ~9 min and up */
+
+/*
+ * queue counters, see sq_stats()
+ * residency[b] counts the elements that spent 2^b to 2^(b+1)-1 nsec in the queue (only kept
+ * with SQ_FLAG_TIMESTAMP); bucket 0 also counts anything under a nanosecond.
+ */
+typedef struct {
+	unsigned long long pushes;		/* elements pushed */
+	unsigned long long pops;		/* elements popped */
+	unsigned long long drops;		/* elements lost to overruns, same as the e->overruns total */
+	unsigned long long conflated;		/* pushes that replaced a queued element with the same key (SQ_FLAG_CONFLATE) */
+	unsigned long long contended;		/* times q->mtx was already taken (mutex mode only) */
+	unsigned long long blocked;		/* times a producer had to wait for room */
+	unsigned long long blocked_ns;		/* total time producers spent waiting for room */
+	unsigned int hwm;			/* most elements ever in the queue at once */
+	unsigned long long residency[SQ_STATS_BUCKETS];
+} sq_stats_t;
+
+
+#define SQ_SET_MAX		64		/* most queues in an sq_set_t, one bit each in the ready mask */
+
+/*
+ * queue set for sq_select()/sq_poll()
+ * each queue in the set sets its bit in ready when it goes from empty to non-empty
+ */
+typedef struct sq_set_t {
+	pthread_mutex_t mtx;			/* protects queues[] and sleeping on cond */
+	pthread_cond_t cond;			/* cond var for select() to wait on when nothing is ready */
+	unsigned int waiters;			/* number of threads sleeping in select() */
+	unsigned long long ready;		/* bit n set when queues[n] went non-empty */
+	unsigned int len;			/* one past the highest bit in use */
+	struct sq_t *queues[SQ_SET_MAX];	/* the queue with bit n, NULL if there's none */
+} sq_set_t;
+
+
 /*
  * queue listener list entry
- * each one of these is a cond var that will be woken up on push()
+ * each one of these is a cond var, an fd or a queue set that will be woken up when push()
+ * makes the queue non-empty
  */
 typedef struct sq_listeners_t {
 	struct sq_listeners_t *next;
-	pthread_cond_t *newdata;
+	pthread_cond_t *newdata;		/* cond var to broadcast to, or NULL */
+	int fd;					/* eventfd to write to if newdata and set are NULL */
+	sq_set_t *set;				/* queue set to mark ready, or NULL */
+	unsigned long long bit;			/* this queue's bit in set->ready */
 } sq_listeners_t;
 
 
-typedef struct {
+/*
+ * queue
+ * fields are grouped by who touches them, and each group starts on a cache line of its own
+ * (SQ_ALIGNED, see sq_config.h) so producers and consumers on different cores don't keep
+ * pulling each other's lines over: read-mostly setup first, then the list and its lock, the
+ * cond vars, the rarely written sleep/wake state, producer counters, consumer counters, the
+ * listener lock and finally the rings (whose head and tail are split up the same way).
+ */
+typedef struct sq_t {
+	/* set up by sq_init() and only read afterwards */
 	const char *name;			/* name of the queue, only for debug */
 	void *ctx;				/* opaque object, not used by sq at all */
+	unsigned int flags;			/* queue flags */
+	unsigned int maxlen;			/* max number of items allowed */
+	unsigned int spin;			/* adaptive waits, see sq_attr_t */
+	unsigned int yield;
+	unsigned int barrier;			/* lock-free modes: sq_membarrier() works, producers can skip some fences */
+	int numa_node;				/* node the queue and its pool are on, SQ_NUMA_ANY if they aren't placed */
+	sq_pool_t *pool;			/* element pool (SQ_FLAG_POOL only) */
+	sq_prio_t *prio;			/* per-priority sublists, used instead of head/tail (SQ_FLAG_PRIO only) */
+	struct sq_journal_t *journal;		/* where the elements' data lives (SQ_FLAG_JOURNAL only) */
+	struct sq_delay_t *delay;		/* due-time heap, used instead of head/tail (SQ_FLAG_DELAY only) */
+	struct sq_conflate_t *conflate;		/* key index, used instead of head/tail (SQ_FLAG_CONFLATE only) */
+	sq_listeners_t *listeners;		/* list of listeners for this queue, woken up when it goes non-empty */
+	int efd;				/* level triggered eventfd from sq_get_fd(), -1 if there isn't one */
+
+	/* list mode: the list, and the lock that protects it */
+	pthread_mutex_t mtx SQ_ALIGNED;		/* queue mutex */
 	sq_elem_t *head;			/* first element in the queue */
 	sq_elem_t *tail;			/* last element in the queue */
-	pthread_mutex_t mtx;			/* queue mutex */
-	pthread_cond_t notfull;			/* cond var for push() to wait on when queue is full */
-	unsigned int flags;			/* queue flags */
-	unsigned int len, maxlen;		/* number of items in queue / max number of items allowed */
+	unsigned int len;			/* number of items in queue */
+
+	pthread_cond_t notfull SQ_ALIGNED;	/* cond var for push() to wait on when queue is full */
+	pthread_cond_t notempty SQ_ALIGNED;	/* cond var for pop_wait() to wait on when queue is empty */
+
+	/* read on every push/pop by the other side, but only written when someone sleeps or data is lost */
+	unsigned int ne_used SQ_ALIGNED;	/* SQ_NE_ON once anyone has slept in pop_wait(), see sq_wake_notempty() (lock-free modes only) */
+	unsigned int ne_waiters;		/* number of consumers sleeping in pop_wait() */
+	unsigned int ne_seq;			/* futex pop_wait() sleeps on (lock-free modes only) */
+	unsigned int nf_waiters;		/* number of producers sleeping on notfull (SQ_FLAG_RING only) */
+	unsigned int overruns;			/* elements lost since the last pop() */
+	unsigned int closed;			/* set by sq_close(), pushes fail and running empty is the end (SQ_CLOSED) */
+
+	/* counters for sq_stats(), producer side */
+	unsigned long long pushes SQ_ALIGNED;	/* list mode only, the rings count their own */
+	unsigned long long drops;
+	unsigned long long conflated;
+	unsigned long long contended;
+	unsigned long long blocked;
+	unsigned long long blocked_ns;
+	unsigned long long evicted;		/* elements SQ_FLAG_DROP_OLDEST popped off the ring */
+	unsigned int pushing;			/* SQ_FLAG_SPSC: the producer is part way through a push, see sq_push_enter() */
+	unsigned int hwm;
+
+	/* counters for sq_stats(), consumer side */
+	unsigned long long pops SQ_ALIGNED;	/* list mode only, the rings count their own */
+	unsigned long long residency[SQ_STATS_BUCKETS];
+
+	pthread_mutex_t listeners_mtx SQ_ALIGNED;	/* listener mutex */
 
-	pthread_mutex_t listeners_mtx;		/* listener mutex */
-	sq_listeners_t *listeners;		/* list of listeners for this queue, each is woken up on push() */
+	sq_ring_t ring;				/* element ring (SQ_FLAG_RING only) */
+	sq_spsc_t spsc;				/* element ring (SQ_FLAG_SPSC only) */
+	sq_mpsc_t mpsc;				/* element list (SQ_FLAG_MPSC only) */
 } sq_t;
 
 
@@ -85,23 +408,68 @@ typedef struct sq_list_t {
 #define SQ_FLAG_NOWAIT		(1 << 0)	/* queue functions not allowed to sleep */
 #define SQ_FLAG_VOLATILE	(1 << 1)	/* on push(): must alloc+copy data too  on pop(): data will disappear when e is free()'d */
 #define SQ_FLAG_FREE		(1 << 2)	/* on pop(): caller must free(e->data) before free(e) */
+#define SQ_FLAG_POOL		(1 << 3)	/* on init(): preallocate elements  on pop(): element must go back with sq_elem_release() */
+#define SQ_FLAG_RING		(1 << 4)	/* on init(): queue is a lock-free ring instead of a mutex-protected list */
+#define SQ_FLAG_SPSC		(1 << 5)	/* on init(): queue is a single producer, single consumer ring */
+#define SQ_FLAG_SHARED		(1 << 6)	/* on publish(): copy data once for all queues  on pop(): data is shared, use sq_elem_release() */
+#define SQ_FLAG_DROP_OLDEST	(1 << 7)	/* on init(): push() to a full queue throws away the oldest element */
+#define SQ_FLAG_DROP_NEWEST	(1 << 8)	/* on init(): push() to a full queue throws away the pushed element */
+#define SQ_FLAG_TIMESTAMP	(1 << 9)	/* on init(): time how long elements spend in the queue */
+#define SQ_FLAG_PRIO		(1 << 10)	/* on init(): pop() goes by e->prio first, then in order */
+#define SQ_FLAG_JOURNAL		(1 << 11)	/* on init(): keep data in a journal file (see sq_attr_t)  on pop(): data is in the journal, use sq_elem_release() */
+#define SQ_FLAG_MPSC		(1 << 12)	/* on init(): queue is an unbounded multiple producer, single consumer list */
+#define SQ_FLAG_DELAY		(1 << 13)	/* on init(): elements aren't popped until they're due, see sq_push_at() */
+#define SQ_FLAG_CONFLATE	(1 << 14)	/* on init(): push() replaces the queued element with the same e->key */
+#define SQ_FLAG_NUMA		(1 << 15)	/* on publish(): with SHARED and VOLATILE, copy data once per NUMA node */
 #define SQ_FLAG_FULL		(1 << 30)	/* pushing this element filled the queue */
-#define SQ_FLAG_OVERRUN		(1 << 31)	/* queue is full and not allowed to sleep waiting to be freed, so some data was discarded */
+#define SQ_FLAG_OVERRUN		(1 << 31)	/* on pop(): some data was discarded since the previous pop(), see e->overruns */
 
 #define SQ_MASK_ALLOC		(SQ_FLAG_VOLATILE | SQ_FLAG_FREE)
 #define SQ_MASK_QSTATE		(SQ_FLAG_OVERRUN | SQ_FLAG_FULL)
+#define SQ_MASK_LOCKFREE	(SQ_FLAG_RING | SQ_FLAG_SPSC | SQ_FLAG_MPSC)
 
 #define SQ_ERR_NO_ERROR		(0)
 #define SQ_ERR_EMPTY		(-1)
 #define SQ_ERR_NOMEM		(-2)
 #define SQ_ERR_FULL		(-3)
 #define SQ_ERR_WOULDBLOCK	(-4)
+#define SQ_ERR_TIMEOUT		(-5)
+#define SQ_ERR_CLOSED		(-6)
+#define SQ_ERR_INVAL		(-7)
 
 int sq_push(sq_t *q, sq_elem_t *e);
+int sq_push_timed(sq_t *q, sq_elem_t *e, unsigned long long timeout_ns);
+int sq_push_at(sq_t *q, sq_elem_t *e, unsigned long long due);
 int sq_pop(sq_t *q, sq_elem_t **e);
+int sq_pop_wait(sq_t *q, sq_elem_t **e);
+int sq_pop_timed(sq_t *q, sq_elem_t **e, unsigned long long timeout_ns);
+int sq_push_many(sq_t *q, sq_elem_t *e, unsigned int *n);
+int sq_pop_many(sq_t *q, sq_elem_t **elems, unsigned int max, unsigned int *n);
 sq_t *sq_init(const char *name, void *ctx, int maxlen, unsigned int flags);
+sq_t *sq_init_attr(const char *name, void *ctx, int maxlen, unsigned int flags, const sq_attr_t *attr);
+void sq_attr_init(sq_attr_t *attr);
+void sq_close(sq_t *q);
+int sq_drain(sq_t *q, sq_elem_t **e, unsigned int *n);
+void sq_destroy(sq_t *q);
+sq_elem_t *sq_elem_dup(const sq_elem_t *e);
+void sq_elem_release(sq_elem_t *e);
+unsigned int sq_len(sq_t *q);
+unsigned long long sq_next_due(sq_t *q);
+void sq_stats(sq_t *q, sq_stats_t *stats);
 void sq_add_listener(sq_t *q, pthread_cond_t *data_cond);
+void sq_add_listener_fd(sq_t *q, int fd);
+int sq_remove_listener(sq_t *q, pthread_cond_t *data_cond);
+int sq_remove_listener_fd(sq_t *q, int fd);
+int sq_get_fd(sq_t *q);
+sq_set_t *sq_set_init(void);
+int sq_set_add(sq_set_t *set, sq_t *q);
+int sq_set_remove(sq_set_t *set, sq_t *q);
+void sq_set_destroy(sq_set_t *set);
+int sq_poll(sq_set_t *set, unsigned long long *ready);
+int sq_select(sq_set_t *set, unsigned long long *ready);
+int sq_select_timed(sq_set_t *set, unsigned long long *ready, unsigned long long timeout_ns);
 sq_list_t *sq_list_add(sq_list_t **list, sq_t *q);
+sq_list_t *sq_list_remove(sq_list_t **list, sq_t *q);
 int sq_publish(sq_list_t *list, sq_elem_t *e);
 
 #endif /* _SQ_H_ */
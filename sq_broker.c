@@ -0,0 +1,630 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sq.h"
+#include "sq_broker.h"
+#include "sq_wait.h"
+
+
+/* queues collected while building a topic's snapshot */
+typedef struct {
+	sq_t **q;
+	unsigned int len;
+	unsigned int size;
+} sq_broker_vec_t;
+
+
+/* length of the level at the start of s */
+static size_t sq_broker_len(const char *s)
+{
+	const char *sep = strchr(s, SQ_BROKER_SEP);
+
+	return sep ? (size_t)(sep - s) : strlen(s);
+}
+
+
+/* compares a node's level with the len characters at s, strcmp() style */
+static int sq_broker_cmp(const char *level, const char *s, size_t len)
+{
+	int r;
+
+	if ((r = strncmp(level, s, len))) {
+		return r;
+	}
+
+	return level[len] != '\0';
+}
+
+
+/*
+ * finds n's child for the len characters at s with a binary search
+ * returns the child or NULL; where it is or would go is put in *pos (if pos isn't NULL)
+ */
+static sq_broker_node_t *sq_broker_kid(sq_broker_node_t *n, const char *s, size_t len, unsigned int *pos)
+{
+	unsigned int lo, hi, mid;
+	int r;
+
+	for (lo = 0, hi = n->nkids; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if ((r = sq_broker_cmp(n->kids[mid]->level, s, len)) == 0) {
+			lo = mid;
+			break;
+		}
+
+		if (r < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (pos) {
+		*pos = lo;
+	}
+
+	return lo < hi ? n->kids[lo] : NULL;
+}
+
+
+/* adds a child to n for the len characters at s, at pos; returns NULL on memory allocation failure */
+static sq_broker_node_t *sq_broker_kid_add(sq_broker_node_t *n, const char *s, size_t len, unsigned int pos)
+{
+	sq_broker_node_t *k, **kids;
+
+	if (n->nkids == n->kids_size) {
+		if ((kids = realloc(n->kids, (n->kids_size ? n->kids_size * 2 : 4) * sizeof(*kids))) == NULL) {
+			return NULL;
+		}
+
+		n->kids = kids;
+		n->kids_size = n->kids_size ? n->kids_size * 2 : 4;
+	}
+
+	if ((k = calloc(1, sizeof(*k))) == NULL) {
+		return NULL;
+	}
+
+	if ((k->level = strndup(s, len)) == NULL) {
+		free(k);
+		return NULL;
+	}
+
+	k->parent = n;
+	memmove(n->kids + pos + 1, n->kids + pos, (n->nkids - pos) * sizeof(*n->kids));
+	n->kids[pos] = k;
+	n->nkids++;
+	return k;
+}
+
+
+/* frees n and any of its parents that no longer have anything in them */
+static void sq_broker_prune(sq_broker_node_t *n)
+{
+	sq_broker_node_t *p;
+	unsigned int pos;
+
+	while ((p = n->parent) && n->subs == NULL && n->topic == NULL && n->nkids == 0) {
+		sq_broker_kid(p, n->level, strlen(n->level), &pos);
+		memmove(p->kids + pos, p->kids + pos + 1, (p->nkids - pos - 1) * sizeof(*p->kids));
+		p->nkids--;
+
+		free(n->kids);
+		free(n->level);
+		free(n);
+		n = p;
+	}
+}
+
+
+/* nonzero if the len characters at s are the level lit */
+static int sq_broker_is(const char *s, size_t len, const char *lit)
+{
+	return len == strlen(lit) && memcmp(s, lit, len) == 0;
+}
+
+
+/*
+ * checks a topic name (wild = 0) or a pattern (wild != 0): topics can't have wildcard levels,
+ * and in a pattern "#" can only be the last level
+ *
+ * returns nonzero if it's fine
+ */
+static int sq_broker_valid(const char *s, int wild)
+{
+	size_t len;
+
+	for ( ; ; s += len + 1) {
+		len = sq_broker_len(s);
+		if (sq_broker_is(s, len, SQ_BROKER_REST)) {
+			return wild && s[len] == '\0';
+		}
+
+		if (!wild && sq_broker_is(s, len, SQ_BROKER_ONE)) {
+			return 0;
+		}
+
+		if (s[len] == '\0') {
+			return 1;
+		}
+	}
+}
+
+
+/*
+ * finds the node for a topic name or pattern, making the missing levels if create is set
+ * returns the node, or NULL if it doesn't exist or there was no memory
+ */
+static sq_broker_node_t *sq_broker_path(sq_broker_t *b, const char *s, int create)
+{
+	sq_broker_node_t *n, *k;
+	unsigned int pos;
+	size_t len;
+
+	for (n = &b->root; ; s += len + 1, n = k) {
+		len = sq_broker_len(s);
+		if ((k = sq_broker_kid(n, s, len, &pos)) == NULL) {
+			if (!create || (k = sq_broker_kid_add(n, s, len, pos)) == NULL) {
+				return NULL;
+			}
+		}
+
+		if (s[len] == '\0') {
+			return k;
+		}
+	}
+}
+
+
+/* adds the queues on a subscription list to v; returns -1 on memory allocation failure */
+static int sq_broker_vec_add(sq_broker_vec_t *v, sq_list_t *l)
+{
+	sq_t **q;
+
+	for ( ; l; l = l->next) {
+		if (v->len == v->size) {
+			if ((q = realloc(v->q, (v->size ? v->size * 2 : 8) * sizeof(*q))) == NULL) {
+				return -1;
+			}
+
+			v->q = q;
+			v->size = v->size ? v->size * 2 : 8;
+		}
+
+		v->q[v->len++] = l->q;
+	}
+
+	return 0;
+}
+
+
+/*
+ * adds the queues subscribed to patterns under n that match the rest of a topic name, s
+ * (NULL once all of the levels are matched). only the paths the topic can take are walked.
+ *
+ * returns 0 or -1 on memory allocation failure
+ */
+static int sq_broker_match(sq_broker_node_t *n, const char *s, sq_broker_vec_t *v)
+{
+	sq_broker_node_t *k;
+	const char *next;
+	size_t len;
+
+	/* "#" matches whatever's left, nothing included */
+	if ((k = sq_broker_kid(n, SQ_BROKER_REST, 1, NULL)) && sq_broker_vec_add(v, k->subs)) {
+		return -1;
+	}
+
+	if (s == NULL) {
+		return sq_broker_vec_add(v, n->subs);
+	}
+
+	len = sq_broker_len(s);
+	next = s[len] ? s + len + 1 : NULL;
+
+	if ((k = sq_broker_kid(n, SQ_BROKER_ONE, 1, NULL)) && sq_broker_match(k, next, v)) {
+		return -1;
+	}
+
+	if ((k = sq_broker_kid(n, s, len, NULL)) && sq_broker_match(k, next, v)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int sq_broker_qcmp(const void *a, const void *b)
+{
+	uintptr_t qa = (uintptr_t)*(sq_t * const *)a, qb = (uintptr_t)*(sq_t * const *)b;
+
+	return (qa > qb) - (qa < qb);
+}
+
+
+/*
+ * waits until every publish that might have loaded t->snap before it was swapped is done.
+ * publishes count themselves in readers[epoch & 1]; bumping the epoch sends new ones to the
+ * other slot, so the old slot drains. it's done twice because a publish can read the epoch,
+ * stall, and count itself in the old slot after we looked at it -- it saw the new snapshot,
+ * but it's in the slot the next writer won't wait for. we sleep on the slot's counter and the
+ * publish that empties it wakes us. two writers flipping the same topic's epoch would send
+ * publishes back into each other's old slots, so they take turns on t->sync_mtx.
+ */
+static void sq_topic_sync(sq_topic_t *t)
+{
+	unsigned int i, idx, n;
+
+	pthread_mutex_lock(&t->sync_mtx);
+	for (i = 0; i < 2; i++) {
+		idx = __atomic_fetch_add(&t->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+		__atomic_store_n(&t->syncing, 1, __ATOMIC_SEQ_CST);
+		while ((n = __atomic_load_n(&t->readers[idx], __ATOMIC_SEQ_CST))) {
+			sq_futex_wait(&t->readers[idx], n, 0);
+		}
+
+		__atomic_store_n(&t->syncing, 0, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&t->sync_mtx);
+}
+
+
+/*
+ * frees the snapshots sq_topic_refresh() swapped out, once no publish is using them any more.
+ * called after b->mtx is dropped: a publish can be stuck pushing to a full queue, and that
+ * shouldn't hold up every other subscribe and unsubscribe on the broker.
+ */
+static void sq_broker_retire(sq_broker_snap_t *old)
+{
+	sq_broker_snap_t *next;
+
+	for ( ; old; old = next) {
+		next = old->retired;
+		sq_topic_sync(old->topic);
+		free(old);
+	}
+}
+
+
+/*
+ * rebuilds a topic's snapshot from the subscriptions that match it and swaps it in. the old
+ * one goes on the *retired list, for sq_broker_retire() to free.
+ *
+ * returns SQ_ERR_NO_ERROR or SQ_ERR_NOMEM, in which case the old snapshot stays
+ */
+static int sq_topic_refresh(sq_broker_t *b, sq_topic_t *t, sq_broker_snap_t **retired)
+{
+	sq_broker_vec_t v = { NULL, 0, 0 };
+	sq_broker_snap_t *snap = NULL, *old;
+	unsigned int i, n;
+
+	if (sq_broker_match(&b->root, t->name, &v)) {
+		free(v.q);
+		return SQ_ERR_NOMEM;
+	}
+
+	/* a queue subscribed through more than one pattern gets one copy */
+	if (v.len) {
+		qsort(v.q, v.len, sizeof(*v.q), sq_broker_qcmp);
+	}
+
+	for (i = n = 0; i < v.len; i++) {
+		if (n == 0 || v.q[i] != v.q[n - 1]) {
+			v.q[n++] = v.q[i];
+		}
+	}
+
+	if (n) {
+		if ((snap = malloc(sizeof(*snap) + n * sizeof(*snap->list))) == NULL) {
+			free(v.q);
+			return SQ_ERR_NOMEM;
+		}
+
+		snap->len = n;
+		for (i = 0; i < n; i++) {
+			snap->list[i].q = v.q[i];
+			snap->list[i].next = i + 1 < n ? &snap->list[i + 1] : NULL;
+		}
+	}
+
+	free(v.q);
+
+	if ((old = __atomic_exchange_n(&t->snap, snap, __ATOMIC_SEQ_CST))) {
+		old->topic = t;
+		old->retired = *retired;
+		*retired = old;
+	}
+
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/* refreshes every topic at or under n, see sq_topic_refresh(); returns SQ_ERR_NOMEM if any of them couldn't be */
+static int sq_broker_refresh_all(sq_broker_t *b, sq_broker_node_t *n, sq_broker_snap_t **retired)
+{
+	unsigned int i;
+	int ret = SQ_ERR_NO_ERROR;
+
+	if (n->topic) {
+		ret = sq_topic_refresh(b, n->topic, retired);
+	}
+
+	for (i = 0; i < n->nkids; i++) {
+		if (sq_broker_refresh_all(b, n->kids[i], retired) != SQ_ERR_NO_ERROR) {
+			ret = SQ_ERR_NOMEM;
+		}
+	}
+
+	return ret;
+}
+
+
+/*
+ * refreshes the topics under n that match the rest of a pattern, s (NULL once all of the
+ * levels are matched), see sq_topic_refresh(); returns SQ_ERR_NOMEM if any of them couldn't be
+ */
+static int sq_broker_refresh(sq_broker_t *b, sq_broker_node_t *n, const char *s, sq_broker_snap_t **retired)
+{
+	sq_broker_node_t *k;
+	const char *next;
+	unsigned int i;
+	size_t len;
+	int ret = SQ_ERR_NO_ERROR;
+
+	if (s == NULL) {
+		return n->topic ? sq_topic_refresh(b, n->topic, retired) : SQ_ERR_NO_ERROR;
+	}
+
+	len = sq_broker_len(s);
+	next = s[len] ? s + len + 1 : NULL;
+
+	if (sq_broker_is(s, len, SQ_BROKER_REST)) {
+		return sq_broker_refresh_all(b, n, retired);
+	}
+
+	if (!sq_broker_is(s, len, SQ_BROKER_ONE)) {
+		return (k = sq_broker_kid(n, s, len, NULL)) ? sq_broker_refresh(b, k, next, retired) : SQ_ERR_NO_ERROR;
+	}
+
+	/* "+": every child, skipping the wildcards (there are no topics under them) */
+	for (i = 0; i < n->nkids; i++) {
+		k = n->kids[i];
+		if (strcmp(k->level, SQ_BROKER_ONE) && strcmp(k->level, SQ_BROKER_REST) &&
+		    sq_broker_refresh(b, k, next, retired) != SQ_ERR_NO_ERROR) {
+			ret = SQ_ERR_NOMEM;
+		}
+	}
+
+	return ret;
+}
+
+
+/*
+ * allocates and initializes an empty broker
+ * returns the new broker or NULL on memory allocation failure
+ */
+sq_broker_t *sq_broker_init(const char *name)
+{
+	sq_broker_t *b;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL) {
+		return NULL;
+	}
+
+	if ((b->root.level = strdup("")) == NULL) {
+		free(b);
+		return NULL;
+	}
+
+	b->name = name;
+	pthread_mutex_init(&b->mtx, NULL);
+	return b;
+}
+
+
+/*
+ * looks up a topic by name, making it (and working out where it goes) if it's new. topics
+ * stay around as long as the broker does, so the handle can be kept and published to.
+ *
+ * returns the topic, or NULL if the name has wildcards in it or there was no memory
+ */
+sq_topic_t *sq_broker_topic(sq_broker_t *b, const char *name)
+{
+	sq_broker_snap_t *retired = NULL;
+	sq_broker_node_t *n;
+	sq_topic_t *t;
+
+	if (!sq_broker_valid(name, 0)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&b->mtx);
+	if ((n = sq_broker_path(b, name, 1)) == NULL || (t = n->topic)) {
+		pthread_mutex_unlock(&b->mtx);
+		return n ? t : NULL;
+	}
+
+	/* the publish counters get a cache line of their own, away from the other topics */
+	if (posix_memalign((void **)&t, SQ_CACHELINE, sizeof(*t))) {
+		sq_broker_prune(n);
+		pthread_mutex_unlock(&b->mtx);
+		return NULL;
+	}
+
+	/* a new topic has no snapshot to swap out, so nothing ends up on retired */
+	memset(t, 0, sizeof(*t));
+	t->node = n;
+	pthread_mutex_init(&t->sync_mtx, NULL);
+	if ((t->name = strdup(name)) == NULL || sq_topic_refresh(b, t, &retired) != SQ_ERR_NO_ERROR) {
+		pthread_mutex_destroy(&t->sync_mtx);
+		free(t->name);
+		free(t);
+		sq_broker_prune(n);
+		pthread_mutex_unlock(&b->mtx);
+		return NULL;
+	}
+
+	n->topic = t;
+	b->topics++;
+	pthread_mutex_unlock(&b->mtx);
+	return t;
+}
+
+
+/*
+ * subscribes a queue to every topic, existing or not, that matches a pattern; a queue that's
+ * already subscribed to the pattern stays subscribed once. a queue that matches a topic
+ * through several patterns still only gets one copy of each element published to it.
+ *
+ * returns SQ_ERR_NO_ERROR, SQ_ERR_INVAL for a bad pattern, or SQ_ERR_NOMEM (in which case
+ * some of the matching topics may not publish to q yet)
+ */
+int sq_broker_subscribe(sq_broker_t *b, const char *pattern, sq_t *q)
+{
+	sq_broker_snap_t *retired = NULL;
+	sq_broker_node_t *n;
+	sq_list_t *l;
+	int ret;
+
+	if (!sq_broker_valid(pattern, 1)) {
+		return SQ_ERR_INVAL;
+	}
+
+	pthread_mutex_lock(&b->mtx);
+	if ((n = sq_broker_path(b, pattern, 1)) == NULL) {
+		pthread_mutex_unlock(&b->mtx);
+		return SQ_ERR_NOMEM;
+	}
+
+	for (l = n->subs; l && l->q != q; l = l->next) ;
+	if (l) {
+		ret = SQ_ERR_NO_ERROR;
+
+	} else if (sq_list_add(&n->subs, q) == NULL) {
+		sq_broker_prune(n);
+		ret = SQ_ERR_NOMEM;
+
+	} else {
+		ret = sq_broker_refresh(b, &b->root, pattern, &retired);
+	}
+
+	pthread_mutex_unlock(&b->mtx);
+	sq_broker_retire(retired);
+	return ret;
+}
+
+
+/*
+ * undoes sq_broker_subscribe(); once it returns, no publish will push to q through this
+ * pattern (it waits for the ones in progress). unsubscribing from a pattern the queue isn't
+ * subscribed to does nothing.
+ *
+ * returns SQ_ERR_NO_ERROR, SQ_ERR_INVAL for a bad pattern, or SQ_ERR_NOMEM (in which case
+ * some of the matching topics may still publish to q)
+ */
+int sq_broker_unsubscribe(sq_broker_t *b, const char *pattern, sq_t *q)
+{
+	sq_broker_snap_t *retired = NULL;
+	sq_broker_node_t *n;
+	sq_list_t **lp, *l;
+	int ret = SQ_ERR_NO_ERROR;
+
+	if (!sq_broker_valid(pattern, 1)) {
+		return SQ_ERR_INVAL;
+	}
+
+	pthread_mutex_lock(&b->mtx);
+	if ((n = sq_broker_path(b, pattern, 0))) {
+		for (lp = &n->subs; *lp && (*lp)->q != q; lp = &(*lp)->next) ;
+		if ((l = *lp)) {
+			*lp = l->next;
+			free(l);
+			ret = sq_broker_refresh(b, &b->root, pattern, &retired);
+			sq_broker_prune(n);
+		}
+	}
+
+	/* the publishes that could still push to q are waited for here */
+	pthread_mutex_unlock(&b->mtx);
+	sq_broker_retire(retired);
+	return ret;
+}
+
+
+/*
+ * publishes an element to every queue subscribed to the topic, same as sq_publish() (an
+ * SQ_FLAG_SHARED element is only copied once); doesn't take any locks
+ *
+ * returns SQ_ERR_NO_ERROR if the element went to every subscriber (or there aren't any), or
+ * the last error a push returned
+ */
+int sq_broker_publish(sq_topic_t *t, sq_elem_t *e)
+{
+	sq_broker_snap_t *snap;
+	unsigned int idx;
+	int ret = SQ_ERR_NO_ERROR;
+
+	/* pairs with sq_topic_sync(): either it sees us counted or we see the new snapshot */
+	idx = __atomic_load_n(&t->epoch, __ATOMIC_RELAXED) & 1;
+	__atomic_add_fetch(&t->readers[idx], 1, __ATOMIC_SEQ_CST);
+
+	if ((snap = __atomic_load_n(&t->snap, __ATOMIC_SEQ_CST))) {
+		ret = sq_publish(snap->list, e);
+	}
+
+	/* pairs with sq_topic_sync(): either it sees the count drop or we see it waiting */
+	if (__atomic_sub_fetch(&t->readers[idx], 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&t->syncing, __ATOMIC_SEQ_CST)) {
+		sq_futex_wake(&t->readers[idx], 1);
+	}
+
+	return ret;
+}
+
+
+
+/* frees n's subtree: subscription lists, topics and their snapshots, and the nodes under it */
+static void sq_broker_free(sq_broker_node_t *n)
+{
+	sq_list_t *l;
+	unsigned int i;
+
+	for (i = 0; i < n->nkids; i++) {
+		sq_broker_free(n->kids[i]);
+		free(n->kids[i]->level);
+		free(n->kids[i]);
+	}
+
+	free(n->kids);
+
+	while ((l = n->subs)) {
+		n->subs = l->next;
+		free(l);
+	}
+
+	if (n->topic) {
+		free(n->topic->snap);
+		free(n->topic->name);
+		pthread_mutex_destroy(&n->topic->sync_mtx);
+		free(n->topic);
+	}
+}
+
+
+/*
+ * frees the broker, its topics and subscriptions; the subscribed queues are the caller's and
+ * are left alone. nobody may be using the broker or any of its topic handles any more.
+ */
+void sq_broker_destroy(sq_broker_t *b)
+{
+	if (b == NULL) {
+		return;
+	}
+
+	sq_broker_free(&b->root);
+	free(b->root.level);
+	pthread_mutex_destroy(&b->mtx);
+	free(b);
+}
\ No newline at end of file
@@ -0,0 +1,82 @@
+#ifndef _SQ_BROKER_H_
+#define _SQ_BROKER_H_
+
+/*
+ * topic based publish/subscribe
+ *
+ * topics are named with '/' separated levels ("sensors/kitchen/temp"). queues subscribe to
+ * patterns: a level of "+" matches any one level and a last level of "#" matches any number
+ * of levels, none included, so "sensors/+/temp" and "sensors/#" both match the topic above
+ * (and "sensors/#" matches "sensors" too).
+ *
+ * topics and subscriptions live in one trie keyed on levels. a topic keeps a snapshot of the
+ * queues it goes to, built when the topic is made and rebuilt only for the topics a
+ * subscribe or unsubscribe pattern matches, so a publish is just a walk of that snapshot:
+ * it costs the same no matter how many other topics and subscriptions there are.
+ *
+ * publishers never lock. a snapshot is never changed once it's up; a subscription change
+ * builds a new one, swaps it in and waits for the publishes still using the old one to finish
+ * before freeing it (RCU style: each topic counts its publishes in one of two slots, and the
+ * writer flips slots and sleeps until the old slot drains, twice). so once
+ * sq_broker_unsubscribe() returns nothing will be pushed to the queue through that pattern
+ * again -- and it does wait for publishes in progress, so don't call it from the only thread
+ * that pops a queue a publisher could be blocked on.
+ *
+ * subscribing and unsubscribing, and looking topics up with sq_broker_topic(), take the
+ * broker's lock. look topics up once and publish to the handle. the waiting is done after
+ * the broker's lock is dropped, one topic at a time, so a publish stuck on a full queue only
+ * holds up the subscribes and unsubscribes whose patterns match its topic.
+ *
+ * sq_broker_destroy() frees the broker with its topics and subscriptions; the subscribed
+ * queues are left alone.
+ */
+
+#define SQ_BROKER_SEP		'/'		/* separates levels */
+#define SQ_BROKER_ONE		"+"		/* matches exactly one level */
+#define SQ_BROKER_REST		"#"		/* last level only, matches any number of levels */
+
+/* queues a topic publishes to, linked so it can be handed straight to sq_publish() */
+typedef struct sq_broker_snap_t {
+	struct sq_topic_t *topic;		/* once swapped out: the topic it was swapped out of */
+	struct sq_broker_snap_t *retired;	/* once swapped out: next snapshot waiting to be freed */
+	unsigned int len;			/* number of queues */
+	sq_list_t list[];			/* list[i].next is &list[i + 1] */
+} sq_broker_snap_t;
+
+typedef struct sq_topic_t {
+	unsigned int readers[2] SQ_ALIGNED;	/* publishes in progress, by epoch & 1 */
+	unsigned int epoch;			/* bumped by writers to move publishes to the other slot */
+	unsigned int syncing;			/* set while a writer sleeps waiting for a slot to drain */
+	sq_broker_snap_t *snap;			/* where publishes go, NULL if nowhere */
+	char *name;				/* the topic's name */
+	struct sq_broker_node_t *node;		/* where the topic is in the trie */
+	pthread_mutex_t sync_mtx;		/* one writer waiting for the topic's publishes at a time */
+} sq_topic_t;
+
+/* one level of the trie */
+typedef struct sq_broker_node_t {
+	char *level;				/* this level, "" for the root */
+	struct sq_broker_node_t *parent;
+	struct sq_broker_node_t **kids;		/* children, sorted by level */
+	unsigned int nkids;			/* children in use */
+	unsigned int kids_size;			/* children allocated */
+	sq_list_t *subs;			/* queues subscribed to the pattern ending here */
+	sq_topic_t *topic;			/* the topic named by the path ending here, if any */
+} sq_broker_node_t;
+
+typedef struct {
+	const char *name;			/* name of the broker */
+	pthread_mutex_t mtx;			/* serializes everything but sq_broker_publish() */
+	sq_broker_node_t root;			/* the trie */
+	unsigned int topics;			/* number of topics */
+} sq_broker_t;
+
+
+sq_broker_t *sq_broker_init(const char *name);
+sq_topic_t *sq_broker_topic(sq_broker_t *b, const char *name);
+int sq_broker_subscribe(sq_broker_t *b, const char *pattern, sq_t *q);
+int sq_broker_unsubscribe(sq_broker_t *b, const char *pattern, sq_t *q);
+int sq_broker_publish(sq_topic_t *t, sq_elem_t *e);
+void sq_broker_destroy(sq_broker_t *b);
+
+#endif /* _SQ_BROKER_H_ */
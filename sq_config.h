@@ -0,0 +1,40 @@
+#ifndef _SQ_CONFIG_H_
+#define _SQ_CONFIG_H_
+
+/*
+ * build-time knobs for sq
+ *
+ * SQ_CACHELINE is the size of the blocks that cores pass cache lines back and forth in. fields
+ * written by different threads (ring head and tail, producer and consumer counters, ...) are
+ * kept SQ_CACHELINE bytes apart with SQ_ALIGNED so a write on one side doesn't invalidate the
+ * other side's line. override it with -DSQ_CACHELINE=n; it must be a power of two.
+ *
+ * the default is 128 where the hardware line really is that big (Apple silicon, POWER) and 64
+ * elsewhere. on x86 the L2 spatial prefetcher fetches lines in pairs, so 128 can help there
+ * as well when producers and consumers are on different sockets, at the cost of bigger structs.
+ *
+ * SQ_INLINE_LEN is the small-message size: SQ_FLAG_VOLATILE payloads up to this many bytes are
+ * copied into a fixed-size element slot (the element struct with the data right behind it),
+ * so every small element is the same size no matter what it carries. pools default to slots
+ * of this size too. make it the size most of your messages fit in.
+ */
+
+#ifndef SQ_CACHELINE
+#if (defined(__APPLE__) && defined(__aarch64__)) || defined(__powerpc64__)
+#define SQ_CACHELINE		128
+#else
+#define SQ_CACHELINE		64
+#endif
+#endif
+
+#if SQ_CACHELINE < 16 || (SQ_CACHELINE & (SQ_CACHELINE - 1))
+#error "SQ_CACHELINE must be a power of two, 16 or more"
+#endif
+
+#define SQ_ALIGNED		__attribute__((aligned(SQ_CACHELINE)))
+
+#ifndef SQ_INLINE_LEN
+#define SQ_INLINE_LEN		64
+#endif
+
+#endif /* _SQ_CONFIG_H_ */
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sq.h"
+#include "sq_conflate.h"
+
+
+/* spreads the bits of a key over the whole word (murmur3's finalizer) */
+static unsigned long long sq_conflate_hash(unsigned long long key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+
+/* returns where the pointer to key's entry is: its bucket or the previous entry's hnext */
+static sq_conflate_ent_t **sq_conflate_find(sq_conflate_t *c, unsigned long long key)
+{
+	sq_conflate_ent_t **ep;
+
+	for (ep = &c->buckets[sq_conflate_hash(key) & c->mask]; *ep && (*ep)->key != key; ep = &(*ep)->hnext) ;
+	return ep;
+}
+
+
+/* doubles the hash table, returns -1 if it can't (the chains just get longer then) */
+static int sq_conflate_grow(sq_conflate_t *c)
+{
+	sq_conflate_ent_t **buckets, **bucket, *ent;
+	unsigned int mask;
+
+	if (c->mask >= ~0U >> 1) {
+		return -1;
+	}
+
+	mask = (c->mask << 1) | 1;
+	if ((buckets = calloc(mask + 1ULL, sizeof(*buckets))) == NULL) {
+		return -1;
+	}
+
+	/* every entry in the table is on the order list too */
+	for (ent = c->head; ent; ent = ent->next) {
+		bucket = &buckets[sq_conflate_hash(ent->key) & mask];
+		ent->hnext = *bucket;
+		*bucket = ent;
+	}
+
+	free(c->buckets);
+	c->buckets = buckets;
+	c->mask = mask;
+	return 0;
+}
+
+
+/* allocates an empty index, returns NULL on memory allocation failure */
+sq_conflate_t *sq_conflate_init(void)
+{
+	sq_conflate_t *c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		return NULL;
+	}
+
+	if ((c->buckets = calloc(SQ_CONFLATE_MIN, sizeof(*c->buckets))) == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	c->mask = SQ_CONFLATE_MIN - 1;
+	return c;
+}
+
+
+/* frees the index; whatever elements are still in it are the caller's problem */
+void sq_conflate_destroy(sq_conflate_t *c)
+{
+	sq_conflate_ent_t *ent;
+
+	if (c == NULL) {
+		return;
+	}
+
+	while ((ent = c->head)) {
+		c->head = ent->next;
+		free(ent);
+	}
+
+	while ((ent = c->free)) {
+		c->free = ent->next;
+		free(ent);
+	}
+
+	free(c->buckets);
+	free(c);
+}
+
+
+/*
+ * makes sure there are entries for n more keys, so that sq_conflate_add() can't fail half way
+ * through a push, and grows the hash table to keep it at most one key per bucket
+ *
+ * returns 0 or -1 on memory allocation failure
+ */
+int sq_conflate_reserve(sq_conflate_t *c, unsigned int n)
+{
+	sq_conflate_ent_t *ent;
+
+	while (c->nfree < n) {
+		if ((ent = malloc(sizeof(*ent))) == NULL) {
+			return -1;
+		}
+
+		ent->next = c->free;
+		c->free = ent;
+		c->nfree++;
+	}
+
+	while (c->len + (unsigned long long)n > c->mask + 1ULL && sq_conflate_grow(c) == 0) ;
+
+	return 0;
+}
+
+
+/*
+ * if e's key is already queued, puts e in place of the element that's there
+ * returns the element e replaced, to be released by the caller, or NULL if the key is new
+ */
+sq_elem_t *sq_conflate_replace(sq_conflate_t *c, sq_elem_t *e)
+{
+	sq_conflate_ent_t *ent;
+	sq_elem_t *old_e;
+
+	if ((ent = *sq_conflate_find(c, e->key)) == NULL) {
+		return NULL;
+	}
+
+	old_e = ent->e;
+	ent->e = e;
+	return old_e;
+}
+
+
+/* adds an element whose key isn't queued to the end of the queue; there must be a free entry */
+void sq_conflate_add(sq_conflate_t *c, sq_elem_t *e)
+{
+	sq_conflate_ent_t *ent, **bucket;
+
+	ent = c->free;
+	c->free = ent->next;
+	c->nfree--;
+
+	ent->key = e->key;
+	ent->e = e;
+	ent->next = NULL;
+
+	bucket = &c->buckets[sq_conflate_hash(e->key) & c->mask];
+	ent->hnext = *bucket;
+	*bucket = ent;
+
+	if (c->tail) {
+		c->tail->next = ent;
+
+	} else {
+		c->head = ent;
+	}
+
+	c->tail = ent;
+	c->len++;
+}
+
+
+/* removes and returns the element of the key that was queued first, NULL if there aren't any */
+sq_elem_t *sq_conflate_take(sq_conflate_t *c)
+{
+	sq_conflate_ent_t *ent, **ep;
+
+	if ((ent = c->head) == NULL) {
+		return NULL;
+	}
+
+	if ((c->head = ent->next) == NULL) {
+		c->tail = NULL;
+	}
+
+	/* by identity, not sq_conflate_find(): that one goes by key */
+	for (ep = &c->buckets[sq_conflate_hash(ent->key) & c->mask]; *ep != ent; ep = &(*ep)->hnext) ;
+	*ep = ent->hnext;
+	c->len--;
+
+	ent->next = c->free;
+	c->free = ent;
+	c->nfree++;
+	return ent->e;
+}
@@ -0,0 +1,43 @@
+#ifndef _SQ_CONFLATE_H_
+#define _SQ_CONFLATE_H_
+
+/*
+ * key index used by SQ_FLAG_CONFLATE queues
+ *
+ * every key in the queue has one entry, which is both in a chained hash table (by e->key) and
+ * in a list in the order the keys were first pushed. the entry points at the latest element
+ * pushed with its key, so a push of a key that's already queued just swaps the element the
+ * entry points at and the key keeps its place in the queue. popped entries go on a free list
+ * and get reused, so memory is bounded by the most keys ever queued at once.
+ *
+ * the caller serializes everything (q->mtx).
+ */
+
+#define SQ_CONFLATE_MIN		64		/* hash buckets allocated to start with */
+
+typedef struct sq_conflate_ent_t {
+	unsigned long long key;			/* e->key, kept here so lookups don't touch the element */
+	sq_elem_t *e;				/* latest element pushed with this key */
+	struct sq_conflate_ent_t *hnext;	/* next entry in the same bucket */
+	struct sq_conflate_ent_t *next;		/* next key in queue order, or next free entry */
+} sq_conflate_ent_t;
+
+typedef struct sq_conflate_t {
+	sq_conflate_ent_t **buckets;		/* hash table, buckets[hash & mask] */
+	unsigned int mask;			/* buckets - 1 */
+	unsigned int len;			/* keys queued */
+	sq_conflate_ent_t *head;		/* first key in queue order */
+	sq_conflate_ent_t *tail;		/* last key in queue order */
+	sq_conflate_ent_t *free;		/* unused entries */
+	unsigned int nfree;			/* number of unused entries */
+} sq_conflate_t;
+
+
+sq_conflate_t *sq_conflate_init(void);
+void sq_conflate_destroy(sq_conflate_t *c);
+int sq_conflate_reserve(sq_conflate_t *c, unsigned int n);
+sq_elem_t *sq_conflate_replace(sq_conflate_t *c, sq_elem_t *e);
+void sq_conflate_add(sq_conflate_t *c, sq_elem_t *e);
+sq_elem_t *sq_conflate_take(sq_conflate_t *c);
+
+#endif /* _SQ_CONFLATE_H_ */
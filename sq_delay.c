@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sq.h"
+#include "sq_delay.h"
+
+
+/* nonzero if entry a comes out before entry b */
+static int sq_delay_before(const sq_delay_ent_t *a, const sq_delay_ent_t *b)
+{
+	return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+
+/* publishes the new earliest due time after the heap changed */
+static void sq_delay_set_next(sq_delay_t *d)
+{
+	__atomic_store_n(&d->next, d->len ? d->heap[0].due : SQ_DELAY_NONE, __ATOMIC_RELAXED);
+}
+
+
+/* allocates an empty heap, returns NULL on memory allocation failure */
+sq_delay_t *sq_delay_init(void)
+{
+	sq_delay_t *d;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL) {
+		return NULL;
+	}
+
+	if ((d->heap = malloc(SQ_DELAY_MIN * sizeof(*d->heap))) == NULL) {
+		free(d);
+		return NULL;
+	}
+
+	d->size = SQ_DELAY_MIN;
+	d->next = SQ_DELAY_NONE;
+	return d;
+}
+
+
+/* frees the heap; whatever elements are still in it are the caller's problem */
+void sq_delay_destroy(sq_delay_t *d)
+{
+	if (d) {
+		free(d->heap);
+		free(d);
+	}
+}
+
+
+/*
+ * makes sure there's room for n more entries, doubling the array as needed, so that
+ * sq_delay_add() can't fail half way through a batch
+ *
+ * returns 0 or -1 on memory allocation failure
+ */
+int sq_delay_reserve(sq_delay_t *d, unsigned int n)
+{
+	sq_delay_ent_t *heap;
+	unsigned long long size;
+
+	if (d->len + (unsigned long long)n <= d->size) {
+		return 0;
+	}
+
+	for (size = d->size; size < d->len + (unsigned long long)n; size <<= 1) ;
+	if (size > ~0U) {
+		return -1;
+	}
+
+	if ((heap = realloc(d->heap, size * sizeof(*heap))) == NULL) {
+		return -1;
+	}
+
+	d->heap = heap;
+	d->size = size;
+	return 0;
+}
+
+
+/* adds an element that's due at due (sq_now_ns() time); there must be room, see sq_delay_reserve() */
+void sq_delay_add(sq_delay_t *d, sq_elem_t *e, unsigned long long due)
+{
+	sq_delay_ent_t ent, *heap = d->heap;
+	unsigned int i, parent;
+
+	ent.due = due;
+	ent.seq = d->seq++;
+	ent.e = e;
+
+	/* sift up: move parents down until ent fits */
+	for (i = d->len++; i > 0; i = parent) {
+		parent = (i - 1) / SQ_DELAY_ARITY;
+		if (!sq_delay_before(&ent, &heap[parent])) {
+			break;
+		}
+
+		heap[i] = heap[parent];
+	}
+
+	heap[i] = ent;
+	if (i == 0) {
+		sq_delay_set_next(d);
+	}
+}
+
+
+/* removes and returns the element that's due first, NULL if the heap is empty */
+sq_elem_t *sq_delay_take(sq_delay_t *d)
+{
+	sq_delay_ent_t last, *heap = d->heap;
+	unsigned int i, c, best, end;
+	sq_elem_t *e;
+
+	if (d->len == 0) {
+		return NULL;
+	}
+
+	e = heap[0].e;
+	last = heap[--d->len];
+
+	/* sift down: move the earliest child up until the old last entry fits */
+	for (i = 0; (c = i * SQ_DELAY_ARITY + 1) < d->len; i = best) {
+		end = c + SQ_DELAY_ARITY < d->len ? c + SQ_DELAY_ARITY : d->len;
+		for (best = c++; c < end; c++) {
+			if (sq_delay_before(&heap[c], &heap[best])) {
+				best = c;
+			}
+		}
+
+		if (!sq_delay_before(&heap[best], &last)) {
+			break;
+		}
+
+		heap[i] = heap[best];
+	}
+
+	heap[i] = last;
+	sq_delay_set_next(d);
+	return e;
+}
+
+
+/* returns when the next element is due, SQ_DELAY_NONE if there isn't one; safe without the lock */
+unsigned long long sq_delay_next(sq_delay_t *d)
+{
+	return __atomic_load_n(&d->next, __ATOMIC_RELAXED);
+}
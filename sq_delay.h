@@ -0,0 +1,43 @@
+#ifndef _SQ_DELAY_H_
+#define _SQ_DELAY_H_
+
+/*
+ * due-time heap used by SQ_FLAG_DELAY queues
+ *
+ * a 4-ary min-heap of (due, seq, element) entries kept in one growable array. the due times
+ * live in the array rather than behind the element pointers, so sifting only ever touches the
+ * array: insert and take are O(log n) with a quarter of the levels a binary heap would have,
+ * and each step compares four neighbouring entries. seq breaks ties so elements that are due
+ * at the same time come out in the order they were pushed.
+ *
+ * the caller serializes everything (q->mtx) except sq_delay_next(), which can be read at any
+ * time.
+ */
+
+#define SQ_DELAY_ARITY		4		/* children per heap node */
+#define SQ_DELAY_MIN		64		/* entries allocated to start with */
+#define SQ_DELAY_NONE		(~0ULL)		/* sq_delay_next() of an empty heap */
+
+typedef struct {
+	unsigned long long due;			/* when the element may be popped, sq_now_ns() time */
+	unsigned long long seq;			/* push order, for elements due at the same time */
+	sq_elem_t *e;
+} sq_delay_ent_t;
+
+typedef struct sq_delay_t {
+	sq_delay_ent_t *heap;			/* heap[0] is due first */
+	unsigned int len;			/* entries in use */
+	unsigned int size;			/* entries allocated */
+	unsigned long long seq;			/* next push's seq */
+	unsigned long long next;		/* heap[0].due or SQ_DELAY_NONE, for readers without the lock */
+} sq_delay_t;
+
+
+sq_delay_t *sq_delay_init(void);
+void sq_delay_destroy(sq_delay_t *d);
+int sq_delay_reserve(sq_delay_t *d, unsigned int n);
+void sq_delay_add(sq_delay_t *d, sq_elem_t *e, unsigned long long due);
+sq_elem_t *sq_delay_take(sq_delay_t *d);
+unsigned long long sq_delay_next(sq_delay_t *d);
+
+#endif /* _SQ_DELAY_H_ */
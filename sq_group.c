@@ -0,0 +1,502 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "sq.h"
+#include "sq_group.h"
+#include "sq_wait.h"
+
+
+/*
+ * allocates and initializes a group of workers, each with a deque of (at least) maxlen
+ * elements; maxlen is rounded up to a power of two. flags are SQ_GROUP_*.
+ *
+ * returns the new group or NULL on memory allocation failure
+ */
+sq_group_t *sq_group_init(const char *name, unsigned int workers, int maxlen, unsigned int flags)
+{
+	sq_group_t *g;
+	unsigned int i, n;
+
+	if (workers == 0 || maxlen <= 0) {
+		return NULL;
+	}
+
+	for (n = 1; n < (unsigned int)maxlen; n <<= 1) ;
+
+	if (posix_memalign((void **)&g, SQ_CACHELINE, sizeof(*g))) {
+		return NULL;
+	}
+
+	memset(g, 0, sizeof(*g));
+	g->name = name;
+	g->flags = flags;
+	g->len = workers;
+	g->mask = n - 1;
+
+	/* each worker's lock and indices get a cache line to themselves */
+	if (posix_memalign((void **)&g->workers, SQ_CACHELINE, workers * sizeof(*g->workers))) {
+		free(g);
+		return NULL;
+	}
+
+	memset(g->workers, 0, workers * sizeof(*g->workers));
+	for (i = 0; i < workers; i++) {
+		if ((g->workers[i].slots = calloc(n, sizeof(*g->workers[i].slots))) == NULL) {
+			while (i--) {
+				free(g->workers[i].slots);
+			}
+
+			free(g->workers);
+			free(g);
+			return NULL;
+		}
+
+		pthread_mutex_init(&g->workers[i].mtx, NULL);
+	}
+
+	return g;
+}
+
+
+/*
+ * wakes up an idle worker, if there is one, after something was pushed. only one wakeup is
+ * in flight at a time: until a worker leaves the idle state (and clears g->waking) it will
+ * look at every deque anyway, so a burst of pushes costs one futex call, not one each. the
+ * worker passes the wakeup on if it leaves work behind, see sq_group_unidle().
+ */
+static void sq_group_wake(sq_group_t *g)
+{
+	/* pairs with the fence in sq_group_pop_deadline(): either it sees the element or we see it idling */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&g->idle, __ATOMIC_RELAXED) && !__atomic_exchange_n(&g->waking, 1, __ATOMIC_ACQ_REL)) {
+		__atomic_add_fetch(&g->seq, 1, __ATOMIC_RELEASE);
+		sq_futex_wake(&g->seq, 1);
+	}
+}
+
+
+/*
+ * a worker is done idling (and has taken its element, if it got one); the next push may wake
+ * someone else. pushes that came in while the wakeup was in flight didn't wake anyone, so if
+ * there's work left over and others are still idle, the next one is woken up too: a burst of
+ * pushes wakes workers one after the other until it runs out of work or idle workers.
+ */
+static void sq_group_unidle(sq_group_t *g)
+{
+	__atomic_sub_fetch(&g->idle, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&g->waking, 0, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&g->idle, __ATOMIC_RELAXED) && sq_group_len(g)) {
+		sq_group_wake(g);
+	}
+}
+
+
+/* adds an element to the newest end of a worker's deque; returns SQ_ERR_NO_ERROR, SQ_ERR_FULL or SQ_ERR_CLOSED */
+static int sq_group_add(sq_group_t *g, sq_group_worker_t *wk, sq_elem_t *e)
+{
+	pthread_mutex_lock(&wk->mtx);
+	if (g->closed) {
+		pthread_mutex_unlock(&wk->mtx);
+		return SQ_ERR_CLOSED;
+	}
+
+	if (wk->len > g->mask) {
+		pthread_mutex_unlock(&wk->mtx);
+		return SQ_ERR_FULL;
+	}
+
+	wk->slots[wk->tail++ & g->mask] = e;
+	__atomic_store_n(&wk->len, wk->len + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&wk->mtx);
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/* takes the next element off a worker's deque, which must be locked and not empty */
+static sq_elem_t *sq_group_take_locked(sq_group_t *g, sq_group_worker_t *wk)
+{
+	sq_elem_t *e;
+
+	if (g->flags & SQ_GROUP_LIFO) {
+		e = wk->slots[--wk->tail & g->mask];
+
+	} else {
+		e = wk->slots[wk->head++ & g->mask];
+	}
+
+	__atomic_store_n(&wk->len, wk->len - 1, __ATOMIC_RELAXED);
+	return e;
+}
+
+
+/* takes the next element off worker w's own deque; returns SQ_ERR_NO_ERROR or SQ_ERR_EMPTY */
+static int sq_group_take(sq_group_t *g, unsigned int w, sq_elem_t **e)
+{
+	sq_group_worker_t *wk = &g->workers[w];
+
+	if (__atomic_load_n(&wk->len, __ATOMIC_RELAXED) == 0) {
+		return SQ_ERR_EMPTY;
+	}
+
+	pthread_mutex_lock(&wk->mtx);
+	if (wk->len == 0) {
+		pthread_mutex_unlock(&wk->mtx);
+		return SQ_ERR_EMPTY;
+	}
+
+	*e = sq_group_take_locked(g, wk);
+	pthread_mutex_unlock(&wk->mtx);
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * worker w has run dry: moves the oldest half of the busiest peer's deque (up to
+ * SQ_GROUP_STEAL_MAX) over to w's deque, then takes the first one. both deques are locked,
+ * lowest index first, so the elements never have to be held anywhere else and put back.
+ *
+ * returns SQ_ERR_NO_ERROR or SQ_ERR_EMPTY if there was nothing to steal
+ */
+static int sq_group_steal(sq_group_t *g, unsigned int w, sq_elem_t **e)
+{
+	sq_group_worker_t *own = &g->workers[w], *vic, *first, *second;
+	unsigned int i, v, len, max, n;
+	int ret;
+
+	for (i = 0, v = w, max = 0; i < g->len; i++) {
+		if (i != w && (len = __atomic_load_n(&g->workers[i].len, __ATOMIC_RELAXED)) > max) {
+			max = len;
+			v = i;
+		}
+	}
+
+	if (v == w) {
+		return SQ_ERR_EMPTY;
+	}
+
+	vic = &g->workers[v];
+	first = v < w ? vic : own;
+	second = v < w ? own : vic;
+	pthread_mutex_lock(&first->mtx);
+	pthread_mutex_lock(&second->mtx);
+
+	/* someone may have got there first, and our own deque may have been pushed to meanwhile */
+	n = (vic->len + 1) / 2;
+	if (n > SQ_GROUP_STEAL_MAX) {
+		n = SQ_GROUP_STEAL_MAX;
+	}
+
+	if (n > g->mask + 1 - own->len) {
+		n = g->mask + 1 - own->len;
+	}
+
+	for (i = 0; i < n; i++) {
+		own->slots[own->tail++ & g->mask] = vic->slots[vic->head++ & g->mask];
+	}
+
+	__atomic_store_n(&vic->len, vic->len - n, __ATOMIC_RELAXED);
+	__atomic_store_n(&own->len, own->len + n, __ATOMIC_RELAXED);
+
+	ret = SQ_ERR_EMPTY;
+	if (own->len) {
+		*e = sq_group_take_locked(g, own);
+		ret = SQ_ERR_NO_ERROR;
+	}
+
+	pthread_mutex_unlock(&second->mtx);
+	pthread_mutex_unlock(&first->mtx);
+	return ret;
+}
+
+
+/* pushes a copy of e to worker w, or the next one along with room */
+static int sq_group_place(sq_group_t *g, unsigned int w, sq_elem_t *e)
+{
+	sq_elem_t *new_e;
+	unsigned int i;
+	int ret;
+
+	/* don't bother copying anything for a closed group */
+	if (__atomic_load_n(&g->closed, __ATOMIC_ACQUIRE)) {
+		return SQ_ERR_CLOSED;
+	}
+
+	if ((new_e = sq_elem_dup(e)) == NULL) {
+		return SQ_ERR_NOMEM;
+	}
+
+	for (i = 0, ret = SQ_ERR_FULL; i < g->len && ret == SQ_ERR_FULL; i++, w = w + 1 < g->len ? w + 1 : 0) {
+		if ((ret = sq_group_add(g, &g->workers[w], new_e)) == SQ_ERR_NO_ERROR) {
+			sq_group_wake(g);
+			return SQ_ERR_NO_ERROR;
+		}
+	}
+
+	/* the caller still owns any SQ_FLAG_FREE data */
+	new_e->flags &= ~SQ_FLAG_FREE;
+	sq_elem_release(new_e);
+	return ret;
+}
+
+
+/*
+ * copies an element into the group, on the next worker round-robin or the least loaded one
+ * (SQ_GROUP_LEAST_LOADED). if that worker's deque is full the next one with room gets it.
+ *
+ * returns SQ_ERR_NO_ERROR, SQ_ERR_FULL if every deque is full, SQ_ERR_CLOSED once the group
+ * has been closed or SQ_ERR_NOMEM
+ */
+int sq_group_push(sq_group_t *g, sq_elem_t *e)
+{
+	unsigned int i, w, best, len, min;
+
+	/* round-robin also says where to start looking, so ties don't all go to worker 0 */
+	w = __atomic_fetch_add(&g->rr, 1, __ATOMIC_RELAXED) % g->len;
+
+	if (g->flags & SQ_GROUP_LEAST_LOADED) {
+		for (i = 0, best = w, min = ~0U; i < g->len; i++, w = w + 1 < g->len ? w + 1 : 0) {
+			if ((len = __atomic_load_n(&g->workers[w].len, __ATOMIC_RELAXED)) < min) {
+				min = len;
+				best = w;
+			}
+		}
+
+		w = best;
+	}
+
+	return sq_group_place(g, w, e);
+}
+
+
+/*
+ * copies an element into worker w's deque (or the next one along, if it's full), for a worker
+ * that wants to keep the work it generates for itself
+ *
+ * returns the same as sq_group_push()
+ */
+int sq_group_push_to(sq_group_t *g, unsigned int w, sq_elem_t *e)
+{
+	return sq_group_place(g, w % g->len, e);
+}
+
+
+/*
+ * returns nonzero once a closed group has nothing left in it. sq_group_close() held every
+ * worker's lock, so whatever got pushed before it is in a deque by the time closed is seen.
+ */
+static int sq_group_ended(sq_group_t *g)
+{
+	return __atomic_load_n(&g->closed, __ATOMIC_ACQUIRE) && sq_group_len(g) == 0;
+}
+
+
+/* pops for worker w from its own deque or a peer's, optionally sleeping until deadline (0 = forever) */
+static int sq_group_pop_deadline(sq_group_t *g, unsigned int w, sq_elem_t **e, int wait, unsigned long long deadline)
+{
+	unsigned int seq;
+	int ret, idling;
+
+	if (w >= g->len) {
+		return SQ_ERR_INVAL;
+	}
+
+	for (idling = 0; ; ) {
+		ret = SQ_ERR_EMPTY;
+		if (sq_group_take(g, w, e) == SQ_ERR_NO_ERROR || sq_group_steal(g, w, e) == SQ_ERR_NO_ERROR) {
+			ret = SQ_ERR_NO_ERROR;
+		}
+
+		/* back from sleeping, and only now that we've had our pick do we say so */
+		if (idling) {
+			sq_group_unidle(g);
+			idling = 0;
+		}
+
+		if (ret == SQ_ERR_NO_ERROR) {
+			return SQ_ERR_NO_ERROR;
+		}
+
+		if (sq_group_ended(g)) {
+			return SQ_ERR_CLOSED;
+		}
+
+		if (!wait) {
+			return SQ_ERR_EMPTY;
+		}
+
+		/* say we're about to sleep, then have one more look before we do */
+		seq = __atomic_load_n(&g->seq, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&g->idle, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (sq_group_take(g, w, e) == SQ_ERR_NO_ERROR || sq_group_steal(g, w, e) == SQ_ERR_NO_ERROR) {
+			sq_group_unidle(g);
+			return SQ_ERR_NO_ERROR;
+		}
+
+		/* closed with elements left somewhere, go round again; sq_group_close() bumps seq after setting closed */
+		if (__atomic_load_n(&g->closed, __ATOMIC_ACQUIRE)) {
+			sq_group_unidle(g);
+			continue;
+		}
+
+		/* whatever woke us, we look at every deque again before going back to sleep */
+		if (sq_futex_wait(&g->seq, seq, deadline) == ETIMEDOUT) {
+			ret = SQ_ERR_TIMEOUT;
+			if (sq_group_take(g, w, e) == SQ_ERR_NO_ERROR || sq_group_steal(g, w, e) == SQ_ERR_NO_ERROR) {
+				ret = SQ_ERR_NO_ERROR;
+			}
+
+			sq_group_unidle(g);
+			return ret;
+		}
+
+		idling = 1;
+	}
+}
+
+
+/*
+ * pops the next element for worker w: from its own deque if there's anything in it, otherwise
+ * stolen from the busiest peer. only worker w should pop with w.
+ *
+ * returns SQ_ERR_NO_ERROR, SQ_ERR_EMPTY if the whole group is empty, SQ_ERR_CLOSED once it
+ * has been closed and emptied, or SQ_ERR_INVAL if there's no worker w
+ */
+int sq_group_pop(sq_group_t *g, unsigned int w, sq_elem_t **e)
+{
+	return sq_group_pop_deadline(g, w, e, 0, 0);
+}
+
+
+/* like sq_group_pop(), but sleeps until there's something to pop */
+int sq_group_pop_wait(sq_group_t *g, unsigned int w, sq_elem_t **e)
+{
+	return sq_group_pop_deadline(g, w, e, 1, 0);
+}
+
+
+/* like sq_group_pop_wait(), but gives up and returns SQ_ERR_TIMEOUT after timeout_ns */
+int sq_group_pop_timed(sq_group_t *g, unsigned int w, sq_elem_t **e, unsigned long long timeout_ns)
+{
+	return sq_group_pop_deadline(g, w, e, 1, sq_now_ns() + timeout_ns);
+}
+
+
+/* returns the number of elements in the whole group; only a snapshot if others are pushing/popping */
+unsigned int sq_group_len(sq_group_t *g)
+{
+	unsigned int i, len;
+
+	for (i = 0, len = 0; i < g->len; i++) {
+		len += __atomic_load_n(&g->workers[i].len, __ATOMIC_RELAXED);
+	}
+
+	return len;
+}
+
+
+/*
+ * closes the group. pushes fail with SQ_ERR_CLOSED from now on, and once the workers have
+ * popped what's left, pops return SQ_ERR_CLOSED instead of SQ_ERR_EMPTY or sleeping. idle
+ * workers are woken up to find out. closing a group that's closed already does nothing.
+ */
+void sq_group_close(sq_group_t *g)
+{
+	unsigned int i;
+
+	/* every lock, so a push is either in a deque already or sees closed */
+	for (i = 0; i < g->len; i++) {
+		pthread_mutex_lock(&g->workers[i].mtx);
+	}
+
+	__atomic_store_n(&g->closed, 1, __ATOMIC_SEQ_CST);
+
+	while (i--) {
+		pthread_mutex_unlock(&g->workers[i].mtx);
+	}
+
+	__atomic_add_fetch(&g->seq, 1, __ATOMIC_SEQ_CST);
+	sq_futex_wake(&g->seq, INT_MAX);
+}
+
+
+/*
+ * takes everything out of every deque in one go, to hand over to whatever takes over from
+ * the workers. close the group first unless the producers have stopped anyway.
+ *
+ * e is set to the first element, with the rest linked to it through e->next, oldest first
+ * for each worker in turn (NULL if there weren't any), and n to the number of elements.
+ * each of them must be released with sq_elem_release().
+ *
+ * returns SQ_ERR_NO_ERROR
+ */
+int sq_group_drain(sq_group_t *g, sq_elem_t **e, unsigned int *n)
+{
+	sq_group_worker_t *wk;
+	sq_elem_t *first, *last, *new_e;
+	unsigned int i, count;
+
+	first = last = NULL;
+	for (i = 0, count = 0; i < g->len; i++) {
+		wk = &g->workers[i];
+		pthread_mutex_lock(&wk->mtx);
+		while (wk->head != wk->tail) {
+			new_e = wk->slots[wk->head++ & g->mask];
+			new_e->next = NULL;
+			if (last) {
+				last->next = new_e;
+
+			} else {
+				first = new_e;
+			}
+
+			last = new_e;
+			count++;
+		}
+
+		__atomic_store_n(&wk->len, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&wk->mtx);
+	}
+
+	*e = first;
+	if (n) {
+		*n = count;
+	}
+
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * frees the group and whatever elements are still in it (released as with sq_elem_release()).
+ * nobody may be using the group any more: close it, let the workers see SQ_ERR_CLOSED and join
+ * them first.
+ */
+void sq_group_destroy(sq_group_t *g)
+{
+	sq_elem_t *e, *next;
+	unsigned int i;
+
+	if (g == NULL) {
+		return;
+	}
+
+	sq_group_drain(g, &e, NULL);
+	for (; e; e = next) {
+		next = e->next;
+		sq_elem_release(e);
+	}
+
+	for (i = 0; i < g->len; i++) {
+		pthread_mutex_destroy(&g->workers[i].mtx);
+		free(g->workers[i].slots);
+	}
+
+	free(g->workers);
+	free(g);
+}
\ No newline at end of file
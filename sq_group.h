@@ -0,0 +1,67 @@
+#ifndef _SQ_GROUP_H_
+#define _SQ_GROUP_H_
+
+/*
+ * work-stealing queue groups
+ *
+ * an sq_group_t spreads elements over a pool of workers, each of which has a deque of its own
+ * with its own lock, so there's no single lock that every producer and consumer fights over.
+ * producers push to the group and it picks a worker, either round-robin or the least loaded
+ * one (SQ_GROUP_LEAST_LOADED). a worker pops from its own deque, oldest first or, with
+ * SQ_GROUP_LIFO, newest first (which keeps what it just pushed itself hot in its cache).
+ *
+ * a worker that runs out steals from the busiest of its peers: it takes the oldest half of the
+ * peer's deque (up to SQ_GROUP_STEAL_MAX elements) in one go, keeps them in its own deque and
+ * pops the first one. a worker with nothing to do and nothing to steal sleeps on the group's
+ * futex, and a push wakes one sleeper (not necessarily the worker it pushed to, any of them can
+ * steal the element). a woken worker that leaves work behind wakes the next sleeper in turn, so
+ * a burst of pushes gets as many workers going as there is work for.
+ *
+ * elements are copied on push the same way sq_push() does it (SQ_FLAG_VOLATILE data and all)
+ * and must be given back with sq_elem_release(). the group never blocks producers: a push
+ * returns SQ_ERR_FULL when every worker's deque is full.
+ *
+ * sq_group_close(), sq_group_drain() and sq_group_destroy() shut a group down the same way
+ * their sq_t counterparts do a queue: once closed, pushes fail with SQ_ERR_CLOSED and workers
+ * get what's left, then SQ_ERR_CLOSED instead of SQ_ERR_EMPTY or sleeping.
+ */
+
+#define SQ_GROUP_LIFO		(1 << 0)	/* workers pop their newest element first */
+#define SQ_GROUP_LEAST_LOADED	(1 << 1)	/* push to the worker with the shortest deque instead of round-robin */
+
+#define SQ_GROUP_STEAL_MAX	32		/* most elements taken in one steal */
+
+/* one worker's deque; slots[head] is the oldest element, slots[tail - 1] the newest */
+typedef struct {
+	pthread_mutex_t mtx SQ_ALIGNED;		/* protects everything below */
+	unsigned long head, tail;		/* positions, the slot is the position & mask */
+	unsigned int len;			/* tail - head, also read without the lock to pick a worker */
+	sq_elem_t **slots;			/* the deque */
+} sq_group_worker_t;
+
+typedef struct {
+	const char *name;			/* name of the group */
+	unsigned int flags;			/* SQ_GROUP_* */
+	unsigned int len;			/* number of workers */
+	unsigned int mask;			/* slots per worker - 1 */
+	unsigned int closed;			/* set by sq_group_close() with every worker's lock held */
+	sq_group_worker_t *workers;		/* the workers */
+	unsigned int rr SQ_ALIGNED;		/* next worker for round-robin pushes */
+	unsigned int idle SQ_ALIGNED;		/* workers getting ready to sleep or asleep */
+	unsigned int seq;			/* futex idle workers sleep on, bumped to wake them */
+	unsigned int waking;			/* set while a wakeup is on its way to an idle worker */
+} sq_group_t;
+
+
+sq_group_t *sq_group_init(const char *name, unsigned int workers, int maxlen, unsigned int flags);
+int sq_group_push(sq_group_t *g, sq_elem_t *e);
+int sq_group_push_to(sq_group_t *g, unsigned int w, sq_elem_t *e);
+int sq_group_pop(sq_group_t *g, unsigned int w, sq_elem_t **e);
+int sq_group_pop_wait(sq_group_t *g, unsigned int w, sq_elem_t **e);
+int sq_group_pop_timed(sq_group_t *g, unsigned int w, sq_elem_t **e, unsigned long long timeout_ns);
+unsigned int sq_group_len(sq_group_t *g);
+void sq_group_close(sq_group_t *g);
+int sq_group_drain(sq_group_t *g, sq_elem_t **e, unsigned int *n);
+void sq_group_destroy(sq_group_t *g);
+
+#endif /* _SQ_GROUP_H_ */
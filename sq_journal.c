@@ -0,0 +1,409 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "sq.h"
+#include "sq_journal.h"
+#include "sq_wait.h"
+
+#define SQ_JOURNAL_RND(x, a)	(((x) + (a) - 1) & ~((unsigned long long)(a) - 1))
+
+/* the record area starts on its own cache line */
+#define SQ_JOURNAL_HDR_LEN	SQ_JOURNAL_RND(sizeof(sq_journal_hdr_t), SQ_CACHELINE)
+
+/* space a record with len bytes of data takes up */
+#define SQ_JOURNAL_REC_LEN(len)	(sizeof(sq_journal_rec_t) + SQ_JOURNAL_RND(len, SQ_JOURNAL_ALIGN))
+
+
+/* CRC-32C (Castagnoli), reflected; the table is filled in by the first sq_journal_open() */
+static unsigned int sq_journal_crc_tab[256];
+static pthread_once_t sq_journal_crc_once = PTHREAD_ONCE_INIT;
+
+static void sq_journal_crc_init(void)
+{
+	unsigned int i, k, c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, k = 0; k < 8; k++) {
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		}
+
+		sq_journal_crc_tab[i] = c;
+	}
+}
+
+
+/* adds len bytes at p to a running CRC-32C, start with crc = 0 */
+static unsigned int sq_journal_crc(unsigned int crc, const void *p, unsigned long long len)
+{
+	const unsigned char *b = p;
+
+	crc = ~crc;
+#ifdef __SSE4_2__
+	for (; len >= 8; len -= 8, b += 8) {
+		unsigned long long v;
+
+		memcpy(&v, b, sizeof(v));
+		crc = (unsigned int)__builtin_ia32_crc32di(crc, v);
+	}
+
+	for (; len; len--) {
+		crc = __builtin_ia32_crc32qi(crc, *b++);
+	}
+#else
+	for (; len; len--) {
+		crc = sq_journal_crc_tab[(crc ^ *b++) & 0xff] ^ (crc >> 8);
+	}
+#endif
+
+	return ~crc;
+}
+
+
+/* a record's CRC, of everything but its flags */
+static unsigned int sq_journal_rec_crc(sq_journal_rec_t *rec)
+{
+	unsigned int crc;
+
+	crc = sq_journal_crc(0, &rec->len, sizeof(rec->len));
+	crc = sq_journal_crc(crc, &rec->next, sizeof(rec->next));
+	return sq_journal_crc(crc, rec + 1, rec->len);
+}
+
+
+/* returns the record at a position */
+static sq_journal_rec_t *sq_journal_rec(sq_journal_t *j, unsigned long long pos)
+{
+	return (sq_journal_rec_t *)(j->recs + pos % j->hdr->size);
+}
+
+
+/*
+ * checks the records between rpos and wpos after opening an existing journal, and cuts wpos
+ * back to the first record that doesn't make sense or whose CRC doesn't match, so recovery
+ * stops there. with SQ_JOURNAL_SYNC_NONE (or a crash between msync()s) the header can reach
+ * the disk without the records it points past, or with only some of their pages.
+ */
+static void sq_journal_check(sq_journal_t *j)
+{
+	sq_journal_hdr_t *hdr = j->hdr;
+	sq_journal_rec_t *rec;
+	unsigned long long pos, lap;
+
+	for (pos = hdr->rpos; pos < hdr->wpos; pos = rec->next) {
+		rec = sq_journal_rec(j, pos);
+		lap = pos - pos % hdr->size + hdr->size;
+
+		if (rec->flags & SQ_JOURNAL_REC_PAD) {
+			if (rec->next != lap) {
+				break;
+			}
+
+		} else if (rec->next != pos + SQ_JOURNAL_REC_LEN(rec->len) || rec->next > lap) {
+			break;
+		}
+
+		if (rec->next > hdr->wpos || rec->crc != sq_journal_rec_crc(rec)) {
+			break;
+		}
+
+		/* whoever popped it last time is gone, so nobody has released it */
+		rec->flags &= ~SQ_JOURNAL_REC_DONE;
+	}
+
+	hdr->wpos = pos;
+}
+
+
+/*
+ * opens (or creates) the journal file at path. a new journal gets a record area of size bytes;
+ * an existing one keeps the size it was made with. the file is flock()'d so only one queue can
+ * use it at a time.
+ *
+ * returns the journal, or NULL with errno set
+ */
+sq_journal_t *sq_journal_open(const char *path, unsigned long long size, unsigned int sync, unsigned long long sync_ns)
+{
+	sq_journal_t *j;
+	sq_journal_hdr_t *hdr;
+	struct stat st;
+	void *p;
+	int fd, err;
+
+	pthread_once(&sq_journal_crc_once, sq_journal_crc_init);
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+		return NULL;
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0) {
+		goto fail;
+	}
+
+	/* brand new file */
+	if (st.st_size == 0) {
+		size = SQ_JOURNAL_RND(size, SQ_JOURNAL_ALIGN);
+		if (size < 2 * SQ_JOURNAL_ALIGN) {
+			errno = EINVAL;
+			goto fail;
+		}
+
+		st.st_size = SQ_JOURNAL_HDR_LEN + size;
+		if (ftruncate(fd, st.st_size) < 0) {
+			goto fail;
+		}
+	}
+
+	if ((unsigned long long)st.st_size < SQ_JOURNAL_HDR_LEN) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if ((p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		goto fail;
+	}
+
+	hdr = p;
+	if (hdr->magic == 0) {
+		hdr->version = SQ_JOURNAL_VERSION;
+		hdr->size = st.st_size - SQ_JOURNAL_HDR_LEN;
+		hdr->wpos = 0;
+		hdr->rpos = 0;
+		hdr->magic = SQ_JOURNAL_MAGIC;
+		msync(p, SQ_JOURNAL_HDR_LEN, MS_SYNC);
+	}
+
+	if (hdr->magic != SQ_JOURNAL_MAGIC || hdr->version != SQ_JOURNAL_VERSION ||
+	    hdr->size != st.st_size - SQ_JOURNAL_HDR_LEN || hdr->size % SQ_JOURNAL_ALIGN ||
+	    hdr->rpos > hdr->wpos || hdr->wpos - hdr->rpos > hdr->size) {
+		munmap(p, st.st_size);
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if ((j = calloc(1, sizeof(*j))) == NULL) {
+		munmap(p, st.st_size);
+		goto fail;
+	}
+
+	j->hdr = hdr;
+	j->recs = (unsigned char *)p + SQ_JOURNAL_HDR_LEN;
+	j->map_len = st.st_size;
+	j->fd = fd;
+	j->sync = sync;
+	j->sync_ns = sync_ns;
+	j->sync_at = sq_now_ns();
+	pthread_mutex_init(&j->sync_mtx, NULL);
+
+	sq_journal_check(j);
+	j->fpos = hdr->rpos;
+	j->synced = hdr->wpos;
+	return j;
+
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+
+/* syncs and unmaps the journal; the file is left for the next sq_journal_open() */
+void sq_journal_close(sq_journal_t *j)
+{
+	if (j == NULL) {
+		return;
+	}
+
+	if (j->sync != SQ_JOURNAL_SYNC_NONE) {
+		msync(j->hdr, j->map_len, MS_SYNC);
+	}
+
+	munmap(j->hdr, j->map_len);
+	close(j->fd);
+	pthread_mutex_destroy(&j->sync_mtx);
+	free(j);
+}
+
+
+/*
+ * appends a record with a copy of len bytes of data. released records at the start of the
+ * used space are reclaimed if there isn't enough room. the caller serializes appends and
+ * consumes (q->mtx).
+ *
+ * returns a pointer to the record's data, or NULL if the journal is full
+ */
+void *sq_journal_append(sq_journal_t *j, const void *data, unsigned int len)
+{
+	sq_journal_hdr_t *hdr = j->hdr;
+	sq_journal_rec_t *rec;
+	unsigned long long pos, need, pad;
+
+	pos = hdr->wpos;
+	need = SQ_JOURNAL_REC_LEN(len);
+	if (need > hdr->size) {
+		return NULL;
+	}
+
+	/* the record has to be contiguous, so it may need to start on the next lap */
+	pad = hdr->size - pos % hdr->size;
+	if (pad >= need) {
+		pad = 0;
+	}
+
+	while (pos + pad + need - j->fpos > hdr->size) {
+		if (j->fpos == pos) {
+			return NULL;
+		}
+
+		rec = sq_journal_rec(j, j->fpos);
+		if (!(__atomic_load_n(&rec->flags, __ATOMIC_ACQUIRE) & (SQ_JOURNAL_REC_DONE | SQ_JOURNAL_REC_PAD))) {
+			return NULL;
+		}
+
+		j->fpos = rec->next;
+	}
+
+	if (pad) {
+		rec = sq_journal_rec(j, pos);
+		rec->len = 0;
+		rec->flags = SQ_JOURNAL_REC_PAD;
+		rec->next = pos + pad;
+		rec->crc = sq_journal_rec_crc(rec);
+
+		/* the read cursor never rests on a pad, its space can be reused as soon as it's passed */
+		if (hdr->rpos == pos) {
+			__atomic_store_n(&hdr->rpos, pos + pad, __ATOMIC_RELEASE);
+		}
+
+		pos += pad;
+	}
+
+	rec = sq_journal_rec(j, pos);
+	memcpy(rec + 1, data, len);
+	rec->len = len;
+	rec->flags = 0;
+	rec->next = pos + need;
+	rec->crc = sq_journal_rec_crc(rec);
+
+	/* the record only counts once wpos has moved past it */
+	__atomic_store_n(&hdr->wpos, rec->next, __ATOMIC_RELEASE);
+	return rec + 1;
+}
+
+
+/* moves the read cursor past a popped record (and any pad after it); called in order, under the same lock as append */
+void sq_journal_consume(sq_journal_t *j, void *data)
+{
+	sq_journal_rec_t *rec = (sq_journal_rec_t *)data - 1;
+	unsigned long long pos;
+
+	pos = rec->next;
+	if (pos < j->hdr->wpos && (sq_journal_rec(j, pos)->flags & SQ_JOURNAL_REC_PAD)) {
+		pos = sq_journal_rec(j, pos)->next;
+	}
+
+	__atomic_store_n(&j->hdr->rpos, pos, __ATOMIC_RELEASE);
+}
+
+
+/* marks a popped record's space as reusable, once the element pointing at it is released */
+void sq_journal_release(void *data)
+{
+	sq_journal_rec_t *rec = (sq_journal_rec_t *)data - 1;
+
+	__atomic_or_fetch(&rec->flags, SQ_JOURNAL_REC_DONE, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * walks the records left over from before the journal was opened; start with *pos = 0.
+ *
+ * returns a pointer to the next record's data (and its length in *len), or NULL when done
+ */
+void *sq_journal_recover(sq_journal_t *j, unsigned long long *pos, unsigned int *len)
+{
+	sq_journal_rec_t *rec;
+
+	if (*pos < j->hdr->rpos) {
+		*pos = j->hdr->rpos;
+	}
+
+	for (; *pos < j->hdr->wpos; *pos = rec->next) {
+		rec = sq_journal_rec(j, *pos);
+		if (!(rec->flags & SQ_JOURNAL_REC_PAD)) {
+			*pos = rec->next;
+			*len = rec->len;
+			return rec + 1;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* returns the current end of the journal, for sq_journal_commit() */
+unsigned long long sq_journal_wpos(sq_journal_t *j)
+{
+	return __atomic_load_n(&j->hdr->wpos, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * makes the journal durable as its sync mode asks, called after pushes (with the wpos they
+ * left behind) and pops (with 0) once the queue is unlocked.
+ *
+ * SQ_JOURNAL_SYNC_BATCH is a group commit: a caller whose records were already covered by
+ * someone else's msync() returns straight away, otherwise it takes the sync lock and syncs
+ * everything appended so far, which covers everyone who arrives while it's at it.
+ * SQ_JOURNAL_SYNC_PERIODIC syncs at most once every sync_ns, from whoever notices it's due.
+ */
+void sq_journal_commit(sq_journal_t *j, unsigned long long upto)
+{
+	unsigned long long now, end;
+
+	switch (j->sync) {
+	case SQ_JOURNAL_SYNC_BATCH:
+		if (upto == 0 || __atomic_load_n(&j->synced, __ATOMIC_ACQUIRE) >= upto) {
+			return;
+		}
+
+		pthread_mutex_lock(&j->sync_mtx);
+		if (__atomic_load_n(&j->synced, __ATOMIC_ACQUIRE) < upto) {
+			end = sq_journal_wpos(j);
+			msync(j->hdr, j->map_len, MS_SYNC);
+			__atomic_store_n(&j->synced, end, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&j->sync_mtx);
+		break;
+
+	case SQ_JOURNAL_SYNC_PERIODIC:
+		now = sq_now_ns();
+		if (now - __atomic_load_n(&j->sync_at, __ATOMIC_RELAXED) < j->sync_ns) {
+			return;
+		}
+
+		/* somebody's already on it */
+		if (pthread_mutex_trylock(&j->sync_mtx)) {
+			return;
+		}
+
+		if (now - j->sync_at >= j->sync_ns) {
+			end = sq_journal_wpos(j);
+			msync(j->hdr, j->map_len, MS_SYNC);
+			__atomic_store_n(&j->synced, end, __ATOMIC_RELEASE);
+			__atomic_store_n(&j->sync_at, now, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&j->sync_mtx);
+		break;
+
+	default:
+		break;
+	}
+}
@@ -0,0 +1,81 @@
+#ifndef _SQ_JOURNAL_H_
+#define _SQ_JOURNAL_H_
+
+#include <pthread.h>
+
+/*
+ * crash-durable journal used by SQ_FLAG_JOURNAL queues
+ *
+ * the journal is a file mapped into memory: a small header followed by a circular area of
+ * records, each a sq_journal_rec_t followed by the element's data. push() appends a record and
+ * the element's data pointer points straight at it, so the data is copied exactly once. pop()
+ * moves the persisted read cursor (rpos) past the record, and sq_elem_release() marks it done
+ * so its space can be used again; space is only reused in order, once everything before it is
+ * done.
+ *
+ * positions (wpos, rpos) are byte counts that never wrap, the offset into the record area is
+ * the position modulo its size. a record that would run off the end of the area is preceded by
+ * a pad record that fills the rest of it, so records are always contiguous.
+ *
+ * when the journal is opened again after a restart, the records between rpos and wpos are the
+ * elements that were never popped. they're checked and handed back in place by
+ * sq_journal_recover(); anything from the first bad record on (i.e. a push that never made it
+ * to disk, or only partly did) is dropped. each record carries a CRC-32C of its length, next
+ * position and data, so a torn write shows up even when the header made it to disk.
+ *
+ * the record area only lives in the page cache until it's msync()'d, see SQ_JOURNAL_SYNC_* in
+ * sq.h for when that happens. pops never msync() under SQ_JOURNAL_SYNC_BATCH: rpos reaches the
+ * disk with the next push's sync, so after a crash the elements popped since then are handed
+ * back again. delivery is at-least-once, consumers of a journaled queue must cope with repeats.
+ */
+
+#define SQ_JOURNAL_MAGIC	0x73716a6c	/* "sqjl" */
+#define SQ_JOURNAL_VERSION	2
+#define SQ_JOURNAL_ALIGN	16		/* records start on this boundary */
+
+#define SQ_JOURNAL_REC_PAD	(1 << 0)	/* filler up to the end of the record area */
+#define SQ_JOURNAL_REC_DONE	(1 << 1)	/* element has been released, space can be reused */
+
+/* file header */
+typedef struct {
+	unsigned int magic;			/* SQ_JOURNAL_MAGIC once the file is set up */
+	unsigned int version;			/* SQ_JOURNAL_VERSION */
+	unsigned long long size;		/* bytes in the record area */
+	unsigned long long wpos;		/* end of the last record */
+	unsigned long long rpos;		/* first record that hasn't been popped */
+} sq_journal_hdr_t;
+
+/* record header, the data follows (on an SQ_JOURNAL_ALIGN boundary, like the record) */
+typedef struct {
+	unsigned int len;			/* data length */
+	unsigned int flags;			/* SQ_JOURNAL_REC_* */
+	unsigned long long next;		/* position of the next record */
+	unsigned int crc;			/* CRC-32C of len, next and the data; flags change after the fact */
+} __attribute__((aligned(SQ_JOURNAL_ALIGN))) sq_journal_rec_t;
+
+typedef struct sq_journal_t {
+	sq_journal_hdr_t *hdr;			/* start of the mapping */
+	unsigned char *recs;			/* record area */
+	unsigned long long map_len;		/* size of the mapping */
+	int fd;
+
+	unsigned long long fpos;		/* oldest record not yet released; space before it is free */
+
+	unsigned int sync;			/* SQ_JOURNAL_SYNC_* */
+	unsigned long long sync_ns;		/* SQ_JOURNAL_SYNC_PERIODIC interval */
+	pthread_mutex_t sync_mtx;		/* one msync() at a time */
+	unsigned long long synced;		/* everything before this position is on disk */
+	unsigned long long sync_at;		/* when the last periodic msync() was */
+} sq_journal_t;
+
+
+sq_journal_t *sq_journal_open(const char *path, unsigned long long size, unsigned int sync, unsigned long long sync_ns);
+void sq_journal_close(sq_journal_t *j);
+void *sq_journal_append(sq_journal_t *j, const void *data, unsigned int len);
+void sq_journal_consume(sq_journal_t *j, void *data);
+void sq_journal_release(void *data);
+void *sq_journal_recover(sq_journal_t *j, unsigned long long *pos, unsigned int *len);
+unsigned long long sq_journal_wpos(sq_journal_t *j);
+void sq_journal_commit(sq_journal_t *j, unsigned long long upto);
+
+#endif /* _SQ_JOURNAL_H_ */
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifdef SQ_NUMA
+#include <sched.h>
+#include <numa.h>
+#endif
+
+#include "sq.h"
+#include "sq_numa.h"
+
+#define SQ_NUMA_UNKNOWN		0		/* sq_numa_state: not checked yet */
+#define SQ_NUMA_OFF		1		/* nothing to place, everything is SQ_NUMA_ANY */
+#define SQ_NUMA_ON		2		/* libnuma works and there's more than one node */
+
+static int sq_numa_state = SQ_NUMA_UNKNOWN;
+
+
+/* returns nonzero if memory can be placed on nodes; checked once, racing callers all get the same answer */
+static int sq_numa_usable(void)
+{
+	int state;
+
+	if ((state = __atomic_load_n(&sq_numa_state, __ATOMIC_RELAXED)) == SQ_NUMA_UNKNOWN) {
+#ifdef SQ_NUMA
+		state = numa_available() >= 0 && numa_max_node() > 0 ? SQ_NUMA_ON : SQ_NUMA_OFF;
+#else
+		state = SQ_NUMA_OFF;
+#endif
+		__atomic_store_n(&sq_numa_state, state, __ATOMIC_RELAXED);
+	}
+
+	return state == SQ_NUMA_ON;
+}
+
+
+/* returns the number of nodes, 1 if there's nothing to place */
+int sq_numa_nodes(void)
+{
+#ifdef SQ_NUMA
+	if (sq_numa_usable()) {
+		return numa_max_node() + 1;
+	}
+#endif
+
+	return 1;
+}
+
+
+/* returns the node a cpu belongs to, 0 if there's nothing to place or the cpu doesn't exist */
+int sq_numa_node_of_cpu(int cpu)
+{
+#ifdef SQ_NUMA
+	int node;
+
+	if (sq_numa_usable() && cpu >= 0 && (node = numa_node_of_cpu(cpu)) >= 0) {
+		return node;
+	}
+#else
+	(void)cpu;
+#endif
+
+	return 0;
+}
+
+
+/* returns the node the calling thread is running on right now (it stays put if it's pinned) */
+int sq_numa_node(void)
+{
+#ifdef SQ_NUMA
+	if (sq_numa_usable()) {
+		return sq_numa_node_of_cpu(sched_getcpu());
+	}
+#endif
+
+	return 0;
+}
+
+
+/*
+ * turns a node from sq_attr_t into the node to allocate on
+ * SQ_NUMA_LOCAL becomes the calling thread's node. SQ_NUMA_ANY comes back when there's nothing
+ * to place, and for nodes that don't exist, have no memory or are past SQ_NUMA_MAX_NODES.
+ */
+int sq_numa_pick(int node)
+{
+	if (node == SQ_NUMA_ANY || !sq_numa_usable()) {
+		return SQ_NUMA_ANY;
+	}
+
+	if (node == SQ_NUMA_LOCAL) {
+		node = sq_numa_node();
+	}
+
+#ifdef SQ_NUMA
+	if (node >= 0 && node < SQ_NUMA_MAX_NODES && node <= numa_max_node() && numa_bitmask_isbitset(numa_all_nodes_ptr, node)) {
+		return node;
+	}
+#endif
+
+	return SQ_NUMA_ANY;
+}
+
+
+/*
+ * allocates len bytes on a node from sq_numa_pick(), or cache line aligned from the heap for
+ * SQ_NUMA_ANY. node memory is whole pages straight from the kernel, so it's only worth it for
+ * long-lived or big allocations.
+ *
+ * returns the memory, to be given back with sq_numa_free() and the same len and node, or NULL
+ */
+void *sq_numa_alloc(size_t len, int node)
+{
+	void *p;
+
+#ifdef SQ_NUMA
+	if (node != SQ_NUMA_ANY) {
+		return numa_alloc_onnode(len, node);
+	}
+#else
+	(void)node;
+#endif
+
+	if (posix_memalign(&p, SQ_CACHELINE, len)) {
+		return NULL;
+	}
+
+	return p;
+}
+
+
+/* frees memory from sq_numa_alloc() */
+void sq_numa_free(void *p, size_t len, int node)
+{
+#ifdef SQ_NUMA
+	if (node != SQ_NUMA_ANY) {
+		numa_free(p, len);
+		return;
+	}
+#else
+	(void)len;
+	(void)node;
+#endif
+
+	free(p);
+}
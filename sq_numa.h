@@ -0,0 +1,29 @@
+#ifndef _SQ_NUMA_H_
+#define _SQ_NUMA_H_
+
+#include <stddef.h>
+
+/*
+ * NUMA placement helpers used by sq
+ *
+ * built with -DSQ_NUMA (the Makefile does this when libnuma is installed), memory can be
+ * allocated on a given node, and a queue, its pool and SQ_FLAG_NUMA publish copies are put on
+ * the node of whoever reads them. without libnuma, when libnuma says the kernel has no NUMA
+ * support, or when there's only the one node, there is nothing to place: every node number
+ * turns into SQ_NUMA_ANY and memory comes from the usual allocator, so code written for a
+ * dual-socket box runs unchanged on a laptop.
+ *
+ * nodes are numbered the way the kernel (and numactl --hardware) numbers them. only the first
+ * SQ_NUMA_MAX_NODES get anything placed on them.
+ */
+
+#define SQ_NUMA_MAX_NODES	64		/* most nodes sq places memory on, and SQ_FLAG_NUMA makes copies for */
+
+int sq_numa_nodes(void);
+int sq_numa_node(void);
+int sq_numa_node_of_cpu(int cpu);
+int sq_numa_pick(int node);
+void *sq_numa_alloc(size_t len, int node);
+void sq_numa_free(void *p, size_t len, int node);
+
+#endif /* _SQ_NUMA_H_ */
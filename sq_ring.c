@@ -0,0 +1,354 @@
+#include <stdlib.h>
+
+#include "sq_ring.h"
+
+/*
+ * sets up a ring with room for at least len entries
+ * (the ring needs at least two slots for the sequence numbers to work out)
+ *
+ * returns the actual capacity of the ring or 0 on memory allocation failure
+ */
+int sq_ring_init(sq_ring_t *r, unsigned int len)
+{
+	unsigned long i, n;
+
+	for (n = 2; n < len; n <<= 1) ;
+
+	if ((r->slots = malloc(n * sizeof(*r->slots))) == NULL) {
+		return 0;
+	}
+
+	/* slot i is free for whoever pushes at position i */
+	for (i = 0; i < n; i++) {
+		r->slots[i].seq = i;
+		r->slots[i].p = NULL;
+	}
+
+	r->mask = n - 1;
+	r->head = 0;
+	r->tail = 0;
+	return n;
+}
+
+
+/* frees the slot array; anything still in the ring is the caller's problem */
+void sq_ring_destroy(sq_ring_t *r)
+{
+	free(r->slots);
+	r->slots = NULL;
+}
+
+
+/*
+ * claims the next slot for a push, to be filled in with sq_ring_fill()
+ * the claim is sequentially consistent, so a producer can look at a flag right after it and
+ * pair that with someone who sets the flag and then checks sq_ring_settled().
+ * pos is updated with the position of the slot.
+ *
+ * returns 0 on success or -1 if the ring is full
+ */
+int sq_ring_claim(sq_ring_t *r, unsigned long *pos)
+{
+	sq_ring_slot_t *s;
+	unsigned long seq;
+	long dif;
+
+	*pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		s = &r->slots[*pos & r->mask];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - *pos);
+
+		/* slot is free, try to claim it */
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->tail, pos, *pos + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				return 0;
+			}
+
+		/* slot still holds an entry from the previous lap: full */
+		} else if (dif < 0) {
+			return -1;
+
+		/* someone else pushed here first, catch up */
+		} else {
+			*pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+/*
+ * publishes p to consumers in the slot claimed at pos. p == NULL gives the slot up instead,
+ * sq_ring_pop() just skips over it.
+ */
+void sq_ring_fill(sq_ring_t *r, unsigned long pos, void *p)
+{
+	sq_ring_slot_t *s = &r->slots[pos & r->mask];
+
+	s->p = p;
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * adds p (which can't be NULL) to the ring
+ * pos_out, if not NULL, is updated with the position p went in at
+ *
+ * returns 0 on success or -1 if the ring is full
+ */
+int sq_ring_push(sq_ring_t *r, void *p, unsigned long *pos_out)
+{
+	unsigned long pos;
+
+	if (sq_ring_claim(r, &pos)) {
+		return -1;
+	}
+
+	sq_ring_fill(r, pos, p);
+	if (pos_out) {
+		*pos_out = pos;
+	}
+
+	return 0;
+}
+
+
+/*
+ * removes the oldest entry from the ring
+ *
+ * returns the entry or NULL if the ring is empty
+ */
+void *sq_ring_pop(sq_ring_t *r)
+{
+	sq_ring_slot_t *s;
+	unsigned long pos, seq;
+	long dif;
+	void *p;
+
+	pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	for (;;) {
+		s = &r->slots[pos & r->mask];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - (pos + 1));
+
+		/* slot has been filled, try to claim it */
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+
+		/* slot hasn't been filled yet: empty */
+		} else if (dif < 0) {
+			return NULL;
+
+		/* someone else popped here first, catch up */
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* hand the slot back to producers for the next lap */
+	p = s->p;
+	__atomic_store_n(&s->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+
+	/* a slot that was given up, see sq_ring_fill() */
+	if (p == NULL) {
+		return sq_ring_pop(r);
+	}
+
+	return p;
+}
+
+
+/*
+ * pops the slots at the head of the ring that were given up, up to the first one that holds an
+ * entry or hasn't been filled yet. lets a producer that gave up its slot clean up after itself
+ * when nobody may be popping any more; it never takes an entry.
+ */
+void sq_ring_skip(sq_ring_t *r)
+{
+	sq_ring_slot_t *s;
+	unsigned long pos;
+
+	pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	for (;;) {
+		s = &r->slots[pos & r->mask];
+
+		/* p can't change while the slot is filled and head hasn't gone past it */
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1 || s->p != NULL) {
+			return;
+		}
+
+		if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&s->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+			pos++;
+		}
+	}
+}
+
+
+/*
+ * returns nonzero if the next push would fail
+ * the loads are sequentially consistent so this can be used to re-check before sleeping
+ */
+int sq_ring_full(sq_ring_t *r)
+{
+	unsigned long pos, seq;
+
+	pos = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&r->slots[pos & r->mask].seq, __ATOMIC_SEQ_CST);
+	return (long)(seq - pos) < 0;
+}
+
+
+/*
+ * returns nonzero if the next pop would fail
+ * the loads are sequentially consistent so this can be used to re-check before sleeping
+ */
+int sq_ring_empty(sq_ring_t *r)
+{
+	unsigned long pos, seq;
+
+	pos = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&r->slots[pos & r->mask].seq, __ATOMIC_SEQ_CST);
+	return (long)(seq - (pos + 1)) < 0;
+}
+
+
+/*
+ * returns nonzero if every slot that was claimed has been popped again, so no push is half
+ * done either. sequentially consistent like sq_ring_full(), see sq_ring_claim().
+ */
+int sq_ring_settled(sq_ring_t *r)
+{
+	unsigned long head;
+
+	/* head never passes tail, so if tail is still where head was when we looked, they met then */
+	head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head;
+}
+
+
+/* returns the number of entries in the ring; only a snapshot if others are pushing/popping */
+unsigned int sq_ring_len(sq_ring_t *r)
+{
+	unsigned long head, tail;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	if ((long)(tail - head) <= 0) {
+		return 0;
+	}
+
+	return tail - head > r->mask + 1 ? r->mask + 1 : tail - head;
+}
+
+
+/*
+ * sets up a single producer, single consumer ring with room for at least len entries
+ *
+ * returns the actual capacity of the ring or 0 on memory allocation failure
+ */
+int sq_spsc_init(sq_spsc_t *r, unsigned int len)
+{
+	unsigned long n;
+
+	for (n = 1; n < len; n <<= 1) ;
+
+	if ((r->slots = calloc(n, sizeof(*r->slots))) == NULL) {
+		return 0;
+	}
+
+	r->mask = n - 1;
+	r->head = 0;
+	r->tail = 0;
+	r->head_cache = 0;
+	r->tail_cache = 0;
+	return n;
+}
+
+
+/* frees the slot array; anything still in the ring is the caller's problem */
+void sq_spsc_destroy(sq_spsc_t *r)
+{
+	free(r->slots);
+	r->slots = NULL;
+}
+
+
+/*
+ * adds p to the ring; producer side only
+ * pos, if not NULL, is updated with the position p went in at
+ *
+ * returns 0 on success or -1 if the ring is full
+ */
+int sq_spsc_push(sq_spsc_t *r, void *p, unsigned long *pos)
+{
+	unsigned long tail;
+
+	tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	/* looks full from here, see how far the consumer really got */
+	if (tail - r->head_cache > r->mask) {
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail - r->head_cache > r->mask) {
+			return -1;
+		}
+	}
+
+	r->slots[tail & r->mask] = p;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (pos) {
+		*pos = tail;
+	}
+
+	return 0;
+}
+
+
+/*
+ * removes the oldest entry from the ring; consumer side only
+ *
+ * returns the entry or NULL if the ring is empty
+ */
+void *sq_spsc_pop(sq_spsc_t *r)
+{
+	unsigned long head;
+	void *p;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	/* looks empty from here, see how far the producer really got */
+	if (head == r->tail_cache) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head == r->tail_cache) {
+			return NULL;
+		}
+	}
+
+	p = r->slots[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+
+/* returns the number of entries in the ring; only a snapshot if others are pushing/popping */
+unsigned int sq_spsc_len(sq_spsc_t *r)
+{
+	unsigned long head, tail;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	return tail - head > r->mask + 1 ? r->mask + 1 : tail - head;
+}
+
+
+/*
+ * returns nonzero if the next pop would fail
+ * the loads are sequentially consistent so this can be used to re-check before sleeping
+ */
+int sq_spsc_empty(sq_spsc_t *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+}
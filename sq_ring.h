@@ -0,0 +1,69 @@
+#ifndef _SQ_RING_H_
+#define _SQ_RING_H_
+
+#include "sq_config.h"
+
+/*
+ * bounded lock-free rings used by sq
+ *
+ * sq_ring_t is a multiple producer, multiple consumer ring of pointers. every slot carries a
+ * sequence number which tells producers and consumers whose turn it is to use the slot, so the
+ * only contended operation is a compare-and-swap on head (consumers) or tail (producers).
+ * head and tail sit on cache lines of their own so producers and consumers don't fight over them.
+ * a push can also be done in two steps, sq_ring_claim() and sq_ring_fill(), so a producer can
+ * still back out of a slot it has claimed (by filling it with NULL) without holding anyone up.
+ * consumers skip such slots, and sq_ring_skip() clears them off the head when nobody else will.
+ *
+ * sq_spsc_t is a single producer, single consumer ring. the producer owns tail, the consumer owns
+ * head, and the only atomics used are acquire loads and release stores. each side keeps a cached
+ * copy of the other side's index and only reads the real one (and pulls its cache line over)
+ * when the cached copy says the ring is full/empty.
+ *
+ * capacity is always rounded up to a power of two.
+ */
+
+/* ring slot */
+typedef struct {
+	unsigned long seq;			/* slot sequence number */
+	void *p;				/* what's stored in the slot */
+} sq_ring_slot_t;
+
+
+typedef struct {
+	unsigned long head SQ_ALIGNED;		/* next position to pop from */
+	unsigned long tail SQ_ALIGNED;		/* next position to push to */
+	sq_ring_slot_t *slots SQ_ALIGNED;	/* slot array */
+	unsigned long mask;			/* number of slots - 1 */
+} sq_ring_t;
+
+
+typedef struct {
+	unsigned long head SQ_ALIGNED;		/* next position to pop from, written by the consumer */
+	unsigned long tail_cache;		/* consumer's last look at tail */
+	unsigned long tail SQ_ALIGNED;		/* next position to push to, written by the producer */
+	unsigned long head_cache;		/* producer's last look at head */
+	void **slots SQ_ALIGNED;		/* slot array */
+	unsigned long mask;			/* number of slots - 1 */
+} sq_spsc_t;
+
+
+int sq_ring_init(sq_ring_t *r, unsigned int len);
+void sq_ring_destroy(sq_ring_t *r);
+int sq_ring_push(sq_ring_t *r, void *p, unsigned long *pos);
+int sq_ring_claim(sq_ring_t *r, unsigned long *pos);
+void sq_ring_fill(sq_ring_t *r, unsigned long pos, void *p);
+void *sq_ring_pop(sq_ring_t *r);
+void sq_ring_skip(sq_ring_t *r);
+int sq_ring_full(sq_ring_t *r);
+int sq_ring_empty(sq_ring_t *r);
+int sq_ring_settled(sq_ring_t *r);
+unsigned int sq_ring_len(sq_ring_t *r);
+
+int sq_spsc_init(sq_spsc_t *r, unsigned int len);
+void sq_spsc_destroy(sq_spsc_t *r);
+int sq_spsc_push(sq_spsc_t *r, void *p, unsigned long *pos);
+void *sq_spsc_pop(sq_spsc_t *r);
+unsigned int sq_spsc_len(sq_spsc_t *r);
+int sq_spsc_empty(sq_spsc_t *r);
+
+#endif /* _SQ_RING_H_ */
@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sq.h"
+#include "sq_shm.h"
+#include "sq_wait.h"
+
+#define SQ_SHM_ALIGN(x, a)	(((x) + (a) - 1) & ~((unsigned long long)(a) - 1))
+
+
+/* returns the slot a position lives in */
+static sq_shm_slot_t *sq_shm_slot(sq_shm_t *q, unsigned long long pos)
+{
+	return (sq_shm_slot_t *)(q->base + q->hdr->slots_off + (pos & (q->hdr->slots - 1)) * q->hdr->stride);
+}
+
+
+/*
+ * the previous owner of the mutex died holding it. head and tail are only ever moved once a
+ * push or pop is otherwise complete, so whatever it was doing simply didn't happen and the
+ * queue is fine as it is; just mark the mutex usable again.
+ */
+static void sq_shm_recover(sq_shm_t *q)
+{
+	__atomic_add_fetch(&q->hdr->recoveries, 1, __ATOMIC_RELAXED);
+#ifdef __linux__
+	pthread_mutex_consistent(&q->hdr->mtx);
+#endif
+}
+
+
+/* locks the queue, taking it over from a dead process if need be */
+static int sq_shm_lock(sq_shm_t *q)
+{
+	int ret;
+
+	ret = pthread_mutex_lock(&q->hdr->mtx);
+	if (ret == EOWNERDEAD) {
+		sq_shm_recover(q);
+		ret = 0;
+	}
+
+	return ret ? SQ_ERR_WOULDBLOCK : SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * waits on one of the queue's cond vars, which also hands back the mutex if its owner died
+ *
+ * returns 0 or ETIMEDOUT
+ */
+static int sq_shm_wait(sq_shm_t *q, pthread_cond_t *cond, unsigned long long deadline)
+{
+	int ret;
+
+	ret = sq_cond_timedwait(cond, &q->hdr->mtx, deadline);
+	if (ret == EOWNERDEAD) {
+		sq_shm_recover(q);
+		ret = 0;
+	}
+
+	return ret == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+
+/* maps an open shm fd; returns the new handle or NULL */
+static sq_shm_t *sq_shm_map(int fd, size_t size, unsigned int flags)
+{
+	sq_shm_t *q;
+	void *p;
+
+	if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		return NULL;
+	}
+
+	if ((q = calloc(1, sizeof(*q))) == NULL) {
+		munmap(p, size);
+		return NULL;
+	}
+
+	q->hdr = p;
+	q->base = p;
+	q->size = size;
+	q->fd = fd;
+	q->flags = flags;
+	return q;
+}
+
+
+/*
+ * creates a new shared queue called name (a shm_open() name, so "/something") with room for
+ * slots messages of up to slot_size bytes each. slots is rounded up to a power of two. any
+ * existing queue by that name is replaced; processes that already had it open keep the old
+ * one until they close it.
+ *
+ * flags is SQ_FLAG_NOWAIT or SQ_FLAG_NONE and only applies to this handle.
+ *
+ * returns the queue, or NULL with errno set
+ */
+sq_shm_t *sq_shm_create(const char *name, unsigned int slots, unsigned int slot_size, unsigned int flags)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	unsigned long long stride, slots_off, size;
+	unsigned int n;
+	sq_shm_hdr_t *hdr;
+	sq_shm_t *q;
+	int fd, err;
+
+	for (n = 1; n < slots && n; n <<= 1) ;
+	if (n == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	stride = SQ_SHM_ALIGN(sizeof(sq_shm_slot_t) + slot_size, sizeof(unsigned long long));
+	slots_off = SQ_SHM_ALIGN(sizeof(sq_shm_hdr_t), SQ_CACHELINE);
+	size = slots_off + n * stride;
+
+	shm_unlink(name);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) < 0 || (q = sq_shm_map(fd, size, flags)) == NULL) {
+		err = errno;
+		close(fd);
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+
+	/* the segment comes to us zeroed, so head, tail and the counters are already right */
+	hdr = q->hdr;
+	hdr->version = SQ_SHM_VERSION;
+	hdr->slots = n;
+	hdr->slot_size = slot_size;
+	hdr->size = size;
+	hdr->slots_off = slots_off;
+	hdr->stride = stride;
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+	pthread_mutex_init(&hdr->mtx, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+#if !(defined(__APPLE__) && defined (__MACH__))
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+#endif
+	pthread_cond_init(&hdr->notempty, &cattr);
+	pthread_cond_init(&hdr->notfull, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	/* everything's in place, let anyone else in */
+	__atomic_store_n(&hdr->magic, SQ_SHM_MAGIC, __ATOMIC_RELEASE);
+	return q;
+}
+
+
+/*
+ * returns nonzero if the header's slots fit in the segment the way sq_shm_create() lays them
+ * out, so that sq_shm_slot() and the messages in the slots stay inside the mapping
+ */
+static int sq_shm_geometry_ok(const sq_shm_hdr_t *hdr)
+{
+	unsigned long long align = sizeof(unsigned long long);
+
+	if (hdr->slots == 0 || (hdr->slots & (hdr->slots - 1))) {
+		return 0;
+	}
+
+	if (hdr->slots_off < sizeof(sq_shm_hdr_t) || hdr->slots_off > hdr->size || hdr->slots_off % align) {
+		return 0;
+	}
+
+	if (hdr->stride < sizeof(sq_shm_slot_t) + (unsigned long long)hdr->slot_size || hdr->stride % align) {
+		return 0;
+	}
+
+	/* divided rather than multiplied, so a huge stride can't wrap around */
+	return hdr->stride <= (hdr->size - hdr->slots_off) / hdr->slots;
+}
+
+
+/*
+ * attaches to a shared queue made by sq_shm_create()
+ * flags is SQ_FLAG_NOWAIT or SQ_FLAG_NONE and only applies to this handle.
+ *
+ * returns the queue, or NULL with errno set (EAGAIN if the creator isn't finished with it yet,
+ * EINVAL if it isn't a queue, is from an incompatible version or its slots don't fit)
+ */
+sq_shm_t *sq_shm_open(const char *name, unsigned int flags)
+{
+	struct stat st;
+	sq_shm_hdr_t *hdr;
+	sq_shm_t *q;
+	int fd, err;
+
+	if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+		return NULL;
+	}
+
+	err = EAGAIN;
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		goto fail;
+	}
+
+	if ((size_t)st.st_size < sizeof(sq_shm_hdr_t)) {
+		goto fail;
+	}
+
+	if ((q = sq_shm_map(fd, st.st_size, flags)) == NULL) {
+		err = errno;
+		goto fail;
+	}
+
+	hdr = q->hdr;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SQ_SHM_MAGIC) {
+		sq_shm_close(q);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	if (hdr->version != SQ_SHM_VERSION || hdr->size != (unsigned long long)st.st_size || !sq_shm_geometry_ok(hdr)) {
+		sq_shm_close(q);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return q;
+
+fail:
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+
+/* detaches from a shared queue; the queue itself lives on until it's unlinked and everyone has closed it */
+void sq_shm_close(sq_shm_t *q)
+{
+	if (q == NULL) {
+		return;
+	}
+
+	munmap(q->base, q->size);
+	close(q->fd);
+	free(q);
+}
+
+
+/* removes a shared queue's name; returns 0 or -1 with errno set */
+int sq_shm_unlink(const char *name)
+{
+	return shm_unlink(name);
+}
+
+
+/* copies a message into the queue, waiting for room until the deadline (0 = forever) */
+static int sq_shm_push_deadline(sq_shm_t *q, const void *data, unsigned int len, unsigned long long deadline)
+{
+	sq_shm_hdr_t *hdr = q->hdr;
+	sq_shm_slot_t *slot;
+
+	if (len > hdr->slot_size) {
+		return SQ_ERR_NOMEM;
+	}
+
+	if (sq_shm_lock(q) != SQ_ERR_NO_ERROR) {
+		return SQ_ERR_WOULDBLOCK;
+	}
+
+	while (hdr->tail - hdr->head >= hdr->slots) {
+		if (q->flags & SQ_FLAG_NOWAIT) {
+			pthread_mutex_unlock(&hdr->mtx);
+			return SQ_ERR_FULL;
+		}
+
+		hdr->nf_waiters++;
+		if (sq_shm_wait(q, &hdr->notfull, deadline) == ETIMEDOUT && hdr->tail - hdr->head >= hdr->slots) {
+			hdr->nf_waiters--;
+			pthread_mutex_unlock(&hdr->mtx);
+			return SQ_ERR_TIMEOUT;
+		}
+		hdr->nf_waiters--;
+	}
+
+	slot = sq_shm_slot(q, hdr->tail);
+	memcpy(slot + 1, data, len);
+	slot->len = len;
+
+	/* the message is only really on the queue once tail moves */
+	__atomic_store_n(&hdr->tail, hdr->tail + 1, __ATOMIC_RELEASE);
+
+	/* broadcast, not signal: a woken consumer that dies before popping mustn't strand the rest */
+	if (hdr->ne_waiters) {
+		pthread_cond_broadcast(&hdr->notempty);
+	}
+
+	pthread_mutex_unlock(&hdr->mtx);
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * copies a message of len bytes onto the queue
+ * waits for room if the queue is full, unless the handle has SQ_FLAG_NOWAIT
+ *
+ * returns SQ_ERR_NO_ERROR, SQ_ERR_FULL, or SQ_ERR_NOMEM if the message is bigger than a slot
+ */
+int sq_shm_push(sq_shm_t *q, const void *data, unsigned int len)
+{
+	return sq_shm_push_deadline(q, data, len, 0);
+}
+
+
+/* as sq_shm_push(), but gives up and returns SQ_ERR_TIMEOUT if the queue is still full after timeout_ns */
+int sq_shm_push_timed(sq_shm_t *q, const void *data, unsigned int len, unsigned long long timeout_ns)
+{
+	return sq_shm_push_deadline(q, data, len, sq_now_ns() + timeout_ns);
+}
+
+
+/* copies the next message out of the queue, optionally waiting for one until the deadline (0 = forever) */
+static int sq_shm_pop_deadline(sq_shm_t *q, void *buf, unsigned int size, unsigned int *len, int wait, unsigned long long deadline)
+{
+	sq_shm_hdr_t *hdr = q->hdr;
+	sq_shm_slot_t *slot;
+
+	if (sq_shm_lock(q) != SQ_ERR_NO_ERROR) {
+		return SQ_ERR_WOULDBLOCK;
+	}
+
+	while (hdr->head == hdr->tail) {
+		if (!wait) {
+			pthread_mutex_unlock(&hdr->mtx);
+			return SQ_ERR_EMPTY;
+		}
+
+		hdr->ne_waiters++;
+		if (sq_shm_wait(q, &hdr->notempty, deadline) == ETIMEDOUT && hdr->head == hdr->tail) {
+			hdr->ne_waiters--;
+			pthread_mutex_unlock(&hdr->mtx);
+			return SQ_ERR_TIMEOUT;
+		}
+		hdr->ne_waiters--;
+	}
+
+	slot = sq_shm_slot(q, hdr->head);
+	*len = slot->len;
+	if (slot->len > size) {
+		pthread_mutex_unlock(&hdr->mtx);
+		return SQ_ERR_NOMEM;
+	}
+
+	memcpy(buf, slot + 1, slot->len);
+	__atomic_store_n(&hdr->head, hdr->head + 1, __ATOMIC_RELEASE);
+
+	if (hdr->nf_waiters) {
+		pthread_cond_broadcast(&hdr->notfull);
+	}
+
+	pthread_mutex_unlock(&hdr->mtx);
+	return SQ_ERR_NO_ERROR;
+}
+
+
+/*
+ * copies the next message on the queue into buf (size bytes long) and sets *len to its length
+ *
+ * returns SQ_ERR_NO_ERROR, SQ_ERR_EMPTY, or SQ_ERR_NOMEM if buf is too small (*len is
+ * still set, and the message stays on the queue)
+ */
+int sq_shm_pop(sq_shm_t *q, void *buf, unsigned int size, unsigned int *len)
+{
+	return sq_shm_pop_deadline(q, buf, size, len, 0, 0);
+}
+
+
+/* as sq_shm_pop(), but waits for a message if the queue is empty */
+int sq_shm_pop_wait(sq_shm_t *q, void *buf, unsigned int size, unsigned int *len)
+{
+	return sq_shm_pop_deadline(q, buf, size, len, 1, 0);
+}
+
+
+/* as sq_shm_pop_wait(), but gives up and returns SQ_ERR_TIMEOUT after timeout_ns */
+int sq_shm_pop_timed(sq_shm_t *q, void *buf, unsigned int size, unsigned int *len, unsigned long long timeout_ns)
+{
+	return sq_shm_pop_deadline(q, buf, size, len, 1, sq_now_ns() + timeout_ns);
+}
+
+
+/* returns the number of messages on the queue, which may already be out of date */
+unsigned int sq_shm_len(sq_shm_t *q)
+{
+	unsigned long long head;
+
+	head = __atomic_load_n(&q->hdr->head, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&q->hdr->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+
+/* returns the number of times the queue's lock has been taken over from a process that died holding it */
+unsigned long long sq_shm_recoveries(sq_shm_t *q)
+{
+	return __atomic_load_n(&q->hdr->recoveries, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,85 @@
+#ifndef _SQ_SHM_H_
+#define _SQ_SHM_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * cross-process queues in shared memory
+ *
+ * sq_t can't be shared between processes since it's full of heap pointers. sq_shm_t is a
+ * bounded queue of byte messages that lives entirely in a shm_open() segment, so producers
+ * and consumers can be separate processes on the same host. one process creates the queue
+ * with sq_shm_create(), the others attach to it by name with sq_shm_open().
+ *
+ * there are no pointers in the segment: messages are copied into fixed size slots which are
+ * found by their offset from the start of the segment, so every process can map it wherever
+ * it likes. the queue is protected by a process-shared mutex and process-shared cond vars.
+ *
+ * on Linux the mutex is robust: if a process dies while holding it, the next process to lock
+ * it takes it over and carries on. a push or pop only becomes visible when head or tail is
+ * updated, which is the last thing done under the lock, so a peer dying half way through
+ * leaves the queue exactly as it was before that push or pop started. sq_shm_recoveries()
+ * says how many times that has happened.
+ *
+ * pushes block while the queue is full unless the handle was created or opened with
+ * SQ_FLAG_NOWAIT, in which case they return SQ_ERR_FULL. a message bigger than the slot size
+ * can't be pushed (SQ_ERR_NOMEM), and a pop into a buffer that's too small returns
+ * SQ_ERR_NOMEM with *len set to the size needed, leaving the message on the queue.
+ *
+ * return values are the same SQ_ERR codes sq uses.
+ */
+
+#define SQ_SHM_MAGIC		0x73717368	/* "sqsh" */
+#define SQ_SHM_VERSION		1
+
+/* segment header, at offset 0 of the segment. everything after it is slots */
+typedef struct {
+	unsigned int magic;			/* SQ_SHM_MAGIC once the creator has finished setting up */
+	unsigned int version;			/* SQ_SHM_VERSION */
+	unsigned int slots;			/* number of slots, a power of two */
+	unsigned int slot_size;			/* largest message a slot will hold */
+	unsigned long long size;		/* size of the whole segment */
+	unsigned long long slots_off;		/* offset of the first slot */
+	unsigned long long stride;		/* distance between slots */
+
+	pthread_mutex_t mtx;			/* process-shared, robust where possible */
+	pthread_cond_t notempty;		/* pop_wait() sleeps on this */
+	pthread_cond_t notfull;			/* push() sleeps on this */
+	unsigned int ne_waiters;		/* processes sleeping on notempty */
+	unsigned int nf_waiters;		/* processes sleeping on notfull */
+
+	unsigned long long head;		/* next message to pop */
+	unsigned long long tail;		/* next slot to push to */
+	unsigned long long recoveries;		/* times the mutex was taken over from a dead process */
+} sq_shm_hdr_t;
+
+/* slot header, the message follows */
+typedef struct {
+	unsigned int len;			/* message length */
+	unsigned int pad;
+} sq_shm_slot_t;
+
+/* a process' handle on a shared queue */
+typedef struct {
+	sq_shm_hdr_t *hdr;			/* mapped segment */
+	unsigned char *base;			/* same, for offset arithmetic */
+	size_t size;				/* mapped size */
+	int fd;					/* shm fd */
+	unsigned int flags;			/* SQ_FLAG_NOWAIT or nothing */
+} sq_shm_t;
+
+
+sq_shm_t *sq_shm_create(const char *name, unsigned int slots, unsigned int slot_size, unsigned int flags);
+sq_shm_t *sq_shm_open(const char *name, unsigned int flags);
+void sq_shm_close(sq_shm_t *q);
+int sq_shm_unlink(const char *name);
+int sq_shm_push(sq_shm_t *q, const void *data, unsigned int len);
+int sq_shm_push_timed(sq_shm_t *q, const void *data, unsigned int len, unsigned long long timeout_ns);
+int sq_shm_pop(sq_shm_t *q, void *buf, unsigned int size, unsigned int *len);
+int sq_shm_pop_wait(sq_shm_t *q, void *buf, unsigned int size, unsigned int *len);
+int sq_shm_pop_timed(sq_shm_t *q, void *buf, unsigned int size, unsigned int *len, unsigned long long timeout_ns);
+unsigned int sq_shm_len(sq_shm_t *q);
+unsigned long long sq_shm_recoveries(sq_shm_t *q);
+
+#endif /* _SQ_SHM_H_ */
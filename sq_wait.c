@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#endif
+
+#include "sq_wait.h"
+
+/* returns the current CLOCK_MONOTONIC time in nsec */
+unsigned long long sq_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* initializes a cond var whose timed waits are measured against CLOCK_MONOTONIC (if possible) */
+void sq_cond_init(pthread_cond_t *cond)
+{
+#if defined(__APPLE__) && defined (__MACH__)
+	pthread_cond_init(cond, NULL);
+#else
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+#endif
+}
+
+
+/*
+ * waits on a cond var set up by sq_cond_init() until it is signalled or the deadline passes
+ *
+ * returns 0 or ETIMEDOUT
+ */
+int sq_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mtx, unsigned long long deadline)
+{
+	struct timespec ts;
+
+	if (deadline == 0) {
+		return pthread_cond_wait(cond, mtx);
+	}
+
+#if defined(__APPLE__) && defined (__MACH__)
+	/* no CLOCK_MONOTONIC cond vars here, so turn the deadline into wall clock time */
+	{
+		unsigned long long now = sq_now_ns();
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		deadline = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec + (deadline > now ? deadline - now : 0);
+	}
+#endif
+
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	return pthread_cond_timedwait(cond, mtx, &ts);
+}
+
+
+#ifdef __linux__
+
+/*
+ * sleeps while *addr == val, until woken up or the deadline passes
+ * can return early for no reason at all, so callers must re-check whatever they're waiting for
+ *
+ * returns 0 or ETIMEDOUT
+ */
+int sq_futex_wait(unsigned int *addr, unsigned int val, unsigned long long deadline)
+{
+	struct timespec ts, *tsp = NULL;
+
+	if (deadline) {
+		unsigned long long now = sq_now_ns();
+
+		if (now >= deadline) {
+			return ETIMEDOUT;
+		}
+
+		/* FUTEX_WAIT wants a relative timeout */
+		ts.tv_sec = (deadline - now) / 1000000000ULL;
+		ts.tv_nsec = (deadline - now) % 1000000000ULL;
+		tsp = &ts;
+	}
+
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0) < 0 && errno == ETIMEDOUT) {
+		return ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+
+/* wakes up to n threads sleeping on addr */
+void sq_futex_wake(unsigned int *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#else
+
+static pthread_mutex_t futex_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t futex_cond;
+static pthread_once_t futex_once = PTHREAD_ONCE_INIT;
+
+static void futex_init(void)
+{
+	sq_cond_init(&futex_cond);
+}
+
+
+/* no futexes: everyone shares one cond var and re-checks their own word when woken */
+int sq_futex_wait(unsigned int *addr, unsigned int val, unsigned long long deadline)
+{
+	int ret = 0;
+
+	pthread_once(&futex_once, futex_init);
+	pthread_mutex_lock(&futex_mtx);
+	if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) {
+		ret = sq_cond_timedwait(&futex_cond, &futex_mtx, deadline);
+	}
+	pthread_mutex_unlock(&futex_mtx);
+
+	return ret == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+
+void sq_futex_wake(unsigned int *addr, int n)
+{
+	pthread_once(&futex_once, futex_init);
+	pthread_mutex_lock(&futex_mtx);
+	pthread_cond_broadcast(&futex_cond);
+	pthread_mutex_unlock(&futex_mtx);
+}
+
+#endif
+
+
+#define SQ_MEMBARRIER_UNKNOWN	0		/* sq_membarrier_state: not checked yet */
+#define SQ_MEMBARRIER_OFF	1		/* not supported, or registering failed */
+#define SQ_MEMBARRIER_ON	2		/* registered for MEMBARRIER_CMD_PRIVATE_EXPEDITED */
+
+static int sq_membarrier_state = SQ_MEMBARRIER_UNKNOWN;
+
+
+/* returns nonzero if sq_membarrier() works; checked (and registered for) once */
+int sq_membarrier_usable(void)
+{
+	int state;
+
+	if ((state = __atomic_load_n(&sq_membarrier_state, __ATOMIC_ACQUIRE)) == SQ_MEMBARRIER_UNKNOWN) {
+		state = SQ_MEMBARRIER_OFF;
+#if defined(__linux__) && defined(SYS_membarrier)
+		{
+			long cmds = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0);
+
+			if (cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+			    syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+				state = SQ_MEMBARRIER_ON;
+			}
+		}
+#endif
+		__atomic_store_n(&sq_membarrier_state, state, __ATOMIC_RELEASE);
+	}
+
+	return state == SQ_MEMBARRIER_ON;
+}
+
+
+/* puts every running thread of the process through a full memory barrier; sq_membarrier_usable() must be true */
+void sq_membarrier(void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+	syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+#endif
+}
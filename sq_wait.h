@@ -0,0 +1,41 @@
+#ifndef _SQ_WAIT_H_
+#define _SQ_WAIT_H_
+
+/*
+ * waiting helpers used by sq
+ *
+ * all times are CLOCK_MONOTONIC nanoseconds. a deadline of 0 means wait forever.
+ *
+ * sq_futex_wait() sleeps as long as *addr still holds val, sq_futex_wake() wakes up to n
+ * sleepers on addr. on Linux these are real futexes; elsewhere they're emulated with a
+ * mutex and cond var that are shared by everyone, which works but wakes up more than needed.
+ *
+ * sq_membarrier() makes every running thread of the process go through a full memory barrier,
+ * so a rarely taken slow path can pair with a fast path that only has a compiler barrier in it
+ * (Linux membarrier(2)). sq_membarrier_usable() says whether it works here; where it doesn't,
+ * the fast path has to pay for a real fence.
+ *
+ * sq_cpu_relax() goes in the body of a busy-wait loop: it tells the core we're spinning (x86
+ * pause, arm yield), which saves power and lets the other hyperthread have the pipeline.
+ */
+
+unsigned long long sq_now_ns(void);
+void sq_cond_init(pthread_cond_t *cond);
+int sq_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mtx, unsigned long long deadline);
+int sq_futex_wait(unsigned int *addr, unsigned int val, unsigned long long deadline);
+void sq_futex_wake(unsigned int *addr, int n);
+int sq_membarrier_usable(void);
+void sq_membarrier(void);
+
+static inline void sq_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+#endif /* _SQ_WAIT_H_ */
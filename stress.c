@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "barrier.h"
+#include "sq.h"
+#include "sq_journal.h"
+
+/*
+ * sq stress test, run by `make test`
+ * hammers every queue mode with as many producers and consumers as it allows and checks that
+ * nothing is lost, nothing comes out twice, and every consumer sees each producer's elements in
+ * the order they were pushed. then it does the same across an sq_close() in the middle of a
+ * run, with the consumers still popping and with sq_drain() picking up what's left, and
+ * finally crashes and recovers a journal, torn record and all. exits non-zero on any failure.
+ *
+ * usage: sq_stress [-n msgs] [-j path]
+ *     -n msgs    messages per producer (default 50000)
+ *     -j path    journal file to use, it's deleted afterwards (default sq_stress.jnl)
+ */
+
+#define STRESS_MSGS		50000
+#define STRESS_MAXLEN		64		/* small, so the queues fill up and wrap all the time */
+#define STRESS_THREADS		4
+#define STRESS_JOURNAL_MSGS	1000
+#define STRESS_POP_NS		(1000 * 1000ULL)	/* how long consumers wait before checking for the end of a run */
+
+/* queue modes to run */
+static const struct {
+	const char *name;
+	unsigned int flags;
+	unsigned int producers;
+	unsigned int consumers;
+} modes[] = {
+	{ "list",	SQ_FLAG_NONE,			STRESS_THREADS,	STRESS_THREADS },
+	{ "list+pool",	SQ_FLAG_POOL,			STRESS_THREADS,	STRESS_THREADS },
+	{ "ring",	SQ_FLAG_RING,			STRESS_THREADS,	STRESS_THREADS },
+	{ "ring+pool",	SQ_FLAG_RING | SQ_FLAG_POOL,	STRESS_THREADS,	STRESS_THREADS },
+	{ "spsc",	SQ_FLAG_SPSC,			1,		1 },
+	{ "spsc+pool",	SQ_FLAG_SPSC | SQ_FLAG_POOL,	1,		1 },
+	{ "mpsc",	SQ_FLAG_MPSC,			STRESS_THREADS,	1 },
+};
+
+#define NUM(a)			(sizeof(a) / sizeof((a)[0]))
+
+/* one run */
+typedef struct {
+	sq_t *q;
+	unsigned int producers, consumers;
+	unsigned int msgs;			/* most messages per producer */
+	pthread_barrier_t start;
+	unsigned char *seen;			/* times each message was popped, producer * msgs + seq */
+	unsigned int pushed[STRESS_THREADS];	/* messages each producer got in */
+	unsigned long long popped;		/* messages popped, all consumers */
+	int closing;				/* the run ends with sq_close(), not after msgs */
+	int stop;				/* set once every producer is done */
+	int failed;
+} run_t;
+
+/* per-thread state */
+typedef struct {
+	run_t *r;
+	pthread_t tid;
+	unsigned int id;
+} worker_t;
+
+
+/* messages are pointer payloads numbered from 1, so none of them is NULL */
+static void *msg_data(run_t *r, unsigned int p, unsigned int seq)
+{
+	return (void *)(uintptr_t)((unsigned long)p * r->msgs + seq + 1);
+}
+
+
+/*
+ * books a popped message: it must not have been seen before, and must come after the last one
+ * this consumer saw from the same producer. last has a slot per producer, -1 to start with.
+ */
+static void msg_check(run_t *r, void *data, long *last, const char *who)
+{
+	unsigned long n = (uintptr_t)data - 1;
+	unsigned int p = n / r->msgs, seq = n % r->msgs;
+
+	if (p >= r->producers) {
+		fprintf(stderr, "%s: bogus message %lu\n", who, n);
+		r->failed = 1;
+		return;
+	}
+
+	if (__atomic_fetch_add(&r->seen[n], 1, __ATOMIC_RELAXED)) {
+		fprintf(stderr, "%s: producer %u message %u popped twice\n", who, p, seq);
+		r->failed = 1;
+	}
+
+	if ((long)seq <= last[p]) {
+		fprintf(stderr, "%s: producer %u message %u after %ld\n", who, p, seq, last[p]);
+		r->failed = 1;
+	}
+
+	last[p] = seq;
+	__atomic_add_fetch(&r->popped, 1, __ATOMIC_RELAXED);
+}
+
+
+/* pushes r->msgs messages, or until the queue is closed */
+static void *producer(void *arg)
+{
+	worker_t *w = arg;
+	run_t *r = w->r;
+	unsigned int i;
+	sq_elem_t e;
+	int ret;
+
+	memset(&e, 0, sizeof(e));
+	pthread_barrier_wait(&r->start);
+
+	for (i = 0; i < r->msgs; i++) {
+		e.data = msg_data(r, w->id, i);
+		while ((ret = sq_push(r->q, &e)) == SQ_ERR_WOULDBLOCK || ret == SQ_ERR_FULL) {
+			sched_yield();
+		}
+
+		if (ret == SQ_ERR_CLOSED) {
+			break;
+		}
+
+		if (ret != SQ_ERR_NO_ERROR) {
+			fprintf(stderr, "producer %u: push returned %d\n", w->id, ret);
+			r->failed = 1;
+			break;
+		}
+	}
+
+	r->pushed[w->id] = i;
+	return NULL;
+}
+
+
+/* pops until the producers are done and the queue is empty, or until it's been closed and emptied */
+static void *consumer(void *arg)
+{
+	worker_t *w = arg;
+	run_t *r = w->r;
+	long last[STRESS_THREADS];
+	sq_elem_t *e;
+	int ret;
+
+	memset(last, 0xff, sizeof(last));
+	pthread_barrier_wait(&r->start);
+
+	for (;;) {
+		if (r->closing) {
+			ret = sq_pop_wait(r->q, &e);
+
+		} else {
+			ret = sq_pop_timed(r->q, &e, STRESS_POP_NS);
+
+			/* the producers are done, and once the queue is empty so are we */
+			if (ret != SQ_ERR_NO_ERROR && __atomic_load_n(&r->stop, __ATOMIC_ACQUIRE) && (ret = sq_pop(r->q, &e)) == SQ_ERR_EMPTY) {
+				break;
+			}
+		}
+
+		if (ret == SQ_ERR_CLOSED) {
+			break;
+		}
+
+		if (ret != SQ_ERR_NO_ERROR) {
+			continue;
+		}
+
+		msg_check(r, e->data, last, "consumer");
+		sq_elem_release(e);
+	}
+
+	return NULL;
+}
+
+
+/* every message that was pushed must have been popped exactly once, and nothing else */
+static void run_verify(run_t *r, const char *name)
+{
+	unsigned long long total = 0;
+	unsigned int p, i;
+
+	for (p = 0; p < r->producers; p++) {
+		total += r->pushed[p];
+		for (i = 0; i < r->msgs; i++) {
+			if (r->seen[p * r->msgs + i] != (i < r->pushed[p])) {
+				fprintf(stderr, "%s: producer %u message %u popped %u times, %u pushed\n", name, p, i, r->seen[p * r->msgs + i], r->pushed[p]);
+				r->failed = 1;
+				break;
+			}
+		}
+	}
+
+	if (r->popped != total) {
+		fprintf(stderr, "%s: pushed %llu, popped %llu\n", name, total, r->popped);
+		r->failed = 1;
+	}
+
+	if (sq_len(r->q)) {
+		fprintf(stderr, "%s: %u left in the queue\n", name, sq_len(r->q));
+		r->failed = 1;
+	}
+}
+
+
+/*
+ * one run of a mode. how:
+ *     0 - producers push msgs each, consumers pop until they're done
+ *     1 - the queue is closed part way, consumers pop until SQ_ERR_CLOSED
+ *     2 - there are no consumers; the queue is closed once it's full and sq_drain()'d
+ */
+static int run(unsigned int mode, unsigned int msgs, int how)
+{
+	static const char *hows[] = { "run", "close", "drain" };
+	worker_t w[2 * STRESS_THREADS];
+	long last[STRESS_THREADS];
+	unsigned int i, n, nw;
+	sq_elem_t *e, *next;
+	run_t r;
+
+	memset(&r, 0, sizeof(r));
+	r.producers = modes[mode].producers;
+	r.consumers = how == 2 ? 0 : modes[mode].consumers;
+	r.msgs = msgs;
+	r.closing = how != 0;
+
+	if ((r.q = sq_init(modes[mode].name, NULL, STRESS_MAXLEN, modes[mode].flags)) == NULL ||
+	    (r.seen = calloc(r.producers, msgs)) == NULL) {
+		fprintf(stderr, "%s: no memory\n", modes[mode].name);
+		return 1;
+	}
+
+	nw = r.producers + r.consumers;
+	pthread_barrier_init(&r.start, NULL, nw + 1);
+
+	for (i = 0; i < nw; i++) {
+		w[i].r = &r;
+		w[i].id = i < r.producers ? i : i - r.producers;
+		pthread_create(&w[i].tid, NULL, i < r.producers ? producer : consumer, &w[i]);
+	}
+
+	pthread_barrier_wait(&r.start);
+
+	/* close once about half the messages are through, or once the queue has filled up */
+	if (how == 1) {
+		while (__atomic_load_n(&r.popped, __ATOMIC_RELAXED) < (unsigned long long)r.producers * msgs / 2) {
+			sched_yield();
+		}
+
+		sq_close(r.q);
+
+	} else if (how == 2) {
+		while (sq_len(r.q) < STRESS_MAXLEN) {
+			sched_yield();
+		}
+
+		sq_close(r.q);
+	}
+
+	for (i = 0; i < r.producers; i++) {
+		pthread_join(w[i].tid, NULL);
+	}
+
+	__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+	for (; i < nw; i++) {
+		pthread_join(w[i].tid, NULL);
+	}
+
+	/* the drained chain is in queue order, so it's one consumer's view */
+	if (how == 2) {
+		memset(last, 0xff, sizeof(last));
+		sq_drain(r.q, &e, &n);
+		for (; e; e = next) {
+			next = e->next;
+			msg_check(&r, e->data, last, "drain");
+			sq_elem_release(e);
+		}
+	}
+
+	run_verify(&r, modes[mode].name);
+	printf("%-10s %-6s %ux%u: %s, %llu messages\n", modes[mode].name, hows[how], r.producers, r.consumers, r.failed ? "FAIL" : "ok", r.popped);
+
+	pthread_barrier_destroy(&r.start);
+	sq_destroy(r.q);
+	free(r.seen);
+	return r.failed;
+}
+
+
+/* pops n messages off a journal queue, which must be numbered first, first + 1, ... */
+static int journal_pop(sq_t *q, unsigned int first, unsigned int n)
+{
+	unsigned int i, v, len;
+	sq_elem_t *e;
+
+	for (i = 0; i < n; i++) {
+		if (sq_pop(q, &e) != SQ_ERR_NO_ERROR) {
+			fprintf(stderr, "journal: only %u of %u popped\n", i, n);
+			return 1;
+		}
+
+		memcpy(&v, e->data, sizeof(v));
+		len = e->dlen;
+		sq_elem_release(e);
+
+		if (len != sizeof(v) || v != first + i) {
+			fprintf(stderr, "journal: popped %u, expected %u\n", v, first + i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * pushes to a journal queue, pops some, and "crashes" by destroying it, which leaves the
+ * records behind. the reopened queue must start out with exactly the ones that weren't popped.
+ * then one of them is torn in the file, and recovery must stop right before it.
+ */
+static int journal(const char *path)
+{
+	unsigned long long pos, off;
+	unsigned int i, len, popped, torn;
+	sq_elem_t e;
+	sq_attr_t attr;
+	int failed, fd;
+	char c;
+	sq_t *q;
+	void *p;
+
+	unlink(path);
+	sq_attr_init(&attr);
+	attr.journal = path;
+	attr.journal_sync = SQ_JOURNAL_SYNC_BATCH;
+
+	if ((q = sq_init_attr("journal", NULL, STRESS_JOURNAL_MSGS, SQ_FLAG_JOURNAL, &attr)) == NULL) {
+		fprintf(stderr, "journal: can't open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.dlen = sizeof(i);
+	e.flags = SQ_FLAG_VOLATILE;
+	for (i = 0; i < STRESS_JOURNAL_MSGS; i++) {
+		e.data = &i;
+		if (sq_push(q, &e) != SQ_ERR_NO_ERROR) {
+			fprintf(stderr, "journal: push %u failed\n", i);
+			sq_destroy(q);
+			return 1;
+		}
+	}
+
+	popped = STRESS_JOURNAL_MSGS / 3;
+	failed = journal_pop(q, 0, popped);
+	sq_destroy(q);
+
+	/* everything that wasn't popped comes back */
+	if (failed || (q = sq_init_attr("journal", NULL, STRESS_JOURNAL_MSGS, SQ_FLAG_JOURNAL, &attr)) == NULL) {
+		return 1;
+	}
+
+	if (sq_len(q) != STRESS_JOURNAL_MSGS - popped) {
+		fprintf(stderr, "journal: recovered %u, expected %u\n", sq_len(q), STRESS_JOURNAL_MSGS - popped);
+		failed = 1;
+	}
+
+	/* find where a record half way through the rest lives in the file */
+	torn = (STRESS_JOURNAL_MSGS - popped) / 2;
+	for (pos = 0, i = 0; (p = sq_journal_recover(q->journal, &pos, &len)) && i < torn; i++) ;
+	off = (unsigned char *)p - (unsigned char *)q->journal->hdr;
+	sq_destroy(q);
+
+	if (p == NULL || (fd = open(path, O_RDWR)) < 0 || pread(fd, &c, 1, off) != 1) {
+		fprintf(stderr, "journal: can't get at record %u\n", torn);
+		return 1;
+	}
+
+	c ^= 0x5a;
+	if (pwrite(fd, &c, 1, off) != 1) {
+		failed = 1;
+	}
+	close(fd);
+
+	if ((q = sq_init_attr("journal", NULL, STRESS_JOURNAL_MSGS, SQ_FLAG_JOURNAL, &attr)) == NULL) {
+		return 1;
+	}
+
+	if (sq_len(q) != torn) {
+		fprintf(stderr, "journal: recovered %u past a torn record, expected %u\n", sq_len(q), torn);
+		failed = 1;
+	}
+
+	failed |= journal_pop(q, popped, sq_len(q) < torn ? sq_len(q) : torn);
+	sq_destroy(q);
+	unlink(path);
+
+	printf("%-10s %-6s: %s, %u recovered, %u past a torn record\n", "journal", "crash", failed ? "FAIL" : "ok", STRESS_JOURNAL_MSGS - popped, torn);
+	return failed;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *path = "sq_stress.jnl";
+	unsigned int msgs = STRESS_MSGS, m;
+	int opt, how, failed = 0;
+
+	while ((opt = getopt(argc, argv, "n:j:")) != -1) {
+		switch (opt) {
+		case 'n':
+			msgs = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'j':
+			path = optarg;
+			break;
+
+		default:
+			fprintf(stderr, "usage: %s [-n msgs] [-j path]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (msgs < 2 * STRESS_MAXLEN) {
+		msgs = 2 * STRESS_MAXLEN;
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for (how = 0; how < 3; how++) {
+		for (m = 0; m < NUM(modes); m++) {
+			failed |= run(m, msgs, how);
+		}
+	}
+
+	failed |= journal(path);
+
+	printf("%s\n", failed ? "FAILED" : "all ok");
+	return failed;
+}
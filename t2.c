@@ -18,6 +18,24 @@ void t2_subscribe(sq_t *q)
 }
 
 
+/* closes this thread's queue, the thread returns once it has handled what's left in it */
+void t2_close(void)
+{
+	sq_close(td.q);
+}
+
+
+/* frees this thread's queue and subscriber list, once none of the threads are running */
+void t2_cleanup(void)
+{
+	while (td.list) {
+		td.list = sq_list_remove(&td.list, td.list->q);
+	}
+
+	sq_destroy(td.q);
+}
+
+
 /* thread 2 listens to messages from thread 1 */
 void *thread2(void *arg)
 {
@@ -26,11 +44,8 @@ void *thread2(void *arg)
 
 	memset(&td, 0, sizeof(td));
 	td.name = THREAD_NAME;
-	pthread_mutex_init(&td.nd_mtx, NULL);
-	pthread_cond_init(&td.newdata, NULL);
 
 	td.q = sq_init(THREAD_NAME, NULL, 64, SQ_FLAG_NONE);
-	sq_add_listener(td.q, &td.newdata);
 
 	/* wait for all threads to start up */
 	pthread_barrier_wait((pthread_barrier_t *)arg);